@@ -30,11 +30,13 @@
    - interpolation (cubic, catmullrom)
    - quaternion basics
    - matrix (projection, transformation...)
-   - random number generator
+   - batch transforms on SoA arrays (SSE, AVX)
+   - random number generators (per stream xoshiro128++, 8 numbers per step)
    - 2d routines
    - 3d routines:
       - voxeliser (tri-box overlap)
       - raytracing (sphere, plane, box, triangle)
+      - raytracing packets (one ray, 4/8 primitives at once) and a box bvh
    
    to create the implementation,
    #define M_MATH_IMPLEMENTATION
@@ -54,6 +56,10 @@ extern "C" {
 #define MMAPI extern
 #endif
 
+#ifndef __OPENCL_VERSION__
+#include <stddef.h>
+#endif
+
 /* basic math */
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -144,11 +150,32 @@ typedef struct {float x, y, z;} float3; /* float3 (doesn't exist in opencl) */
 /* basic math */
 MMAPI unsigned int m_next_power_of_two(unsigned int x);
 
-/* rand (Marsaglia MWC generator) */
+/* rand: one global generator, not thread safe (m_rng wrapper) */
 MMAPI void m_srand(unsigned int z, unsigned int w);
 MMAPI unsigned int m_rand(void);
 MMAPI float m_randf(void); /* (0 - 1) range */
 
+/* rng: generator objects, one per thread or stream (xoshiro128++)
+   - 8 interleaved lanes, stepped together: SSE2 or AVX2 when available
+   - the sequence only depends on seed and stream, not on simd or on how it is read
+   - same seed with different streams gives independent sequences: stream k
+     starts k * 2^96 steps into the seed's sequence and its lanes are 2^64
+     steps apart, so nothing overlaps before 2^64 numbers per lane
+   - seeding jumps ahead and takes a few microseconds, seed once per stream */
+#define M_RNG_LANES 8
+
+typedef struct {
+   unsigned int s[4][M_RNG_LANES];
+   unsigned int out[M_RNG_LANES]; /* last step, handed out one by one */
+   int pos;
+} m_rng;
+
+MMAPI void m_rng_seed(m_rng *rng, unsigned int seed, unsigned int stream);
+MMAPI unsigned int m_rng_next(m_rng *rng);
+MMAPI float m_rng_nextf(m_rng *rng); /* [0 - 1) range, 24 bits */
+MMAPI void m_rng_fill(m_rng *rng, unsigned int *dest, int count);
+MMAPI void m_rng_fillf(m_rng *rng, float *dest, int count); /* [0 - 1) range, 24 bits */
+
 /* interpolation */
 MMAPI float m_interpolation_cubic(float y0, float y1, float y2, float y3, float mu);
 MMAPI float m_interpolation_catmullrom(float y0, float y1, float y2, float y3, float mu);
@@ -184,6 +211,25 @@ MMAPI void m_mat4_rotate3(float3 *dest, const float *matrix, const float3 *src);
 MMAPI void m_mat4_inverse_rotate3(float3 *dest, const float *matrix, const float3 *src);
 MMAPI void m_mat4_transform3(float3 *dest, const float *matrix, const float3 *src);
 MMAPI void m_mat4_transform4(float4 *dest, const float *matrix, const float4 *src);
+MMAPI void m_mat4_frustum_planes(float4 *planes, const float *matrix); /* 6 planes (left, right, bottom, top, near, far) of a view-projection, normalized, facing inside */
+
+/* batch
+   - positions as separate x, y, z (and w) arrays; dest arrays may be the src arrays
+   - w can be NULL for points (w = 1)
+   - m_mat4_mul_batch: dest[i] = A * B[i], 16 floats each; dest may be B
+   - any alignment works, M_SIMD_ALIGN is faster on older cpus
+   - SSE on x86, AVX if compiled with it (-mavx), define M_NO_SIMD for plain C
+   - same results as the single functions, unless the compiler fuses their multiply-adds (-mfma) */
+#define M_SIMD_ALIGN 32
+#define M_SIMD_PAD(count) (((count) + 7) & ~7) /* round a float count up to whole AVX registers */
+
+#ifndef __OPENCL_VERSION__
+MMAPI void *m_aligned_malloc(size_t size); /* M_SIMD_ALIGN aligned */
+MMAPI void  m_aligned_free(void *ptr);
+MMAPI void  m_mat4_mul_batch(float *dest, const float *A, const float *B, int count);
+MMAPI void  m_mat4_transform3_batch(float *dest_x, float *dest_y, float *dest_z, const float *matrix, const float *x, const float *y, const float *z, int count);
+MMAPI void  m_mat4_transform4_batch(float *dest_x, float *dest_y, float *dest_z, float *dest_w, const float *matrix, const float *x, const float *y, const float *z, const float *w, int count);
+#endif
 
 /* 2d */
 MMAPI int   m_2d_line_to_line_intersection(float2 *dest, float2 *p11, float2 *p12, float2 *p21, float2 *p22);
@@ -193,6 +239,7 @@ MMAPI float m_2d_polyline_length(float2 *points, int count);
 
 /* 3d */
 MMAPI int   m_3d_box_to_box_collision(float3 *min1, float3 *max1, float3 *min2, float3 *max2);
+MMAPI int   m_3d_box_to_frustum_collision(float4 *planes, float3 *box_min, float3 *box_max); /* 0 outside, 1 intersecting, 2 inside */
 MMAPI int   m_3d_ray_box_intersection_in_out(float3 *ray_origin, float3 *ray_direction, float3 *box_min, float3 *box_max, float *in, float *out);
 MMAPI int   m_3d_ray_sphere_intersection_in_out(float3 *ray_origin, float3 *ray_direction, float3 *sphere_origin, float sphere_radius2, float *in, float *out);
 MMAPI int   m_3d_tri_box_overlap(float3 *box_center, float3 *box_half_size, float3 *vert1, float3 *vert2, float3 *vert3);
@@ -202,6 +249,41 @@ MMAPI float m_3d_ray_sphere_intersection(float3 *ray_origin, float3 *ray_directi
 MMAPI float m_3d_ray_box_intersection(float3 *ray_origin, float3 *ray_direction, float3 *box_min, float3 *box_max);
 MMAPI float m_3d_ray_triangle_intersection(float3 *ray_origin, float3 *ray_direction, float3 *vert1, float3 *vert2, float3 *vert3, float *u, float *v);
 
+#ifndef __OPENCL_VERSION__
+/* 3d packets: one ray against count primitives stored as SoA, 4 or 8 per instruction
+   - dest[i] (if dest isn't NULL) is the distance to primitive i, 0 if the ray starts inside, or -1 for a miss
+   - hits behind the ray origin are misses
+   - returns the index of the nearest hit, or -1
+   - the sphere test expects a normalized ray_direction, like m_3d_ray_sphere_intersection */
+typedef struct {float *x, *y, *z;} float3_soa; /* count float3s as separate x, y, z arrays */
+
+MMAPI int m_3d_ray_box_intersection_soa(float *dest, const float3 *ray_origin, const float3 *ray_direction, const float3_soa *box_min, const float3_soa *box_max, int count);
+MMAPI int m_3d_ray_sphere_intersection_soa(float *dest, const float3 *ray_origin, const float3 *ray_direction, const float3_soa *sphere_origin, const float *sphere_radius2, int count);
+MMAPI int m_3d_ray_triangle_intersection_soa(float *dest, const float3 *ray_origin, const float3 *ray_direction, const float3_soa *vert1, const float3_soa *vert2, const float3_soa *vert3, int count);
+
+/* box bvh: 8-wide nodes whose children are either nodes or boxes
+   - m_bvh_build returns 0 if out of memory
+   - m_bvh_ray_nearest returns the index of the nearest box hit (-1 if none) and its distance
+   - flat boxes work, so axis aligned quads (glyphs in text space) can be picked exactly */
+#define M_BVH_WIDTH 8
+
+typedef struct {
+   float min_x[M_BVH_WIDTH], min_y[M_BVH_WIDTH], min_z[M_BVH_WIDTH];
+   float max_x[M_BVH_WIDTH], max_y[M_BVH_WIDTH], max_z[M_BVH_WIDTH];
+   int child[M_BVH_WIDTH]; /* node index, or ~box index */
+   int count;
+} m_bvh_node;
+
+typedef struct {
+   m_bvh_node *nodes;
+   int node_count;
+} m_bvh;
+
+MMAPI int  m_bvh_build(m_bvh *bvh, const float3 *box_min, const float3 *box_max, int count);
+MMAPI void m_bvh_destroy(m_bvh *bvh);
+MMAPI int  m_bvh_ray_nearest(const m_bvh *bvh, const float3 *ray_origin, const float3 *ray_direction, float *dist);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -213,10 +295,29 @@ MMAPI float m_3d_ray_triangle_intersection(float3 *ray_origin, float3 *ray_direc
 
 #ifndef __OPENCL_VERSION__
 #include <math.h>
+#include <stdlib.h>
+#endif
+
+#if !defined(__OPENCL_VERSION__) && !defined(M_NO_SIMD)
+   #if defined(__AVX__)
+      #include <immintrin.h>
+      #define M__AVX
+   #endif
+   #if defined(__AVX2__)
+      #define M__AVX2
+   #endif
+   #if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+      #include <xmmintrin.h>
+      #define M__SSE
+   #endif
+   #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+      #include <emmintrin.h>
+      #define M__SSE2
+   #endif
 #endif
 
-static unsigned int m__rz = 362436069;
-static unsigned int m__rw = 521288629;
+static m_rng m__rng;
+static int m__rng_seeded = 0;
 
 MMAPI unsigned int m_next_power_of_two(unsigned int x)
 {
@@ -234,15 +335,15 @@ MMAPI unsigned int m_next_power_of_two(unsigned int x)
 
 MMAPI void m_srand(unsigned int z, unsigned int w)
 {
-   m__rz = z;
-   m__rw = w;
+   m_rng_seed(&m__rng, z, w);
+   m__rng_seeded = 1;
 }
 
 MMAPI unsigned int m_rand(void)
 {
-   m__rz = 36969 * (m__rz & 65535) + (m__rz >> 16);
-   m__rw = 18000 * (m__rw & 65535) + (m__rw >> 16);
-   return (m__rz << 16) + m__rw;
+   if (!m__rng_seeded)
+      m_srand(362436069, 521288629);
+   return m_rng_next(&m__rng);
 }
 
 MMAPI float m_randf(void)
@@ -251,6 +352,196 @@ MMAPI float m_randf(void)
    return (u + 1.0) * 2.328306435454494e-10;
 }
 
+#define M__ROTL(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+
+/* splitmix64, expands a seed into generator state */
+static unsigned long long m__splitmix64(unsigned long long *x)
+{
+   unsigned long long z = (*x += 0x9e3779b97f4a7c15ull);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+   return z ^ (z >> 31);
+}
+
+/* xoshiro128 jump polynomials: m__rng_jump advances a state by 2^64 steps,
+   m__rng_stream_jump[b] by 2^(96+b) steps (entry 0 is the reference long_jump) */
+static const unsigned int m__rng_jump[4] = {0x8764000bu, 0xf542d2d3u, 0x6fa035c3u, 0x77f2db5bu};
+static const unsigned int m__rng_stream_jump[32][4] = {
+   {0xb523952eu, 0x0b6f099fu, 0xccf5a0efu, 0x1c580662u}, {0xeeb0e0a4u, 0x77133e23u, 0xdc596025u, 0x97f55fe2u},
+   {0x9e9b45acu, 0x6d495900u, 0x69ac41e5u, 0x0356e935u}, {0x407883f3u, 0x547d4854u, 0x9065599bu, 0x662b6ac9u},
+   {0x667ee2deu, 0x8a954d8bu, 0x6551c593u, 0x2fcdf7e4u}, {0xfb5707aau, 0xdaa2886au, 0xb233cd67u, 0x0f4183cau},
+   {0x40dbcd63u, 0x8e131a4fu, 0x224fc251u, 0xc64784eeu}, {0x4f4db4ffu, 0x7b6ea15fu, 0xb29e13b7u, 0x563b1ea7u},
+   {0xbbd3ae5au, 0xebf544e9u, 0xd28ec540u, 0x5ce3332fu}, {0xd39c61ebu, 0x1f4dd02eu, 0x95a4e90fu, 0xa9ac90e8u},
+   {0x790c846cu, 0xd428b915u, 0xd2660f23u, 0x725dcd70u}, {0x08eff263u, 0xf39ff6c1u, 0x513d8ba0u, 0xca4404cau},
+   {0x26534b4du, 0xcf8db66bu, 0x6102f64bu, 0xf84f07e3u}, {0xa88724c5u, 0x0870d7d7u, 0x181f9787u, 0xdc3d5d45u},
+   {0xdba73489u, 0x0df0ec1fu, 0x43005e2eu, 0xd543edf1u}, {0x6d73a1e7u, 0xfe43b2a7u, 0xf9a46a20u, 0x58859a86u},
+   {0xa683b6d0u, 0xafc4a733u, 0x1bf94979u, 0xf904dd9fu}, {0x2ee03d84u, 0x75c74e3du, 0x96efbfd6u, 0x7d256f6cu},
+   {0x3ad0ebe7u, 0x13f14f31u, 0x796d291cu, 0xa42bbfddu}, {0xce04ddb0u, 0x1fc44a96u, 0xb6a00a91u, 0x8a6c4326u},
+   {0x4e519967u, 0x0d7a869eu, 0x40012492u, 0x6dc7c036u}, {0x9e4d0a48u, 0x6a86db67u, 0xae852b9bu, 0x6cc51cebu},
+   {0x5a52e97fu, 0x77beacceu, 0xb8030b6cu, 0x5ead7c39u}, {0x022cefbeu, 0x7d88e3d4u, 0x858bbdfeu, 0x6b644146u},
+   {0x90067a45u, 0xb7ce03bcu, 0xde4ac3e8u, 0x99853a2cu}, {0xe3a7ccf3u, 0x35c9b163u, 0xbb5b8048u, 0x31ac55d8u},
+   {0x8d4a33dbu, 0x169e96efu, 0x3788b4a3u, 0x622cd32eu}, {0x0513f190u, 0x06f60339u, 0x93608184u, 0x4576959du},
+   {0x1a64167bu, 0x05c745c5u, 0xe2f50d3au, 0x8abc30fau}, {0x1741bb62u, 0x3afd4ba4u, 0xb268faefu, 0x18bf57c6u},
+   {0x39b7b7b9u, 0x31bb1001u, 0xd95f2dccu, 0x5686c6e7u}, {0x54d81f7eu, 0x0453f0feu, 0x3bef4345u, 0x9d5e1791u}
+};
+
+static void m__rng_jump_state(unsigned int s[4], const unsigned int poly[4])
+{
+   unsigned int t0 = 0, t1 = 0, t2 = 0, t3 = 0, t;
+   int i, b;
+   for (i = 0; i < 4; i++) {
+      for (b = 0; b < 32; b++) {
+         if (poly[i] & (1u << b)) {
+            t0 ^= s[0]; t1 ^= s[1]; t2 ^= s[2]; t3 ^= s[3];
+         }
+         t = s[1] << 9;
+         s[2] ^= s[0];
+         s[3] ^= s[1];
+         s[1] ^= s[2];
+         s[0] ^= s[3];
+         s[2] ^= t;
+         s[3] = M__ROTL(s[3], 11);
+      }
+   }
+   s[0] = t0; s[1] = t1; s[2] = t2; s[3] = t3;
+}
+
+MMAPI void m_rng_seed(m_rng *rng, unsigned int seed, unsigned int stream)
+{
+   /* two splitmix64 outputs never are both 0, so the state is valid */
+   unsigned long long x = seed, a = m__splitmix64(&x), b = m__splitmix64(&x);
+   unsigned int s[4];
+   int i;
+   s[0] = (unsigned int)a; s[1] = (unsigned int)(a >> 32);
+   s[2] = (unsigned int)b; s[3] = (unsigned int)(b >> 32);
+
+   /* stream k starts k * 2^96 steps in, lane i another i * 2^64 steps */
+   for (i = 0; i < 32; i++)
+      if (stream & (1u << i))
+         m__rng_jump_state(s, m__rng_stream_jump[i]);
+   for (i = 0; i < M_RNG_LANES; i++) {
+      if (i > 0)
+         m__rng_jump_state(s, m__rng_jump);
+      rng->s[0][i] = s[0]; rng->s[1][i] = s[1]; rng->s[2][i] = s[2]; rng->s[3][i] = s[3];
+   }
+   rng->pos = M_RNG_LANES;
+}
+
+/* steps every lane n times, dest gets n * M_RNG_LANES numbers (as [0 - 1) floats if tofloat) */
+static void m__rng_steps(m_rng *rng, void *dest, int n, int tofloat)
+{
+   int i = 0, k;
+#if defined(M__AVX2)
+   {
+      __m256i s0 = _mm256_loadu_si256((const __m256i *)rng->s[0]);
+      __m256i s1 = _mm256_loadu_si256((const __m256i *)rng->s[1]);
+      __m256i s2 = _mm256_loadu_si256((const __m256i *)rng->s[2]);
+      __m256i s3 = _mm256_loadu_si256((const __m256i *)rng->s[3]);
+      __m256 scale = _mm256_set1_ps(5.9604644775390625e-8f);
+      for (k = 0; k < n; k++) {
+         __m256i r = _mm256_add_epi32(s0, s3), t = _mm256_slli_epi32(s1, 9);
+         r = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(r, 7), _mm256_srli_epi32(r, 25)), s0);
+         s2 = _mm256_xor_si256(s2, s0);
+         s3 = _mm256_xor_si256(s3, s1);
+         s1 = _mm256_xor_si256(s1, s2);
+         s0 = _mm256_xor_si256(s0, s3);
+         s2 = _mm256_xor_si256(s2, t);
+         s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+         if (tofloat)
+            _mm256_storeu_ps((float *)dest + k * M_RNG_LANES, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(r, 8)), scale));
+         else
+            _mm256_storeu_si256((__m256i *)((unsigned int *)dest + k * M_RNG_LANES), r);
+      }
+      _mm256_storeu_si256((__m256i *)rng->s[0], s0);
+      _mm256_storeu_si256((__m256i *)rng->s[1], s1);
+      _mm256_storeu_si256((__m256i *)rng->s[2], s2);
+      _mm256_storeu_si256((__m256i *)rng->s[3], s3);
+      i = M_RNG_LANES;
+   }
+#elif defined(M__SSE2)
+   for (; i < M_RNG_LANES; i += 4) {
+      __m128i s0 = _mm_loadu_si128((const __m128i *)(rng->s[0] + i));
+      __m128i s1 = _mm_loadu_si128((const __m128i *)(rng->s[1] + i));
+      __m128i s2 = _mm_loadu_si128((const __m128i *)(rng->s[2] + i));
+      __m128i s3 = _mm_loadu_si128((const __m128i *)(rng->s[3] + i));
+      __m128 scale = _mm_set1_ps(5.9604644775390625e-8f);
+      for (k = 0; k < n; k++) {
+         __m128i r = _mm_add_epi32(s0, s3), t = _mm_slli_epi32(s1, 9);
+         r = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32(r, 7), _mm_srli_epi32(r, 25)), s0);
+         s2 = _mm_xor_si128(s2, s0);
+         s3 = _mm_xor_si128(s3, s1);
+         s1 = _mm_xor_si128(s1, s2);
+         s0 = _mm_xor_si128(s0, s3);
+         s2 = _mm_xor_si128(s2, t);
+         s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+         if (tofloat)
+            _mm_storeu_ps((float *)dest + k * M_RNG_LANES + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(r, 8)), scale));
+         else
+            _mm_storeu_si128((__m128i *)((unsigned int *)dest + k * M_RNG_LANES + i), r);
+      }
+      _mm_storeu_si128((__m128i *)(rng->s[0] + i), s0);
+      _mm_storeu_si128((__m128i *)(rng->s[1] + i), s1);
+      _mm_storeu_si128((__m128i *)(rng->s[2] + i), s2);
+      _mm_storeu_si128((__m128i *)(rng->s[3] + i), s3);
+   }
+#endif
+   for (; i < M_RNG_LANES; i++) {
+      unsigned int s0 = rng->s[0][i], s1 = rng->s[1][i], s2 = rng->s[2][i], s3 = rng->s[3][i];
+      for (k = 0; k < n; k++) {
+         unsigned int r = M__ROTL(s0 + s3, 7) + s0, t = s1 << 9;
+         s2 ^= s0;
+         s3 ^= s1;
+         s1 ^= s2;
+         s0 ^= s3;
+         s2 ^= t;
+         s3 = M__ROTL(s3, 11);
+         if (tofloat)
+            ((float *)dest)[k * M_RNG_LANES + i] = (float)(r >> 8) * 5.9604644775390625e-8f;
+         else
+            ((unsigned int *)dest)[k * M_RNG_LANES + i] = r;
+      }
+      rng->s[0][i] = s0; rng->s[1][i] = s1; rng->s[2][i] = s2; rng->s[3][i] = s3;
+   }
+}
+
+#undef M__ROTL
+
+MMAPI unsigned int m_rng_next(m_rng *rng)
+{
+   if (rng->pos >= M_RNG_LANES) {
+      m__rng_steps(rng, rng->out, 1, 0);
+      rng->pos = 0;
+   }
+   return rng->out[rng->pos++];
+}
+
+MMAPI float m_rng_nextf(m_rng *rng)
+{
+   return (float)(m_rng_next(rng) >> 8) * 5.9604644775390625e-8f;
+}
+
+MMAPI void m_rng_fill(m_rng *rng, unsigned int *dest, int count)
+{
+   int i = 0;
+   while (i < count && rng->pos < M_RNG_LANES)
+      dest[i++] = rng->out[rng->pos++];
+   m__rng_steps(rng, dest + i, (count - i) / M_RNG_LANES, 0);
+   i += (count - i) / M_RNG_LANES * M_RNG_LANES;
+   for (; i < count; i++)
+      dest[i] = m_rng_next(rng);
+}
+
+MMAPI void m_rng_fillf(m_rng *rng, float *dest, int count)
+{
+   int i = 0;
+   while (i < count && rng->pos < M_RNG_LANES)
+      dest[i++] = (float)(rng->out[rng->pos++] >> 8) * 5.9604644775390625e-8f;
+   m__rng_steps(rng, dest + i, (count - i) / M_RNG_LANES, 1);
+   i += (count - i) / M_RNG_LANES * M_RNG_LANES;
+   for (; i < count; i++)
+      dest[i] = m_rng_nextf(rng);
+}
+
 MMAPI float m_interpolation_cubic(float y0, float y1, float y2, float y3, float mu)
 {
    float a0, a1, a2, a3, mu2;
@@ -761,6 +1052,184 @@ MMAPI void m_mat4_transform4(float4 *dest, const float *matrix, const float4 *sr
    dest->w = matrix[3] * src->x + matrix[7] * src->y + matrix[11] * src->z + matrix[15] * src->w;
 }
 
+MMAPI void m_mat4_frustum_planes(float4 *planes, const float *matrix)
+{
+   int i;
+
+   /* rows of the matrix: w +- x, w +- y, w +- z (Gribb, Hartmann) */
+   for (i = 0; i < 3; i++) {
+      float4 *p = &planes[i * 2];
+      p[0].x = matrix[3] + matrix[i];
+      p[0].y = matrix[7] + matrix[4 + i];
+      p[0].z = matrix[11] + matrix[8 + i];
+      p[0].w = matrix[15] + matrix[12 + i];
+      p[1].x = matrix[3] - matrix[i];
+      p[1].y = matrix[7] - matrix[4 + i];
+      p[1].z = matrix[11] - matrix[8 + i];
+      p[1].w = matrix[15] - matrix[12 + i];
+   }
+
+   for (i = 0; i < 6; i++) {
+      float l = M_LENGHT3(planes[i]);
+      if (l > 0) {
+         l = 1.0f / l;
+         planes[i].x *= l; planes[i].y *= l; planes[i].z *= l; planes[i].w *= l;
+      }
+   }
+}
+
+#ifndef __OPENCL_VERSION__
+
+MMAPI void *m_aligned_malloc(size_t size)
+{
+   /* over-allocate and keep the malloc pointer just below the aligned block */
+   unsigned char *p = (unsigned char *)malloc(size + M_SIMD_ALIGN + sizeof(void *));
+   unsigned char *a;
+   if (p == NULL)
+      return NULL;
+   a = p + sizeof(void *);
+   a += (M_SIMD_ALIGN - ((size_t)a & (M_SIMD_ALIGN - 1))) & (M_SIMD_ALIGN - 1);
+   ((void **)a)[-1] = p;
+   return a;
+}
+
+MMAPI void m_aligned_free(void *ptr)
+{
+   if (ptr)
+      free(((void **)ptr)[-1]);
+}
+
+/* each dest column is A's columns weighted by a column of B, summed in the same order as m_mat4_mul */
+MMAPI void m_mat4_mul_batch(float *dest, const float *A, const float *B, int count)
+{
+   int i = 0;
+#if defined(M__AVX)
+   {
+      __m256 a0 = _mm256_broadcast_ps((const __m128 *)A);
+      __m256 a1 = _mm256_broadcast_ps((const __m128 *)(A + 4));
+      __m256 a2 = _mm256_broadcast_ps((const __m128 *)(A + 8));
+      __m256 a3 = _mm256_broadcast_ps((const __m128 *)(A + 12));
+      for (; i < count; i++) {
+         const float *b = B + i * 16;
+         float *d = dest + i * 16;
+         int j;
+         for (j = 0; j < 16; j += 8) { /* two columns */
+            __m256 bj = _mm256_loadu_ps(b + j);
+            __m256 c = _mm256_mul_ps(a0, _mm256_permute_ps(bj, 0x00));
+            c = _mm256_add_ps(c, _mm256_mul_ps(a1, _mm256_permute_ps(bj, 0x55)));
+            c = _mm256_add_ps(c, _mm256_mul_ps(a2, _mm256_permute_ps(bj, 0xaa)));
+            c = _mm256_add_ps(c, _mm256_mul_ps(a3, _mm256_permute_ps(bj, 0xff)));
+            _mm256_storeu_ps(d + j, c);
+         }
+      }
+   }
+#elif defined(M__SSE)
+   {
+      __m128 a0 = _mm_loadu_ps(A);
+      __m128 a1 = _mm_loadu_ps(A + 4);
+      __m128 a2 = _mm_loadu_ps(A + 8);
+      __m128 a3 = _mm_loadu_ps(A + 12);
+      for (; i < count; i++) {
+         const float *b = B + i * 16;
+         float *d = dest + i * 16;
+         int j;
+         for (j = 0; j < 16; j += 4) {
+            __m128 c = _mm_mul_ps(a0, _mm_set1_ps(b[j]));
+            c = _mm_add_ps(c, _mm_mul_ps(a1, _mm_set1_ps(b[j + 1])));
+            c = _mm_add_ps(c, _mm_mul_ps(a2, _mm_set1_ps(b[j + 2])));
+            c = _mm_add_ps(c, _mm_mul_ps(a3, _mm_set1_ps(b[j + 3])));
+            _mm_storeu_ps(d + j, c);
+         }
+      }
+   }
+#endif
+   for (; i < count; i++) {
+      float tmp[16]; int j;
+      m_mat4_mul(tmp, A, B + i * 16);
+      for (j = 0; j < 16; j++) dest[i * 16 + j] = tmp[j];
+   }
+}
+
+/* one matrix row for N positions: m0 * x + m1 * y + m2 * z + m3 (* w) */
+#define M__ROW3(add, mul, m, r, px, py, pz) add(add(add(mul(m[r], px), mul(m[r + 4], py)), mul(m[r + 8], pz)), m[r + 12])
+#define M__ROW4(add, mul, m, r, px, py, pz, pw) add(add(add(mul(m[r], px), mul(m[r + 4], py)), mul(m[r + 8], pz)), mul(m[r + 12], pw))
+
+MMAPI void m_mat4_transform3_batch(float *dest_x, float *dest_y, float *dest_z, const float *matrix, const float *x, const float *y, const float *z, int count)
+{
+   int i = 0;
+#if defined(M__AVX)
+   {
+      __m256 m[16]; int j;
+      for (j = 0; j < 16; j++) m[j] = _mm256_set1_ps(matrix[j]);
+      for (; i + 8 <= count; i += 8) {
+         __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+         _mm256_storeu_ps(dest_x + i, M__ROW3(_mm256_add_ps, _mm256_mul_ps, m, 0, px, py, pz));
+         _mm256_storeu_ps(dest_y + i, M__ROW3(_mm256_add_ps, _mm256_mul_ps, m, 1, px, py, pz));
+         _mm256_storeu_ps(dest_z + i, M__ROW3(_mm256_add_ps, _mm256_mul_ps, m, 2, px, py, pz));
+      }
+   }
+#endif
+#if defined(M__SSE)
+   {
+      __m128 m[16]; int j;
+      for (j = 0; j < 16; j++) m[j] = _mm_set1_ps(matrix[j]);
+      for (; i + 4 <= count; i += 4) {
+         __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+         _mm_storeu_ps(dest_x + i, M__ROW3(_mm_add_ps, _mm_mul_ps, m, 0, px, py, pz));
+         _mm_storeu_ps(dest_y + i, M__ROW3(_mm_add_ps, _mm_mul_ps, m, 1, px, py, pz));
+         _mm_storeu_ps(dest_z + i, M__ROW3(_mm_add_ps, _mm_mul_ps, m, 2, px, py, pz));
+      }
+   }
+#endif
+   for (; i < count; i++) {
+      float3 src, dest;
+      src.x = x[i]; src.y = y[i]; src.z = z[i];
+      m_mat4_transform3(&dest, matrix, &src);
+      dest_x[i] = dest.x; dest_y[i] = dest.y; dest_z[i] = dest.z;
+   }
+}
+
+MMAPI void m_mat4_transform4_batch(float *dest_x, float *dest_y, float *dest_z, float *dest_w, const float *matrix, const float *x, const float *y, const float *z, const float *w, int count)
+{
+   int i = 0;
+#if defined(M__AVX)
+   {
+      __m256 m[16], one = _mm256_set1_ps(1.0f); int j;
+      for (j = 0; j < 16; j++) m[j] = _mm256_set1_ps(matrix[j]);
+      for (; i + 8 <= count; i += 8) {
+         __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+         __m256 pw = w ? _mm256_loadu_ps(w + i) : one;
+         _mm256_storeu_ps(dest_x + i, M__ROW4(_mm256_add_ps, _mm256_mul_ps, m, 0, px, py, pz, pw));
+         _mm256_storeu_ps(dest_y + i, M__ROW4(_mm256_add_ps, _mm256_mul_ps, m, 1, px, py, pz, pw));
+         _mm256_storeu_ps(dest_z + i, M__ROW4(_mm256_add_ps, _mm256_mul_ps, m, 2, px, py, pz, pw));
+         _mm256_storeu_ps(dest_w + i, M__ROW4(_mm256_add_ps, _mm256_mul_ps, m, 3, px, py, pz, pw));
+      }
+   }
+#endif
+#if defined(M__SSE)
+   {
+      __m128 m[16], one = _mm_set1_ps(1.0f); int j;
+      for (j = 0; j < 16; j++) m[j] = _mm_set1_ps(matrix[j]);
+      for (; i + 4 <= count; i += 4) {
+         __m128 px = _mm_loadu_ps(x + i), py = _mm_loadu_ps(y + i), pz = _mm_loadu_ps(z + i);
+         __m128 pw = w ? _mm_loadu_ps(w + i) : one;
+         _mm_storeu_ps(dest_x + i, M__ROW4(_mm_add_ps, _mm_mul_ps, m, 0, px, py, pz, pw));
+         _mm_storeu_ps(dest_y + i, M__ROW4(_mm_add_ps, _mm_mul_ps, m, 1, px, py, pz, pw));
+         _mm_storeu_ps(dest_z + i, M__ROW4(_mm_add_ps, _mm_mul_ps, m, 2, px, py, pz, pw));
+         _mm_storeu_ps(dest_w + i, M__ROW4(_mm_add_ps, _mm_mul_ps, m, 3, px, py, pz, pw));
+      }
+   }
+#endif
+   for (; i < count; i++) {
+      float4 src, dest;
+      src.x = x[i]; src.y = y[i]; src.z = z[i]; src.w = w ? w[i] : 1.0f;
+      m_mat4_transform4(&dest, matrix, &src);
+      dest_x[i] = dest.x; dest_y[i] = dest.y; dest_z[i] = dest.z; dest_w[i] = dest.w;
+   }
+}
+
+#endif /* __OPENCL_VERSION__ */
+
 MMAPI float m_2d_polygon_area(float2 *points, int count)
 {
    float fx, fy, a; int p;
@@ -840,6 +1309,24 @@ MMAPI int m_3d_box_to_box_collision(float3 *min1, float3 *max1, float3 *min2, fl
    (min1->z > max2->z) || (max1->z < min2->z));
 }
 
+MMAPI int m_3d_box_to_frustum_collision(float4 *planes, float3 *box_min, float3 *box_max)
+{
+   int i, inside = 2;
+   for (i = 0; i < 6; i++) {
+      float4 *p = &planes[i];
+      /* corners furthest along and against the normal */
+      float3 front, back;
+      if (p->x >= 0) { front.x = box_max->x; back.x = box_min->x; } else { front.x = box_min->x; back.x = box_max->x; }
+      if (p->y >= 0) { front.y = box_max->y; back.y = box_min->y; } else { front.y = box_min->y; back.y = box_max->y; }
+      if (p->z >= 0) { front.z = box_max->z; back.z = box_min->z; } else { front.z = box_min->z; back.z = box_max->z; }
+      if (M_DOT3(*p, front) + p->w < 0)
+         return 0;
+      if (M_DOT3(*p, back) + p->w < 0)
+         inside = 1;
+   }
+   return inside;
+}
+
 MMAPI int m_3d_ray_box_intersection_in_out(float3 *ray_origin, float3 *ray_direction, float3 *box_min, float3 *box_max, float *in, float *out)
 {
    float3 idir;
@@ -1159,4 +1646,448 @@ MMAPI int m_3d_tri_box_overlap(float3 *boxcenter, float3 *boxhalfsize, float3 *v
 #undef M_AXISTEST_Z12
 #undef M_AXISTEST_Z0
 
+#ifndef __OPENCL_VERSION__
+
+/* vector ops for the packet tests, M__W lanes wide */
+#if defined(M__AVX)
+   #define M__W 8
+   #define m__v __m256
+   #define m__set1 _mm256_set1_ps
+   #define m__load _mm256_loadu_ps
+   #define m__store _mm256_storeu_ps
+   #define m__add _mm256_add_ps
+   #define m__sub _mm256_sub_ps
+   #define m__mul _mm256_mul_ps
+   #define m__div _mm256_div_ps
+   #define m__min _mm256_min_ps
+   #define m__max _mm256_max_ps
+   #define m__sqrt _mm256_sqrt_ps
+   #define m__and _mm256_and_ps
+   #define m__le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+   #define m__lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+   #define m__neq(a, b) _mm256_cmp_ps(a, b, _CMP_NEQ_UQ)
+   #define m__select(mask, a, b) _mm256_blendv_ps(b, a, mask)
+#elif defined(M__SSE)
+   #define M__W 4
+   #define m__v __m128
+   #define m__set1 _mm_set1_ps
+   #define m__load _mm_loadu_ps
+   #define m__store _mm_storeu_ps
+   #define m__add _mm_add_ps
+   #define m__sub _mm_sub_ps
+   #define m__mul _mm_mul_ps
+   #define m__div _mm_div_ps
+   #define m__min _mm_min_ps
+   #define m__max _mm_max_ps
+   #define m__sqrt _mm_sqrt_ps
+   #define m__and _mm_and_ps
+   #define m__le _mm_cmple_ps
+   #define m__lt _mm_cmplt_ps
+   #define m__neq _mm_cmpneq_ps
+   #define m__select(mask, a, b) _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
+#endif
+
+/* the scalar versions below do the same operations in the same order as the
+   vector lanes (M_MIN/M_MAX pick the second operand on NaN, like minps/maxps),
+   so a primitive gets the same distance whichever path tests it */
+static float m__ray_box1(const float3 *o, const float3 *idir, float min_x, float min_y, float min_z, float max_x, float max_y, float max_z)
+{
+   float t0, t1, tn, tf;
+   t0 = (min_x - o->x) * idir->x; t1 = (max_x - o->x) * idir->x;
+   tn = M_MIN(t0, t1); tf = M_MAX(t0, t1);
+   t0 = (min_y - o->y) * idir->y; t1 = (max_y - o->y) * idir->y;
+   tn = M_MAX(tn, M_MIN(t0, t1)); tf = M_MIN(tf, M_MAX(t0, t1));
+   t0 = (min_z - o->z) * idir->z; t1 = (max_z - o->z) * idir->z;
+   tn = M_MAX(tn, M_MIN(t0, t1)); tf = M_MIN(tf, M_MAX(t0, t1));
+   tn = M_MAX(tn, 0.0f);
+   return (tn <= tf) ? tn : -1.0f;
+}
+
+static float m__ray_sphere1(const float3 *o, const float3 *d, float cx, float cy, float cz, float r2)
+{
+   float vx = cx - o->x, vy = cy - o->y, vz = cz - o->z;
+   float b = vx * d->x + vy * d->y + vz * d->z;
+   float det = b * b - (vx * vx + vy * vy + vz * vz) + r2;
+   float s;
+   if (!(det >= 0.0f))
+      return -1.0f;
+   s = sqrtf(det);
+   if (!(b + s >= 0.0f))
+      return -1.0f;
+   return M_MAX(b - s, 0.0f);
+}
+
+static float m__ray_triangle1(const float3 *o, const float3 *d, const float3 *v1, const float3 *v2, const float3 *v3)
+{
+   float3 e1, e2, p, tv, q;
+   float det, inv, u, v, t;
+   M_SUB3(e1, *v2, *v1);
+   M_SUB3(e2, *v3, *v1);
+   M_CROSS3(p, *d, e2);
+   det = M_DOT3(e1, p);
+   inv = 1.0f / det;
+   M_SUB3(tv, *o, *v1);
+   u = M_DOT3(tv, p) * inv;
+   M_CROSS3(q, tv, e1);
+   v = M_DOT3(*d, q) * inv;
+   t = M_DOT3(e2, q) * inv;
+   if (det != 0.0f && u >= 0.0f && u <= 1.0f && v >= 0.0f && u + v <= 1.0f && t > 0.0f)
+      return t;
+   return -1.0f;
+}
+
+#ifdef M__W
+static int m__nearest(const float *t, int count)
+{
+   int i, nearest = -1;
+   for (i = 0; i < count; i++) {
+      if (t[i] >= 0.0f && (nearest < 0 || t[i] < t[nearest]))
+         nearest = i;
+   }
+   return nearest;
+}
+#endif
+
+/* runs of M__W primitives go through tmp unless dest is given */
+#define M__PACKET_OUT(i) (dest ? dest + (i) : tmp)
+
+MMAPI int m_3d_ray_box_intersection_soa(float *dest, const float3 *ray_origin, const float3 *ray_direction, const float3_soa *box_min, const float3_soa *box_max, int count)
+{
+   float3 idir;
+   float best = -1.0f;
+   int i = 0, nearest = -1;
+   /* finite, so a ray starting on the plane of a face it is parallel to gives 0, not 0 * inf */
+   idir.x = M_CLAMP(1.0f / ray_direction->x, -3.402823466e+38f, 3.402823466e+38f);
+   idir.y = M_CLAMP(1.0f / ray_direction->y, -3.402823466e+38f, 3.402823466e+38f);
+   idir.z = M_CLAMP(1.0f / ray_direction->z, -3.402823466e+38f, 3.402823466e+38f);
+#ifdef M__W
+   {
+      float tmp[M__W];
+      int n;
+      m__v ox = m__set1(ray_origin->x), oy = m__set1(ray_origin->y), oz = m__set1(ray_origin->z);
+      m__v ix = m__set1(idir.x), iy = m__set1(idir.y), iz = m__set1(idir.z);
+      m__v zero = m__set1(0.0f), miss = m__set1(-1.0f);
+      for (; i + M__W <= count; i += M__W) {
+         m__v t0, t1, tn, tf;
+         float *out = M__PACKET_OUT(i);
+         t0 = m__mul(m__sub(m__load(box_min->x + i), ox), ix); t1 = m__mul(m__sub(m__load(box_max->x + i), ox), ix);
+         tn = m__min(t0, t1); tf = m__max(t0, t1);
+         t0 = m__mul(m__sub(m__load(box_min->y + i), oy), iy); t1 = m__mul(m__sub(m__load(box_max->y + i), oy), iy);
+         tn = m__max(tn, m__min(t0, t1)); tf = m__min(tf, m__max(t0, t1));
+         t0 = m__mul(m__sub(m__load(box_min->z + i), oz), iz); t1 = m__mul(m__sub(m__load(box_max->z + i), oz), iz);
+         tn = m__max(tn, m__min(t0, t1)); tf = m__min(tf, m__max(t0, t1));
+         tn = m__max(tn, zero);
+         m__store(out, m__select(m__le(tn, tf), tn, miss));
+         n = m__nearest(out, M__W);
+         if (n >= 0 && (nearest < 0 || out[n] < best)) { nearest = i + n; best = out[n]; }
+      }
+   }
+#endif
+   for (; i < count; i++) {
+      float t = m__ray_box1(ray_origin, &idir, box_min->x[i], box_min->y[i], box_min->z[i], box_max->x[i], box_max->y[i], box_max->z[i]);
+      if (dest) dest[i] = t;
+      if (t >= 0.0f && (nearest < 0 || t < best)) { nearest = i; best = t; }
+   }
+   return nearest;
+}
+
+MMAPI int m_3d_ray_sphere_intersection_soa(float *dest, const float3 *ray_origin, const float3 *ray_direction, const float3_soa *sphere_origin, const float *sphere_radius2, int count)
+{
+   float best = -1.0f;
+   int i = 0, nearest = -1;
+#ifdef M__W
+   {
+      float tmp[M__W];
+      int n;
+      m__v ox = m__set1(ray_origin->x), oy = m__set1(ray_origin->y), oz = m__set1(ray_origin->z);
+      m__v dx = m__set1(ray_direction->x), dy = m__set1(ray_direction->y), dz = m__set1(ray_direction->z);
+      m__v zero = m__set1(0.0f), miss = m__set1(-1.0f);
+      for (; i + M__W <= count; i += M__W) {
+         m__v vx, vy, vz, b, det, s, hit;
+         float *out = M__PACKET_OUT(i);
+         vx = m__sub(m__load(sphere_origin->x + i), ox);
+         vy = m__sub(m__load(sphere_origin->y + i), oy);
+         vz = m__sub(m__load(sphere_origin->z + i), oz);
+         b = m__add(m__add(m__mul(vx, dx), m__mul(vy, dy)), m__mul(vz, dz));
+         det = m__add(m__sub(m__mul(b, b), m__add(m__add(m__mul(vx, vx), m__mul(vy, vy)), m__mul(vz, vz))), m__load(sphere_radius2 + i));
+         hit = m__le(zero, det);
+         s = m__sqrt(m__max(zero, det));
+         hit = m__and(hit, m__le(zero, m__add(b, s)));
+         m__store(out, m__select(hit, m__max(m__sub(b, s), zero), miss));
+         n = m__nearest(out, M__W);
+         if (n >= 0 && (nearest < 0 || out[n] < best)) { nearest = i + n; best = out[n]; }
+      }
+   }
+#endif
+   for (; i < count; i++) {
+      float t = m__ray_sphere1(ray_origin, ray_direction, sphere_origin->x[i], sphere_origin->y[i], sphere_origin->z[i], sphere_radius2[i]);
+      if (dest) dest[i] = t;
+      if (t >= 0.0f && (nearest < 0 || t < best)) { nearest = i; best = t; }
+   }
+   return nearest;
+}
+
+MMAPI int m_3d_ray_triangle_intersection_soa(float *dest, const float3 *ray_origin, const float3 *ray_direction, const float3_soa *vert1, const float3_soa *vert2, const float3_soa *vert3, int count)
+{
+   float best = -1.0f;
+   int i = 0, nearest = -1;
+#ifdef M__W
+   {
+      float tmp[M__W];
+      int n;
+      m__v ox = m__set1(ray_origin->x), oy = m__set1(ray_origin->y), oz = m__set1(ray_origin->z);
+      m__v dx = m__set1(ray_direction->x), dy = m__set1(ray_direction->y), dz = m__set1(ray_direction->z);
+      m__v zero = m__set1(0.0f), one = m__set1(1.0f), miss = m__set1(-1.0f);
+      for (; i + M__W <= count; i += M__W) {
+         float *out = M__PACKET_OUT(i);
+         m__v ax = m__load(vert1->x + i), ay = m__load(vert1->y + i), az = m__load(vert1->z + i);
+         m__v e1x = m__sub(m__load(vert2->x + i), ax), e1y = m__sub(m__load(vert2->y + i), ay), e1z = m__sub(m__load(vert2->z + i), az);
+         m__v e2x = m__sub(m__load(vert3->x + i), ax), e2y = m__sub(m__load(vert3->y + i), ay), e2z = m__sub(m__load(vert3->z + i), az);
+         m__v px = m__sub(m__mul(dy, e2z), m__mul(dz, e2y));
+         m__v py = m__sub(m__mul(dz, e2x), m__mul(dx, e2z));
+         m__v pz = m__sub(m__mul(dx, e2y), m__mul(dy, e2x));
+         m__v det = m__add(m__add(m__mul(e1x, px), m__mul(e1y, py)), m__mul(e1z, pz));
+         m__v inv = m__div(one, det);
+         m__v tx = m__sub(ox, ax), ty = m__sub(oy, ay), tz = m__sub(oz, az);
+         m__v u = m__mul(m__add(m__add(m__mul(tx, px), m__mul(ty, py)), m__mul(tz, pz)), inv);
+         m__v qx = m__sub(m__mul(ty, e1z), m__mul(tz, e1y));
+         m__v qy = m__sub(m__mul(tz, e1x), m__mul(tx, e1z));
+         m__v qz = m__sub(m__mul(tx, e1y), m__mul(ty, e1x));
+         m__v v = m__mul(m__add(m__add(m__mul(dx, qx), m__mul(dy, qy)), m__mul(dz, qz)), inv);
+         m__v t = m__mul(m__add(m__add(m__mul(e2x, qx), m__mul(e2y, qy)), m__mul(e2z, qz)), inv);
+         m__v hit = m__and(m__neq(det, zero), m__and(m__le(zero, u), m__le(u, one)));
+         hit = m__and(hit, m__and(m__le(zero, v), m__le(m__add(u, v), one)));
+         hit = m__and(hit, m__lt(zero, t));
+         m__store(out, m__select(hit, t, miss));
+         n = m__nearest(out, M__W);
+         if (n >= 0 && (nearest < 0 || out[n] < best)) { nearest = i + n; best = out[n]; }
+      }
+   }
+#endif
+   for (; i < count; i++) {
+      float3 a, b, c;
+      float t;
+      a.x = vert1->x[i]; a.y = vert1->y[i]; a.z = vert1->z[i];
+      b.x = vert2->x[i]; b.y = vert2->y[i]; b.z = vert2->z[i];
+      c.x = vert3->x[i]; c.y = vert3->y[i]; c.z = vert3->z[i];
+      t = m__ray_triangle1(ray_origin, ray_direction, &a, &b, &c);
+      if (dest) dest[i] = t;
+      if (t >= 0.0f && (nearest < 0 || t < best)) { nearest = i; best = t; }
+   }
+   return nearest;
+}
+
+#undef M__PACKET_OUT
+
+/* bvh */
+typedef struct {
+   m_bvh *bvh;
+   const float3 *box_min, *box_max;
+   float3 *center;
+   int *index;
+} m__bvh_builder;
+
+/* moves the k-th smallest center (on axis) of index[first..last] to its sorted place */
+static void m__bvh_select(m__bvh_builder *b, int first, int last, int k, int axis)
+{
+   int *index = b->index;
+   while (first < last) {
+      const float *c = &b->center[index[(first + last) / 2]].x;
+      float pivot = c[axis];
+      int i = first, j = last;
+      while (i <= j) {
+         while ((&b->center[index[i]].x)[axis] < pivot) i++;
+         while ((&b->center[index[j]].x)[axis] > pivot) j--;
+         if (i <= j) {
+            int tmp = index[i]; index[i] = index[j]; index[j] = tmp;
+            i++; j--;
+         }
+      }
+      if (k <= j) last = j;
+      else if (k >= i) first = i;
+      else break;
+   }
+}
+
+static void m__bvh_bounds(m__bvh_builder *b, int first, int count, float3 *bmin, float3 *bmax)
+{
+   int i;
+   *bmin = b->box_min[b->index[first]];
+   *bmax = b->box_max[b->index[first]];
+   for (i = first + 1; i < first + count; i++) {
+      M_MIN3(*bmin, *bmin, b->box_min[b->index[i]]);
+      M_MAX3(*bmax, *bmax, b->box_max[b->index[i]]);
+   }
+}
+
+static int m__bvh_node(m__bvh_builder *b, int first, int count)
+{
+   int start[M_BVH_WIDTH + 1];
+   int groups = 1, node_id = b->bvh->node_count++, g, i;
+   m_bvh_node *node = &b->bvh->nodes[node_id];
+
+   /* split the biggest group at the median of its centers on their longest axis,
+      until there are enough groups; few enough boxes all become children */
+   start[0] = first;
+   start[1] = first + count;
+   if (count <= M_BVH_WIDTH) {
+      for (i = 1; i <= count; i++)
+         start[i] = first + i;
+      groups = count;
+   }
+   else while (groups < M_BVH_WIDTH) {
+      float3 cmin, cmax, size;
+      int big = 0, mid, axis;
+      for (g = 1; g < groups; g++) {
+         if (start[g + 1] - start[g] > start[big + 1] - start[big])
+            big = g;
+      }
+      cmin = cmax = b->center[b->index[start[big]]];
+      for (i = start[big] + 1; i < start[big + 1]; i++) {
+         M_MIN3(cmin, cmin, b->center[b->index[i]]);
+         M_MAX3(cmax, cmax, b->center[b->index[i]]);
+      }
+      M_SUB3(size, cmax, cmin);
+      axis = (size.x >= size.y && size.x >= size.z) ? 0 : (size.y >= size.z ? 1 : 2);
+      mid = (start[big] + start[big + 1]) / 2;
+      m__bvh_select(b, start[big], start[big + 1] - 1, mid, axis);
+      for (g = groups; g > big; g--)
+         start[g + 1] = start[g];
+      start[big + 1] = mid;
+      groups++;
+   }
+
+   node->count = groups;
+   for (g = 0; g < M_BVH_WIDTH; g++) {
+      float3 bmin, bmax;
+      if (g < groups) {
+         int n = start[g + 1] - start[g];
+         m__bvh_bounds(b, start[g], n, &bmin, &bmax);
+         node->child[g] = (n == 1) ? ~b->index[start[g]] : m__bvh_node(b, start[g], n);
+         node = &b->bvh->nodes[node_id];
+      }
+      else {
+         /* never tested (past count), but keep the lanes finite */
+         bmin.x = bmin.y = bmin.z = bmax.x = bmax.y = bmax.z = 0.0f;
+         node->child[g] = -1;
+      }
+      node->min_x[g] = bmin.x; node->min_y[g] = bmin.y; node->min_z[g] = bmin.z;
+      node->max_x[g] = bmax.x; node->max_y[g] = bmax.y; node->max_z[g] = bmax.z;
+   }
+   return node_id;
+}
+
+MMAPI int m_bvh_build(m_bvh *bvh, const float3 *box_min, const float3 *box_max, int count)
+{
+   m__bvh_builder b;
+   int i;
+
+   bvh->nodes = NULL;
+   bvh->node_count = 0;
+   if (count <= 0)
+      return 1;
+
+   /* every node has at least two children, so there are fewer nodes than boxes */
+   bvh->nodes = (m_bvh_node *)m_aligned_malloc(sizeof(m_bvh_node) * (size_t)count);
+   b.center = (float3 *)malloc(sizeof(float3) * (size_t)count);
+   b.index = (int *)malloc(sizeof(int) * (size_t)count);
+   if (bvh->nodes == NULL || b.center == NULL || b.index == NULL) {
+      m_aligned_free(bvh->nodes);
+      bvh->nodes = NULL;
+      free(b.center);
+      free(b.index);
+      return 0;
+   }
+
+   b.bvh = bvh;
+   b.box_min = box_min;
+   b.box_max = box_max;
+   for (i = 0; i < count; i++) {
+      M_ADD3(b.center[i], box_min[i], box_max[i]);
+      b.index[i] = i;
+   }
+   m__bvh_node(&b, 0, count);
+
+   free(b.center);
+   free(b.index);
+   return 1;
+}
+
+MMAPI void m_bvh_destroy(m_bvh *bvh)
+{
+   m_aligned_free(bvh->nodes);
+   bvh->nodes = NULL;
+   bvh->node_count = 0;
+}
+
+MMAPI int m_bvh_ray_nearest(const m_bvh *bvh, const float3 *ray_origin, const float3 *ray_direction, float *dist)
+{
+   int stack[256];
+   float stack_t[256];
+   int sp = 0, nearest = -1;
+   float best = 0.0f;
+
+   if (bvh->node_count > 0) {
+      stack[0] = 0;
+      stack_t[0] = 0.0f;
+      sp = 1;
+   }
+   while (sp > 0) {
+      const m_bvh_node *node;
+      float3_soa bmin, bmax;
+      float t[M_BVH_WIDTH];
+      int i;
+
+      sp--;
+      if (nearest >= 0 && stack_t[sp] >= best)
+         continue;
+
+      node = &bvh->nodes[stack[sp]];
+      bmin.x = (float *)node->min_x; bmin.y = (float *)node->min_y; bmin.z = (float *)node->min_z;
+      bmax.x = (float *)node->max_x; bmax.y = (float *)node->max_y; bmax.z = (float *)node->max_z;
+      if (m_3d_ray_box_intersection_soa(t, ray_origin, ray_direction, &bmin, &bmax, node->count) < 0)
+         continue;
+
+      for (i = 0; i < node->count; i++) {
+         if (t[i] < 0.0f || (nearest >= 0 && t[i] >= best))
+            continue;
+         if (node->child[i] < 0) {
+            nearest = ~node->child[i];
+            best = t[i];
+         }
+         else if (sp < 256) {
+            stack[sp] = node->child[i];
+            stack_t[sp] = t[i];
+            sp++;
+         }
+      }
+   }
+
+   if (dist && nearest >= 0)
+      *dist = best;
+   return nearest;
+}
+
+#ifdef M__W
+#undef M__W
+#undef m__v
+#undef m__set1
+#undef m__load
+#undef m__store
+#undef m__add
+#undef m__sub
+#undef m__mul
+#undef m__div
+#undef m__min
+#undef m__max
+#undef m__sqrt
+#undef m__and
+#undef m__le
+#undef m__lt
+#undef m__neq
+#undef m__select
+#endif
+
+#endif /* __OPENCL_VERSION__ */
+
 #endif /* M_MATH_IMPLEMENTATION */
@@ -0,0 +1,477 @@
+/*
+   Compile-time versions of m_math (C++14):
+   - sqrt, sin, cos, tan
+   - vectors and quaternions (float3, float4 from m_math.h)
+   - matrix (perspective, ortho, lookat, transformation, mul, inverse)
+
+   every function is constexpr and follows the operation order of its m_math
+   counterpart, so fixed cameras and layout transforms can be baked:
+
+      constexpr m_cx_mat4 projection = m_cx_mat4_perspective(0.8f, 16.0f / 9.0f, 0.1f, 100.0f);
+      glUniformMatrix4fv(location, 1, GL_FALSE, projection.m);
+
+   results are the same floats as the runtime functions. sqrt and the
+   trigonometry are evaluated in double and rounded once, which is correctly
+   rounded: where libm is not (glibc tanf, sinf on a few % of inputs) they
+   differ by one ulp. the runtime functions write into dest, these return a
+   whole matrix: translation, scale and rotation start from identity.
+
+   include m_math.h first (with or without M_MATH_IMPLEMENTATION).
+*/
+
+#ifndef M_MATH_CONSTEXPR_H
+#define M_MATH_CONSTEXPR_H
+
+#ifndef M_MATH_H
+#error "m_math_constexpr.h needs m_math.h"
+#endif
+
+#if !defined(__cplusplus) || (__cplusplus < 201402L && !(defined(_MSVC_LANG) && _MSVC_LANG >= 201402L))
+#error "m_math_constexpr.h needs C++14"
+#endif
+
+typedef struct {float m[16];} m_cx_mat4; /* column major, like m_math */
+
+/* basic math */
+constexpr float m_cx_sqrt(float x)
+{
+   double v = x, scale = 1.0, r = 1.0, prev = 0.0;
+   if (!(x > 0.0f))
+      return x == 0.0f ? x : (x - x) / (x - x); /* 0, -0; negative or nan is not a constant */
+   if (x > 3.402823466e+38f)
+      return x;
+   /* bring v into [0.25, 4] so newton converges in a few steps */
+   while (v > 4.0) { v *= 0.25; scale *= 2.0; }
+   while (v < 0.25) { v *= 4.0; scale *= 0.5; }
+   for (int i = 0; i < 16 && r != prev; i++) {
+      prev = r;
+      r = 0.5 * (r + v / r);
+   }
+   return (float)(r * scale);
+}
+
+/* reduces x to r in [-pi/4, pi/4] with x = r + quadrant * pi/2 */
+constexpr double m__cx_reduce(double x, int *quadrant)
+{
+   const double pio2_hi = 1.57079632673412561417e+00;
+   const double pio2_lo = 6.07710050650619224932e-11;
+   double k = x * 0.63661977236758134308;
+   long long n = (long long)(k < 0.0 ? k - 0.5 : k + 0.5);
+   *quadrant = (int)(n & 3);
+   return (x - (double)n * pio2_hi) - (double)n * pio2_lo;
+}
+
+constexpr double m__cx_sin_series(double r)
+{
+   double r2 = r * r, term = r, sum = r;
+   for (int i = 1; i < 12; i++) {
+      term *= -r2 / ((2 * i) * (2 * i + 1));
+      sum += term;
+   }
+   return sum;
+}
+
+constexpr double m__cx_cos_series(double r)
+{
+   double r2 = r * r, term = 1.0, sum = 1.0;
+   for (int i = 1; i < 12; i++) {
+      term *= -r2 / ((2 * i - 1) * (2 * i));
+      sum += term;
+   }
+   return sum;
+}
+
+constexpr float m_cx_sin(float x)
+{
+   int q = 0;
+   double r = m__cx_reduce(x, &q);
+   double s = m__cx_sin_series(r), c = m__cx_cos_series(r);
+   return (float)(q == 0 ? s : q == 1 ? c : q == 2 ? -s : -c);
+}
+
+constexpr float m_cx_cos(float x)
+{
+   int q = 0;
+   double r = m__cx_reduce(x, &q);
+   double s = m__cx_sin_series(r), c = m__cx_cos_series(r);
+   return (float)(q == 0 ? c : q == 1 ? -s : q == 2 ? -c : s);
+}
+
+constexpr float m_cx_tan(float x)
+{
+   int q = 0;
+   double r = m__cx_reduce(x, &q);
+   double s = m__cx_sin_series(r), c = m__cx_cos_series(r);
+   return (float)((q & 1) ? -c / s : s / c);
+}
+
+/* vector math */
+constexpr float3 m_cx_float3(float x, float y, float z)
+{
+   float3 r = {x, y, z};
+   return r;
+}
+
+constexpr float4 m_cx_float4(float x, float y, float z, float w)
+{
+   float4 r = {x, y, z, w};
+   return r;
+}
+
+constexpr float m_cx_dot3(float3 a, float3 b)
+{
+   return M_DOT3(a, b);
+}
+
+constexpr float3 m_cx_add3(float3 a, float3 b)
+{
+   float3 r = {0.0f, 0.0f, 0.0f};
+   M_ADD3(r, a, b);
+   return r;
+}
+
+constexpr float3 m_cx_sub3(float3 a, float3 b)
+{
+   float3 r = {0.0f, 0.0f, 0.0f};
+   M_SUB3(r, a, b);
+   return r;
+}
+
+constexpr float3 m_cx_mul3(float3 a, float3 b)
+{
+   float3 r = {0.0f, 0.0f, 0.0f};
+   M_MUL3(r, a, b);
+   return r;
+}
+
+constexpr float3 m_cx_cross3(float3 a, float3 b)
+{
+   float3 r = {0.0f, 0.0f, 0.0f};
+   M_CROSS3(r, a, b);
+   return r;
+}
+
+constexpr float m_cx_length3(float3 a)
+{
+   return m_cx_sqrt(a.x * a.x + a.y * a.y + a.z * a.z);
+}
+
+constexpr float3 m_cx_normalize3(float3 a)
+{
+   float3 r = {0.0f, 0.0f, 0.0f};
+   float l = m_cx_length3(a);
+   if (l > 0) {
+      l = 1.0f / l;
+      r.x = a.x * l; r.y = a.y * l; r.z = a.z * l;
+   }
+   return r;
+}
+
+/* quaternion */
+constexpr float4 m_cx_quat_identity(void)
+{
+   float4 r = M_QUAT_IDENTITY();
+   return r;
+}
+
+constexpr float4 m_cx_quat_normalize(float4 q)
+{
+   float4 r = M_QUAT_IDENTITY();
+   float l = m_cx_sqrt(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+   if (l > 0.00000001f) {
+      float m = 1.0f / l;
+      r.x = q.x * m;
+      r.y = q.y * m;
+      r.z = q.z * m;
+      r.w = q.w * m;
+   }
+   return r;
+}
+
+constexpr float4 m_cx_quat_rotation_axis(float3 axis, float angle)
+{
+   float ha = angle * 0.5f;
+   float sina = m_cx_sin(ha);
+   float4 r = {sina * axis.x, sina * axis.y, sina * axis.z, m_cx_cos(ha)};
+   return m_cx_quat_normalize(r);
+}
+
+constexpr float4 m_cx_quat_mul(float4 a, float4 b)
+{
+   float4 r = {
+      (b.w * a.x) + (b.x * a.w) + (b.y * a.z) - (b.z * a.y),
+      (b.w * a.y) + (b.y * a.w) + (b.z * a.x) - (b.x * a.z),
+      (b.w * a.z) + (b.z * a.w) + (b.x * a.y) - (b.y * a.x),
+      (b.w * a.w) - (b.x * a.x) - (b.y * a.y) - (b.z * a.z)
+   };
+   return r;
+}
+
+/* matrix */
+constexpr m_cx_mat4 m_cx_mat4_identity(void)
+{
+   m_cx_mat4 r = {M_MAT4_IDENTITY()};
+   return r;
+}
+
+constexpr bool m_cx_mat4_equal(const m_cx_mat4 &a, const m_cx_mat4 &b)
+{
+   for (int i = 0; i < 16; i++) {
+      if (a.m[i] != b.m[i])
+         return false;
+   }
+   return true;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_perspective(float fov, float ratio, float znear, float zfar)
+{
+   m_cx_mat4 r = {{0.0f}};
+   float ymax = znear * m_cx_tan(fov);
+   float xmax = ymax * ratio;
+   float left = -xmax, right = xmax, bottom = -ymax, top = ymax;
+   float temp = 2.0f * znear;
+   float temp2 = right - left;
+   float temp3 = top - bottom;
+   float temp4 = zfar - znear;
+
+   r.m[0] = temp / temp2;
+   r.m[5] = temp / temp3;
+   r.m[8] = (right + left) / temp2;
+   r.m[9] = (top + bottom) / temp3;
+   r.m[10] = (-zfar - znear) / temp4;
+   r.m[11] = -1.0f;
+   r.m[14] = (-temp * zfar) / temp4;
+   return r;
+}
+
+/* unlike m_mat4_ortho, an empty volume gives identity */
+constexpr m_cx_mat4 m_cx_mat4_ortho(float left, float right, float bottom, float top, float znear, float zfar)
+{
+   m_cx_mat4 r = m_cx_mat4_identity();
+   if (right == left || top == bottom || zfar == znear)
+      return r;
+
+   r.m[0] = 2.0f / (right-left);
+   r.m[5] = 2.0f / (top-bottom);
+   r.m[10] = -2.0f / (zfar-znear);
+   r.m[12] = -(right + left) / (right - left);
+   r.m[13] = -(top + bottom) / (top - bottom);
+   r.m[14] = -(zfar + znear) / (zfar - znear);
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_lookat(float3 pos, float3 dir, float3 up)
+{
+   m_cx_mat4 r = {{0.0f}};
+   float3 lftn = m_cx_normalize3(m_cx_cross3(dir, up));
+   float3 upn = m_cx_normalize3(m_cx_cross3(m_cx_cross3(dir, up), dir));
+   float3 dirn = m_cx_normalize3(dir);
+
+   r.m[0] = lftn.x; r.m[1] = upn.x; r.m[2] = -dirn.x;
+   r.m[4] = lftn.y; r.m[5] = upn.y; r.m[6] = -dirn.y;
+   r.m[8] = lftn.z; r.m[9] = upn.z; r.m[10] = -dirn.z;
+   r.m[12] = -m_cx_dot3(lftn, pos);
+   r.m[13] = -m_cx_dot3(upn, pos);
+   r.m[14] = m_cx_dot3(dirn, pos);
+   r.m[15] = 1.0f;
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_translation(float3 translation)
+{
+   m_cx_mat4 r = m_cx_mat4_identity();
+   r.m[12] = translation.x;
+   r.m[13] = translation.y;
+   r.m[14] = translation.z;
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_scale(float3 scale)
+{
+   m_cx_mat4 r = m_cx_mat4_identity();
+   r.m[0] = scale.x;
+   r.m[5] = scale.y;
+   r.m[10] = scale.z;
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_rotation_axis(float3 axis, float angle)
+{
+   m_cx_mat4 r = m_cx_mat4_identity();
+   float sina = m_cx_sin(angle);
+   float cosa = m_cx_cos(angle);
+   float icosa = 1.0f - cosa;
+
+   r.m[0] = axis.x * axis.x + cosa * (1.0f - axis.x * axis.x);
+   r.m[1] = axis.x * axis.y * icosa + sina * axis.z;
+   r.m[2] = axis.x * axis.z * icosa - sina * axis.y;
+
+   r.m[4] = axis.x * axis.y * icosa - sina * axis.z;
+   r.m[5] = axis.y * axis.y + cosa * (1.0f - axis.y * axis.y);
+   r.m[6] = axis.y * axis.z * icosa + sina * axis.x;
+
+   r.m[8] = axis.x * axis.z * icosa + sina * axis.y;
+   r.m[9] = axis.y * axis.z * icosa - sina * axis.x;
+   r.m[10] = axis.z * axis.z + cosa * (1.0f - axis.z * axis.z);
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_mul(const m_cx_mat4 &a, const m_cx_mat4 &b)
+{
+   m_cx_mat4 r = {{0.0f}};
+   for (int c = 0; c < 16; c += 4) {
+      for (int i = 0; i < 4; i++)
+         r.m[c + i] = a.m[i] * b.m[c] + a.m[4 + i] * b.m[c + 1] + a.m[8 + i] * b.m[c + 2] + a.m[12 + i] * b.m[c + 3];
+   }
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_transpose(const m_cx_mat4 &s)
+{
+   m_cx_mat4 r = {{0.0f}};
+   for (int c = 0; c < 4; c++) {
+      for (int i = 0; i < 4; i++)
+         r.m[c * 4 + i] = s.m[i * 4 + c];
+   }
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_inverse_transpose(const m_cx_mat4 &s)
+{
+   m_cx_mat4 r = {{0.0f}};
+   float tmp[12] = {0.0f};
+   float det = 0.0f;
+
+   // calculate pairs for first 8 elements (cofactors)
+   tmp[0] =  s.m[10] * s.m[15];
+   tmp[1] =  s.m[11] * s.m[14];
+   tmp[2] =  s.m[9] *  s.m[15];
+   tmp[3] =  s.m[11] * s.m[13];
+   tmp[4] =  s.m[9] *  s.m[14];
+   tmp[5] =  s.m[10] * s.m[13];
+   tmp[6] =  s.m[8] *  s.m[15];
+   tmp[7] =  s.m[11] * s.m[12];
+   tmp[8] =  s.m[8] *  s.m[14];
+   tmp[9] =  s.m[10] * s.m[12];
+   tmp[10] = s.m[8] *  s.m[13];
+   tmp[11] = s.m[9] *  s.m[12];
+
+   // calculate first 8 elements (cofactors)
+   r.m[0] = tmp[0]*s.m[5] + tmp[3]*s.m[6] + tmp[4]*s.m[7]
+           - tmp[1]*s.m[5] - tmp[2]*s.m[6] - tmp[5]*s.m[7];
+
+   r.m[1] = tmp[1]*s.m[4] + tmp[6]*s.m[6] + tmp[9]*s.m[7]
+            -tmp[0]*s.m[4] - tmp[7]*s.m[6] - tmp[8]*s.m[7];
+
+   r.m[2] = tmp[2]*s.m[4] + tmp[7]*s.m[5] + tmp[10]*s.m[7]
+            -tmp[3]*s.m[4] - tmp[6]*s.m[5] - tmp[11]*s.m[7];
+
+   r.m[3] = tmp[5]*s.m[4] + tmp[8]*s.m[5] + tmp[11]*s.m[6]
+            -tmp[4]*s.m[4] - tmp[9]*s.m[5] - tmp[10]*s.m[6];
+
+   r.m[4] = tmp[1]*s.m[1] + tmp[2]*s.m[2] + tmp[5]*s.m[3]
+            -tmp[0]*s.m[1] - tmp[3]*s.m[2] - tmp[4]*s.m[3];
+
+   r.m[5] = tmp[0]*s.m[0] + tmp[7]*s.m[2] + tmp[8]*s.m[3]
+            -tmp[1]*s.m[0] - tmp[6]*s.m[2] - tmp[9]*s.m[3];
+
+   r.m[6] = tmp[3]*s.m[0] + tmp[6]*s.m[1] + tmp[11]*s.m[3]
+            -tmp[2]*s.m[0] - tmp[7]*s.m[1] - tmp[10]*s.m[3];
+
+   r.m[7] = tmp[4]*s.m[0] + tmp[9]*s.m[1] + tmp[10]*s.m[2]
+            -tmp[5]*s.m[0] - tmp[8]*s.m[1] - tmp[11]*s.m[2];
+
+   // calculate pairs for second 8 elements (cofactors)
+   tmp[0] =  s.m[2] * s.m[7];
+   tmp[1] =  s.m[3] * s.m[6];
+   tmp[2] =  s.m[1] * s.m[7];
+   tmp[3] =  s.m[3] * s.m[5];
+   tmp[4] =  s.m[1] * s.m[6];
+   tmp[5] =  s.m[2] * s.m[5];
+   tmp[6] =  s.m[0] * s.m[7];
+   tmp[7] =  s.m[3] * s.m[4];
+   tmp[8] =  s.m[0] * s.m[6];
+   tmp[9] =  s.m[2] * s.m[4];
+   tmp[10] = s.m[0] * s.m[5];
+   tmp[11] = s.m[1] * s.m[4];
+
+   // calculate second 8 elements (cofactors)
+   r.m[8] = tmp[0]*s.m[13] + tmp[3]*s.m[14] + tmp[4]*s.m[15]
+            -tmp[1]*s.m[13] - tmp[2]*s.m[14] - tmp[5]*s.m[15];
+
+   r.m[9] = tmp[1]*s.m[12] + tmp[6]*s.m[14] + tmp[9]*s.m[15]
+            -tmp[0]*s.m[12] - tmp[7]*s.m[14] - tmp[8]*s.m[15];
+
+   r.m[10] = tmp[2]*s.m[12] + tmp[7]*s.m[13] + tmp[10]*s.m[15]
+             -tmp[3]*s.m[12] - tmp[6]*s.m[13] - tmp[11]*s.m[15];
+
+   r.m[11] = tmp[5]*s.m[12] + tmp[8]*s.m[13] + tmp[11]*s.m[14]
+             -tmp[4]*s.m[12] - tmp[9]*s.m[13] - tmp[10]*s.m[14];
+
+   r.m[12] = tmp[2]*s.m[10] + tmp[5]*s.m[11] + tmp[1]*s.m[9]
+             -tmp[4]*s.m[11] - tmp[0]*s.m[9] - tmp[3]*s.m[10];
+
+   r.m[13] = tmp[8]*s.m[11] + tmp[0]*s.m[8] + tmp[7]*s.m[10]
+             -tmp[6]*s.m[10] - tmp[9]*s.m[11] - tmp[1]*s.m[8];
+
+   r.m[14] = tmp[6]*s.m[9] + tmp[11]*s.m[11] + tmp[3]*s.m[8]
+             -tmp[10]*s.m[11] - tmp[2]*s.m[8] - tmp[7]*s.m[9];
+
+   r.m[15] = tmp[10]*s.m[10] + tmp[4]*s.m[8] + tmp[9]*s.m[9]
+             -tmp[8]*s.m[9] - tmp[11]*s.m[10] - tmp[5]*s.m[8];
+
+   // calculate determinant
+   det = s.m[0] * r.m[0]
+       + s.m[1] * r.m[1]
+       + s.m[2] * r.m[2]
+       + s.m[3] * r.m[3];
+
+   if (det == 0.0f) {
+      r = m_cx_mat4_identity();
+   }
+   else {
+      float m = 1.0f / det;
+      for (int i = 0; i < 16; i++)
+         r.m[i] *= m;
+   }
+   return r;
+}
+
+constexpr m_cx_mat4 m_cx_mat4_inverse(const m_cx_mat4 &s)
+{
+   return m_cx_mat4_transpose(m_cx_mat4_inverse_transpose(s));
+}
+
+constexpr float3 m_cx_mat4_transform3(const m_cx_mat4 &matrix, float3 v)
+{
+   float3 r = {
+      matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12],
+      matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13],
+      matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + matrix.m[14]
+   };
+   return r;
+}
+
+constexpr float4 m_cx_mat4_transform4(const m_cx_mat4 &matrix, float4 v)
+{
+   float4 r = {
+      matrix.m[0] * v.x + matrix.m[4] * v.y + matrix.m[8] * v.z + matrix.m[12] * v.w,
+      matrix.m[1] * v.x + matrix.m[5] * v.y + matrix.m[9] * v.z + matrix.m[13] * v.w,
+      matrix.m[2] * v.x + matrix.m[6] * v.y + matrix.m[10] * v.z + matrix.m[14] * v.w,
+      matrix.m[3] * v.x + matrix.m[7] * v.y + matrix.m[11] * v.z + matrix.m[15] * v.w
+   };
+   return r;
+}
+
+/* self checks, against the runtime results */
+static_assert(m_cx_sqrt(0.0f) == 0.0f && m_cx_sqrt(1.0f) == 1.0f && m_cx_sqrt(2.25f) == 1.5f && m_cx_sqrt(1e-30f) == 1e-15f, "m_cx_sqrt");
+static_assert(m_cx_sin(0.0f) == 0.0f && m_cx_cos(0.0f) == 1.0f && m_cx_tan(0.0f) == 0.0f, "m_cx trigonometry");
+static_assert(m_cx_sin(1.0f) == 0.841470957f && m_cx_cos(1.0f) == 0.540302277f && m_cx_tan(1.0f) == 1.55740774f, "m_cx trigonometry");
+static_assert(m_cx_sin(-4.0f) == 0.756802499f && m_cx_cos(100.0f) == 0.862318873f && m_cx_tan(10.0f) == 0.648360848f, "m_cx trigonometry");
+static_assert(m_cx_mat4_equal(m_cx_mat4_mul(m_cx_mat4_identity(), m_cx_mat4_scale(m_cx_float3(2.0f, 3.0f, 4.0f))), m_cx_mat4_scale(m_cx_float3(2.0f, 3.0f, 4.0f))), "m_cx_mat4_mul");
+static_assert(m_cx_mat4_transform3(m_cx_mat4_mul(m_cx_mat4_translation(m_cx_float3(1.0f, 2.0f, 3.0f)), m_cx_mat4_scale(m_cx_float3(2.0f, 2.0f, 2.0f))), m_cx_float3(1.0f, 1.0f, 1.0f)).z == 5.0f, "m_cx_mat4_transform3");
+static_assert(m_cx_mat4_equal(m_cx_mat4_inverse(m_cx_mat4_translation(m_cx_float3(1.0f, 2.0f, 3.0f))), m_cx_mat4_translation(m_cx_float3(-1.0f, -2.0f, -3.0f))), "m_cx_mat4_inverse");
+static_assert(m_cx_mat4_ortho(0.0f, 4.0f, 0.0f, 2.0f, -1.0f, 1.0f).m[0] == 0.5f && m_cx_mat4_ortho(0.0f, 4.0f, 0.0f, 2.0f, -1.0f, 1.0f).m[12] == -1.0f, "m_cx_mat4_ortho");
+static_assert(m_cx_mat4_lookat(m_cx_float3(0.0f, 0.0f, 5.0f), m_cx_float3(0.0f, 0.0f, -1.0f), m_cx_float3(0.0f, 1.0f, 0.0f)).m[14] == -5.0f, "m_cx_mat4_lookat");
+
+#endif
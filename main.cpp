@@ -2,11 +2,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <atomic>
 #define GLFW_INCLUDE_GLCOREARB
 #include <GLFW/glfw3.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
 #define M_MATH_IMPLEMENTATION
 #include "m_math.h"
+#include "m_math_constexpr.h"
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #define STB_RECT_PACK_IMPLEMENTATION
@@ -24,6 +37,40 @@
 #define WINDOW_W 600
 #define WINDOW_H 600
 
+#define FONT_ATLAS_MIP_LEVELS 4 // mips below the base level, fewer if the padded glyphs don't fit
+#define FONT_ATLAS_BC4 1        // upload the atlas as BC4/RGTC1 when the driver has it
+
+#ifndef GL_COMPRESSED_RED_RGTC1
+#define GL_COMPRESSED_RED_RGTC1 0x8DBB
+#endif
+
+// How much GL error checking is compiled in:
+//   0  none, GL_ERR does nothing (the default with NDEBUG)
+//   1  errors come from the KHR_debug callback as the driver finds them, and
+//      GL_ERR only looks at what it reported; without KHR_debug, GL_ERR calls
+//      glGetError on one frame in GL_ERROR_SAMPLE_FRAMES (the default)
+//   2  GL_ERR calls glGetError every time, which can stall the driver
+#ifndef GL_ERROR_CHECKS
+#ifdef NDEBUG
+#define GL_ERROR_CHECKS 0
+#else
+#define GL_ERROR_CHECKS 1
+#endif
+#endif
+#define GL_ERROR_SAMPLE_FRAMES 60
+
+#ifndef GL_DEBUG_OUTPUT
+#define GL_DEBUG_OUTPUT 0x92E0
+#define GL_DEBUG_TYPE_ERROR 0x824C
+#define GL_DEBUG_SEVERITY_NOTIFICATION 0x826B
+#endif
+#ifndef GL_DONT_CARE
+#define GL_DONT_CARE 0x1100
+#endif
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
 void close_callback(GLFWwindow * window) {
     printf("close_callback");
 }
@@ -32,7 +79,51 @@ void size_callback(GLFWwindow * window, int width, int height) {
     printf("size_callback");
 }
 
-void cursorpos_callback(GLFWwindow * window, double mx, double my) {}
+// glyph quads as flat boxes in a bvh, so the glyph under the cursor is found
+// without testing every quad of the text
+struct glyph_picker {
+    m_bvh bvh;
+    const float *inverse_view_projection;
+    const char *text;
+    int hovered;
+};
+
+void cursorpos_callback(GLFWwindow * window, double mx, double my) {
+    glyph_picker *picker = (glyph_picker *) glfwGetWindowUserPointer(window);
+    if (!picker) {
+        return;
+    }
+
+    int width, height;
+    glfwGetWindowSize(window, &width, &height);
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    // unproject the cursor on the near and far planes to get the ray
+    float4 ndc_near, ndc_far, near_point, far_point;
+    ndc_near.x = ndc_far.x = (float)(2.0 * mx / width - 1.0);
+    ndc_near.y = ndc_far.y = (float)(1.0 - 2.0 * my / height);
+    ndc_near.z = -1.0f;
+    ndc_far.z = 1.0f;
+    ndc_near.w = ndc_far.w = 1.0f;
+    m_mat4_transform4(&near_point, picker->inverse_view_projection, &ndc_near);
+    m_mat4_transform4(&far_point, picker->inverse_view_projection, &ndc_far);
+
+    float3 ray_origin, ray_target, ray_direction;
+    ray_origin.x = near_point.x / near_point.w;
+    ray_origin.y = near_point.y / near_point.w;
+    ray_origin.z = near_point.z / near_point.w;
+    ray_target.x = far_point.x / far_point.w;
+    ray_target.y = far_point.y / far_point.w;
+    ray_target.z = far_point.z / far_point.w;
+    M_SUB3(ray_direction, ray_target, ray_origin);
+    M_NORMALIZE3(ray_direction, ray_direction);
+
+    float distance;
+    int hit = m_bvh_ray_nearest(&picker->bvh, &ray_origin, &ray_direction, &distance);
+    picker->hovered = hit;
+}
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
     printf("key_callback\n");
@@ -58,8 +149,9 @@ void print_gl_string(const char *name, GLenum s) {
     printf("GL %s = %s\n", name, v);
 }
 
-void gl_error(const char *file, int line) {
-    bool has_errors = false;
+// Prints any pending GL errors; returns the number found.
+int gl_error_print(const char *file, int line) {
+    int errors = 0;
     for (GLint error = glGetError(); error; error = glGetError()) {
         printf("\tGL_ERROR: file:%s:%d -- Hex: 0x%x Dec: %d)\n", file, line, error, error);
         switch (error) {
@@ -81,12 +173,123 @@ void gl_error(const char *file, int line) {
             default:
                 printf("\t__UNEXPECTED_VALUE__)\n");
         }
-        has_errors = true;
+        ++errors;
     }
-    assert(!has_errors);
+    return errors;
 }
 
+void gl_error(const char *file, int line) {
+    if (gl_error_print(file, line)) {
+        assert(!"GL error");
+    }
+}
+
+// State behind GL_ERR with GL_ERROR_CHECKS 1. The debug callback can run on
+// a driver thread, so it only prints and counts.
+struct gl_error_state {
+    bool debug_output;         // the KHR_debug callback is installed
+    std::atomic<int> reported; // errors the callback has seen
+    int checked;               // of those, how many GL_ERR has already seen
+    int frame;
+    const char *last_file;     // where the last sampled check was
+    int last_line;
+};
+
+gl_error_state gl_errors;
+
+typedef void (APIENTRY *gl_debug_proc)(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                       GLsizei length, const GLchar *message, const void *user);
+typedef void (APIENTRY *gl_debug_message_callback_proc)(gl_debug_proc callback, const void *user);
+typedef void (APIENTRY *gl_debug_message_control_proc)(GLenum source, GLenum type, GLenum severity,
+                                                        GLsizei count, const GLuint *ids, GLboolean enabled);
+
+void APIENTRY gl_debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+                                GLsizei length, const GLchar *message, const void *user) {
+    printf("\tGL_DEBUG: %s 0x%x (source 0x%x, severity 0x%x): %s\n",
+           type == GL_DEBUG_TYPE_ERROR ? "error" : "message", id, source, severity, message);
+    if (type == GL_DEBUG_TYPE_ERROR) {
+        ++gl_errors.reported;
+    }
+}
+
+// Call once the context is current. With GL_ERROR_CHECKS 1, installs the
+// debug callback if the context has KHR_debug (or ARB_debug_output); the
+// window should have asked for a debug context for it to say much.
+void gl_errors_init(GLFWwindow *window) {
+    gl_errors.debug_output = false;
+    gl_errors.reported = 0;
+    gl_errors.checked = 0;
+    gl_errors.frame = 0;
+    gl_errors.last_file = "startup";
+    gl_errors.last_line = 0;
+#if GL_ERROR_CHECKS == 1
+    int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+    bool khr = major > 4 || (major == 4 && minor >= 3) || glfwExtensionSupported("GL_KHR_debug");
+    bool arb = !khr && glfwExtensionSupported("GL_ARB_debug_output");
+    if (!khr && !arb) {
+        printf("GL errors: no KHR_debug, checking one frame in %d\n", GL_ERROR_SAMPLE_FRAMES);
+        return;
+    }
+    gl_debug_message_callback_proc callback =
+        (gl_debug_message_callback_proc) glfwGetProcAddress(khr ? "glDebugMessageCallback" : "glDebugMessageCallbackARB");
+    gl_debug_message_control_proc control =
+        (gl_debug_message_control_proc) glfwGetProcAddress(khr ? "glDebugMessageControl" : "glDebugMessageControlARB");
+    if (!callback) {
+        return;
+    }
+    // anything already pending happened before the callback could see it
+    gl_error("startup", 0);
+    callback(gl_debug_callback, NULL);
+    if (control) {
+        control(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+    }
+    if (khr) {
+        glEnable(GL_DEBUG_OUTPUT); // asynchronous, so it doesn't slow the driver down
+    }
+    gl_errors.debug_output = true;
+    printf("GL errors: reported by the debug callback\n");
+#else
+    (void) window;
+#endif
+}
+
+// GL_ERR with GL_ERROR_CHECKS 1. Never calls glGetError with the callback in
+// place; without it, only on sampled frames, so an error shows up at the
+// first check after it happened and may have been raised up to
+// GL_ERROR_SAMPLE_FRAMES frames earlier.
+void gl_error_check(const char *file, int line) {
+    if (gl_errors.debug_output) {
+        int reported = gl_errors.reported;
+        if (reported != gl_errors.checked) {
+            printf("\tGL_ERROR: %d from the debug callback, seen at %s:%d\n", reported - gl_errors.checked, file, line);
+            gl_errors.checked = reported;
+            assert(!"GL error");
+        }
+        return;
+    }
+    if (gl_errors.frame % GL_ERROR_SAMPLE_FRAMES != 0) {
+        return;
+    }
+    if (gl_error_print(file, line)) {
+        printf("\tsince the check at %s:%d\n", gl_errors.last_file, gl_errors.last_line);
+        assert(!"GL error");
+    }
+    gl_errors.last_file = file;
+    gl_errors.last_line = line;
+}
+
+// GL_ERR_NEXT_FRAME goes once per frame, for the sampling
+#if GL_ERROR_CHECKS == 0
+#define GL_ERR ((void) 0)
+#define GL_ERR_NEXT_FRAME ((void) 0)
+#elif GL_ERROR_CHECKS == 1
+#define GL_ERR gl_error_check(__FILE__, __LINE__)
+#define GL_ERR_NEXT_FRAME ((void) ++gl_errors.frame)
+#else
 #define GL_ERR gl_error(__FILE__, __LINE__)
+#define GL_ERR_NEXT_FRAME ((void) 0)
+#endif
 
 GLuint compile_shader(GLenum type, const char *src) {
     GLuint shader;
@@ -114,7 +317,6 @@ inline float *push_v4_arr(float *v, float x, float y, float z, float a) {
     v[1] = y;
     v[2] = z;
     v[3] = a;
-    printf("push_v4_arr: %f, %f, %f, %f\n",  x, y, z, a);
     return v + 4;
 }
 
@@ -124,7 +326,6 @@ inline float *push_v5_arr(float *v, float x, float y, float z, float s, float t)
     v[2] = z;
     v[3] = s;
     v[4] = t;
-    printf("push_v5_arr: %f, %f, %f, %f, %f\n",  x, y, z, s, t);
     return v + 5;
 }
 
@@ -154,6 +355,35 @@ float* push_textured_quad_scaled_arr(float*v, float x0, float y0, float x1, floa
     return push_textured_quad_arr(v, x0 * scale_x, y0 * scale_y, x1 * scale_x, y1 * scale_y, s0, t0, s1, t1);
 }
 
+// Lays out text in screen pixels with the baked font, its top left corner at
+// x, y (y down) and scale screen pixels per font pixel; '\n' starts a new
+// line. Returns the number of glyph quads written, at most max_glyphs.
+int layout_text(float *v, int max_glyphs, const stbtt_bakedchar *cdata, int atlas_width, int atlas_height,
+                char first_char, int char_count, float font_size, float x, float y, float scale, const char *text) {
+    float pen_x = 0;
+    float pen_y = font_size * 0.8f; // roughly the ascent
+    int glyphs = 0;
+    for (const char *c = text; *c && glyphs < max_glyphs; ++c) {
+        if (*c == '\n') {
+            pen_x = 0;
+            pen_y += font_size;
+            continue;
+        }
+        int index = *c - first_char;
+        if (index < 0 || index >= char_count) {
+            continue;
+        }
+        stbtt_aligned_quad q;
+        stbtt_GetBakedQuad(cdata, atlas_width, atlas_height, index, &pen_x, &pen_y, &q, 1);
+        if (q.x0 == q.x1 || q.y0 == q.y1) {
+            continue; // spaces
+        }
+        v = push_textured_quad_arr(v, x + q.x0 * scale, y + q.y0 * scale, x + q.x1 * scale, y + q.y1 * scale, q.s0, q.t0, q.s1, q.t1);
+        ++glyphs;
+    }
+    return glyphs;
+}
+
 void set_float3(float3 *v, float x, float y, float z) {
     v->x = x;
     v->y = y;
@@ -165,6 +395,72 @@ void set_float2(float2 *v, float x, float y) {
     v->y = y;
 }
 
+// a string keeps its glyph quads and boxes, so that a culling pass can copy
+// only the visible glyphs into the vertex buffer every frame
+struct text_string {
+    const float *vertices;   // floats_per_glyph per glyph
+    float3 *glyph_min;
+    float3 *glyph_max;
+    float3 box_min;          // whole string, tested before its glyphs
+    float3 box_max;
+    int glyph_count;
+};
+
+struct cull_stats {
+    int drawn;
+    int culled;
+};
+
+void text_string_update_box(text_string *s) {
+    s->box_min = s->glyph_min[0];
+    s->box_max = s->glyph_max[0];
+    for (int i = 1; i < s->glyph_count; ++i) {
+        M_MIN3(s->box_min, s->box_min, s->glyph_min[i]);
+        M_MAX3(s->box_max, s->box_max, s->glyph_max[i]);
+    }
+}
+
+// copies the glyphs inside the frustum to dest, one memcpy per run of visible
+// glyphs, and returns how many were copied
+int cull_text(float *dest, int floats_per_glyph, text_string *strings, int string_count, float4 *planes, cull_stats *stats) {
+    int written = 0;
+    for (int i = 0; i < string_count; ++i) {
+        text_string *s = &strings[i];
+        if (s->glyph_count <= 0) {
+            continue;
+        }
+
+        int hit = m_3d_box_to_frustum_collision(planes, &s->box_min, &s->box_max);
+        if (hit == 0) {
+            stats->culled += s->glyph_count;
+            continue;
+        }
+        if (hit == 2) {
+            memcpy(dest + written * floats_per_glyph, s->vertices, sizeof(float) * floats_per_glyph * s->glyph_count);
+            written += s->glyph_count;
+            stats->drawn += s->glyph_count;
+            continue;
+        }
+
+        int first = written, run_start = -1;
+        for (int g = 0; g <= s->glyph_count; ++g) {
+            bool visible = g < s->glyph_count && m_3d_box_to_frustum_collision(planes, &s->glyph_min[g], &s->glyph_max[g]);
+            if (visible && run_start < 0) {
+                run_start = g;
+            }
+            else if (!visible && run_start >= 0) {
+                int run = g - run_start;
+                memcpy(dest + written * floats_per_glyph, s->vertices + run_start * floats_per_glyph, sizeof(float) * floats_per_glyph * run);
+                written += run;
+                run_start = -1;
+            }
+        }
+        stats->drawn += written - first;
+        stats->culled += s->glyph_count - (written - first);
+    }
+    return written;
+}
+
 const unsigned char* read_entire_file(char* filename) {
     unsigned char *result = 0;
     
@@ -248,6 +544,787 @@ GLuint upload_new_texture(int width, int height, int channels, unsigned char* pi
     return tex;
 }
 
+// Font atlas mip chain. The glyphs are moved onto a grid of block x block
+// cells with an empty cell after each glyph, where block is 2^levels: every
+// block then holds texels of one glyph only, so box filtered mips down to
+// that level never blend two glyphs together.
+struct font_atlas {
+    int width, height;
+    int levels;                                        // mips below level 0
+    unsigned char *pixels[FONT_ATLAS_MIP_LEVELS + 1];  // level 0 .. levels
+};
+
+// returns 0 and leaves chars alone if the padded glyphs don't fit
+int font_atlas_repack(unsigned char *dest, const unsigned char *src, int width, int height, stbtt_bakedchar *chars, int char_count, int block) {
+    int grid_w = width / block, grid_h = height / block;
+    std::vector<stbrp_node> nodes(grid_w);
+    std::vector<stbrp_rect> rects(char_count);
+    stbrp_context context;
+
+    for (int i = 0; i < char_count; ++i) {
+        rects[i].id = i;
+        rects[i].w = (chars[i].x1 - chars[i].x0 + block - 1) / block + 1;
+        rects[i].h = (chars[i].y1 - chars[i].y0 + block - 1) / block + 1;
+    }
+    stbrp_init_target(&context, grid_w, grid_h, nodes.data(), grid_w);
+    if (!stbrp_pack_rects(&context, rects.data(), char_count)) {
+        return 0;
+    }
+
+    memset(dest, 0, width * height);
+    for (int i = 0; i < char_count; ++i) {
+        stbtt_bakedchar *c = &chars[i];
+        int x = rects[i].x * block, y = rects[i].y * block;
+        int w = c->x1 - c->x0, h = c->y1 - c->y0;
+        for (int row = 0; row < h; ++row) {
+            memcpy(dest + (y + row) * width + x, src + (c->y0 + row) * width + c->x0, w);
+        }
+        c->x0 = x;
+        c->y0 = y;
+        c->x1 = x + w;
+        c->y1 = y + h;
+    }
+    return 1;
+}
+
+// 2x2 box filter, rounded: (a + b + c + d + 2) / 4
+void font_atlas_downsample(unsigned char *dest, const unsigned char *src, int src_width, int src_height) {
+    int w = src_width / 2, h = src_height / 2;
+    for (int y = 0; y < h; ++y) {
+        const unsigned char *row0 = src + (y * 2) * src_width;
+        const unsigned char *row1 = row0 + src_width;
+        unsigned char *out = dest + y * w;
+        int x = 0;
+#ifdef HAVE_SSE2
+        // 16 output texels from 32 texels of each row: even and odd bytes
+        // become 16 bit lanes, so the sums can't overflow
+        const __m128i low = _mm_set1_epi16(0xff), two = _mm_set1_epi16(2);
+        for (; x + 16 <= w; x += 16) {
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + x * 2));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + x * 2 + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + x * 2));
+            __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + x * 2 + 16));
+            __m128i s0 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a0, low), _mm_srli_epi16(a0, 8)),
+                                       _mm_add_epi16(_mm_and_si128(b0, low), _mm_srli_epi16(b0, 8)));
+            __m128i s1 = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a1, low), _mm_srli_epi16(a1, 8)),
+                                       _mm_add_epi16(_mm_and_si128(b1, low), _mm_srli_epi16(b1, 8)));
+            s0 = _mm_srli_epi16(_mm_add_epi16(s0, two), 2);
+            s1 = _mm_srli_epi16(_mm_add_epi16(s1, two), 2);
+            _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(s0, s1));
+        }
+#endif
+        for (; x < w; ++x) {
+            out[x] = (unsigned char)((row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] + row1[x * 2 + 1] + 2) >> 2);
+        }
+    }
+}
+
+// repacks the baked atlas for as many mip levels as fit (at most
+// FONT_ATLAS_MIP_LEVELS) and builds them; chars are moved with the glyphs
+void font_atlas_build(font_atlas *atlas, const unsigned char *bitmap, int width, int height, stbtt_bakedchar *chars, int char_count) {
+    atlas->width = width;
+    atlas->height = height;
+    atlas->pixels[0] = (unsigned char *) malloc(width * height);
+
+    int levels = FONT_ATLAS_MIP_LEVELS;
+    while (levels > 0 && ((width | height) & ((1 << levels) - 1))) {
+        --levels;
+    }
+    while (levels > 0 && !font_atlas_repack(atlas->pixels[0], bitmap, width, height, chars, char_count, 1 << levels)) {
+        --levels;
+    }
+    if (levels == 0) {
+        memcpy(atlas->pixels[0], bitmap, width * height);
+    }
+
+    atlas->levels = levels;
+    for (int level = 1; level <= levels; ++level) {
+        int w = width >> level, h = height >> level;
+        atlas->pixels[level] = (unsigned char *) malloc(w * h);
+        font_atlas_downsample(atlas->pixels[level], atlas->pixels[level - 1], w * 2, h * 2);
+    }
+}
+
+void font_atlas_free(font_atlas *atlas) {
+    for (int level = 0; level <= atlas->levels; ++level) {
+        free(atlas->pixels[level]);
+    }
+    atlas->levels = -1;
+}
+
+// BC4 (RGTC1): 8 bytes per 4x4 block, two endpoints and a 3 bit palette index
+// per texel. red0 > red1 interpolates 6 values between them, red0 <= red1
+// interpolates 4 and adds exact 0 and 255, which suits glyph edges: both modes
+// are tried with the block's min and max (without 0 and 255 for the second).
+int bc4_fit(unsigned char *dest, const unsigned char *texels, int red0, int red1) {
+    int palette[8] = {red0, red1};
+    if (red0 > red1) {
+        for (int i = 2; i < 8; ++i) palette[i] = ((8 - i) * red0 + (i - 1) * red1) / 7;
+    }
+    else {
+        for (int i = 2; i < 6; ++i) palette[i] = ((6 - i) * red0 + (i - 1) * red1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    unsigned long long bits = 0;
+    int error = 0;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0, best_error = 256;
+        for (int j = 0; j < 8; ++j) {
+            int e = abs(texels[i] - palette[j]);
+            if (e < best_error) {
+                best = j;
+                best_error = e;
+            }
+        }
+        bits |= (unsigned long long) best << (3 * i);
+        error += best_error * best_error;
+    }
+
+    dest[0] = (unsigned char) red0;
+    dest[1] = (unsigned char) red1;
+    for (int i = 0; i < 6; ++i) {
+        dest[2 + i] = (unsigned char) (bits >> (8 * i));
+    }
+    return error;
+}
+
+void encode_bc4_block(unsigned char *dest, const unsigned char *texels /* 16 */) {
+    int lo = 255, hi = 0, inner_lo = 255, inner_hi = 0;
+    for (int i = 0; i < 16; ++i) {
+        lo = M_MIN(lo, texels[i]);
+        hi = M_MAX(hi, texels[i]);
+        if (texels[i] != 0 && texels[i] != 255) {
+            inner_lo = M_MIN(inner_lo, texels[i]);
+            inner_hi = M_MAX(inner_hi, texels[i]);
+        }
+    }
+
+    if (hi == lo) {
+        memset(dest, 0, 8);
+        dest[0] = dest[1] = (unsigned char) hi; // every index 0 is red0
+        return;
+    }
+    int error = bc4_fit(dest, texels, hi, lo);
+    if (error > 0 && (lo == 0 || hi == 255)) {
+        unsigned char other[8];
+        if (inner_lo > inner_hi) {
+            inner_lo = inner_hi = 0;
+        }
+        if (bc4_fit(other, texels, inner_lo, inner_hi) < error) {
+            memcpy(dest, other, 8);
+        }
+    }
+}
+
+// returns the size of the encoded level, (width / 4) * (height / 4) * 8 rounded up
+int encode_bc4(unsigned char *dest, const unsigned char *src, int width, int height) {
+    int blocks_w = (width + 3) / 4, blocks_h = (height + 3) / 4;
+    for (int by = 0; by < blocks_h; ++by) {
+        for (int bx = 0; bx < blocks_w; ++bx) {
+            unsigned char texels[16];
+            for (int i = 0; i < 16; ++i) {
+                int x = M_MIN(bx * 4 + (i & 3), width - 1);
+                int y = M_MIN(by * 4 + (i >> 2), height - 1);
+                texels[i] = src[y * width + x];
+            }
+            encode_bc4_block(dest + (by * blocks_w + bx) * 8, texels);
+        }
+    }
+    return blocks_w * blocks_h * 8;
+}
+
+GLuint upload_font_atlas(const font_atlas *atlas, bool bc4) {
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, atlas->levels > 0 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // deeper mips would mix glyphs
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, atlas->levels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    std::vector<unsigned char> blocks;
+    for (int level = 0; level <= atlas->levels; ++level) {
+        int w = atlas->width >> level, h = atlas->height >> level;
+        if (bc4) {
+            blocks.resize(((w + 3) / 4) * ((h + 3) / 4) * 8);
+            int size = encode_bc4(blocks.data(), atlas->pixels[level], w, h);
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_COMPRESSED_RED_RGTC1, w, h, 0, size, blocks.data());
+        }
+        else {
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RED, w, h, 0, GL_RED, GL_UNSIGNED_BYTE, atlas->pixels[level]);
+        }
+    }
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+// Decodes images on worker threads; the GL thread uploads them as they finish.
+//
+// With streaming on, uploads go through a small ring of pixel-unpack buffers.
+// A worker reads the image header first, the GL thread maps a free buffer for
+// it, and the worker decodes straight into the mapped memory. All the GL
+// thread does per image is unmap, glTexSubImage2D from the buffer and drop a
+// fence; the driver copies in the background, and the buffer is only handed
+// out again once its fence has signaled, so it is mapped unsynchronized.
+#define TEXTURE_STAGING_BUFFERS 4
+
+struct staging_buffer {
+    GLuint pbo;
+    GLsizeiptr size;
+    GLsync fence; // set after the copy out of the buffer, until it signals
+    bool mapped;  // a worker is decoding into it
+};
+
+struct image_job {
+    std::string filename;
+    bool flip;
+    GLuint *texture; // set by the GL thread once uploaded
+    int width, height, channels;
+    unsigned char *pixels;
+    int stride;  // bytes per row in pixels
+    int staging; // index of the staging buffer holding pixels, -1 if malloc'd
+    const char *failure;
+};
+
+struct asset_loader {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable job_done;
+    std::deque<image_job> pending;
+    std::deque<image_job> sized;    // header read, waiting for a staging buffer
+    std::deque<image_job> finished;
+    int in_flight;
+    bool quit;
+    bool streaming;
+    size_t bytes_uploaded; // only touched on the GL thread
+    staging_buffer staging[TEXTURE_STAGING_BUFFERS]; // only touched on the GL thread
+};
+
+void asset_loader_worker(asset_loader *loader) {
+    for (;;) {
+        image_job job;
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            loader->work_ready.wait(lock, [loader] { return loader->quit || !loader->pending.empty(); });
+            if (loader->pending.empty()) {
+                return;
+            }
+            job = loader->pending.front();
+            loader->pending.pop_front();
+        }
+
+        // flip and failure reason are per thread, so other loads don't interfere
+        stbi_set_flip_vertically_on_load_thread(job.flip);
+        bool sized = false;
+        if (!loader->streaming) {
+            job.pixels = stbi_load(job.filename.c_str(), &job.width, &job.height, &job.channels, 0);
+            job.failure = job.pixels ? NULL : stbi_failure_reason();
+        } else if (job.staging < 0) {
+            // only the header for now; the GL thread picks a buffer to decode into
+            sized = stbi_info(job.filename.c_str(), &job.width, &job.height, &job.channels) != 0;
+            job.failure = sized ? NULL : stbi_failure_reason();
+            if (job.channels == 2) {
+                job.channels = 4;
+            }
+            job.stride = (job.width * job.channels + 3) & ~3; // GL_UNPACK_ALIGNMENT is 4
+        } else {
+            int x, y, n;
+            if (!stbi_load_into(job.filename.c_str(), &x, &y, &n, job.channels, job.pixels, job.width, job.height, job.stride)) {
+                job.failure = stbi_failure_reason();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(loader->mutex);
+            if (sized) {
+                loader->sized.push_back(job);
+            } else {
+                loader->finished.push_back(job);
+            }
+        }
+        loader->job_done.notify_one();
+    }
+}
+
+void asset_loader_start(asset_loader *loader, int num_threads, bool streaming) {
+    loader->in_flight = 0;
+    loader->quit = false;
+    loader->streaming = streaming;
+    loader->bytes_uploaded = 0;
+    for (int i = 0; i < TEXTURE_STAGING_BUFFERS; ++i) {
+        loader->staging[i].pbo = 0;
+        loader->staging[i].size = 0;
+        loader->staging[i].fence = 0;
+        loader->staging[i].mapped = false;
+    }
+    if (streaming) {
+        GLuint pbos[TEXTURE_STAGING_BUFFERS];
+        glGenBuffers(TEXTURE_STAGING_BUFFERS, pbos);
+        for (int i = 0; i < TEXTURE_STAGING_BUFFERS; ++i) {
+            loader->staging[i].pbo = pbos[i];
+        }
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    for (int i = 0; i < num_threads; ++i) {
+        loader->workers.push_back(std::thread(asset_loader_worker, loader));
+    }
+}
+
+void asset_loader_load_image(asset_loader *loader, const char *filename, bool flip, GLuint *texture) {
+    image_job job;
+    job.filename = filename;
+    job.flip = flip;
+    job.texture = texture;
+    job.width = job.height = job.channels = 0;
+    job.pixels = NULL;
+    job.stride = 0;
+    job.staging = -1;
+    job.failure = NULL;
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->pending.push_back(job);
+        ++loader->in_flight;
+    }
+    loader->work_ready.notify_one();
+}
+
+// Returns a staging buffer that is neither mapped nor still being copied
+// from, or -1. With wait set, blocks on a fence if no buffer is free yet.
+int staging_buffer_acquire(asset_loader *loader, bool wait) {
+    int fenced = -1;
+    for (int i = 0; i < TEXTURE_STAGING_BUFFERS; ++i) {
+        staging_buffer *buffer = &loader->staging[i];
+        if (buffer->mapped) {
+            continue;
+        }
+        if (buffer->fence) {
+            if (glClientWaitSync(buffer->fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+                fenced = i;
+                continue;
+            }
+            glDeleteSync(buffer->fence);
+            buffer->fence = 0;
+        }
+        return i;
+    }
+    if (wait && fenced >= 0) {
+        staging_buffer *buffer = &loader->staging[fenced];
+        while (glClientWaitSync(buffer->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(buffer->fence);
+        buffer->fence = 0;
+        return fenced;
+    }
+    return -1;
+}
+
+// Maps a staging buffer for a job whose header has been read and sends it
+// back to the workers to decode into. Returns false if none is free.
+bool asset_loader_map_staging(asset_loader *loader, image_job *job, bool wait) {
+    int index = staging_buffer_acquire(loader, wait);
+    if (index < 0) {
+        return false;
+    }
+    staging_buffer *buffer = &loader->staging[index];
+    GLsizeiptr size = (GLsizeiptr) job->stride * job->height;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->pbo);
+    if (buffer->size < size) {
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        buffer->size = size;
+    }
+    // the fence has signaled, so nothing is reading it and there's no need to sync
+    job->pixels = (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!job->pixels) {
+        job->failure = "couldn't map a pixel unpack buffer";
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->finished.push_back(*job);
+        return true;
+    }
+    buffer->mapped = true;
+    job->staging = index;
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->pending.push_back(*job);
+    }
+    loader->work_ready.notify_one();
+    return true;
+}
+
+// Unmaps the job's staging buffer and copies it into a new texture; the copy
+// runs on the GPU timeline and the fence says when the buffer is free again.
+void asset_loader_upload_staged(asset_loader *loader, image_job *job) {
+    staging_buffer *buffer = &loader->staging[job->staging];
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->pbo);
+    bool intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+    buffer->mapped = false;
+    if (!job->failure && !intact) {
+        job->failure = "pixel unpack buffer contents were lost";
+    }
+    if (!job->failure) {
+        GLenum format = job->channels == 3 ? GL_RGB : job->channels == 4 ? GL_RGBA : GL_RED;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        *job->texture = upload_new_texture(job->width, job->height, job->channels, NULL);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer->pbo);
+        glBindTexture(GL_TEXTURE_2D, *job->texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, job->width, job->height, format, GL_UNSIGNED_BYTE, (void *) 0);
+        loader->bytes_uploaded += (size_t) job->stride * job->height;
+        glBindTexture(GL_TEXTURE_2D, 0);
+        buffer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    job->pixels = NULL;
+}
+
+// Call from the GL thread. Hands out staging buffers and uploads whatever has
+// finished decoding; with wait set, keeps going until nothing is left in
+// flight. Returns the number of images still in flight.
+int asset_loader_upload_finished(asset_loader *loader, bool wait) {
+    for (;;) {
+        // a decode in progress frees its buffer soon, so only block on a
+        // fence when every buffer is waiting on the GPU
+        bool decoding = false;
+        for (int i = 0; i < TEXTURE_STAGING_BUFFERS; ++i) {
+            decoding = decoding || loader->staging[i].mapped;
+        }
+        for (;;) {
+            image_job job;
+            {
+                std::lock_guard<std::mutex> lock(loader->mutex);
+                if (loader->sized.empty()) {
+                    break;
+                }
+                job = loader->sized.front();
+            }
+            if (!asset_loader_map_staging(loader, &job, wait && !decoding)) {
+                break;
+            }
+            decoding = true;
+            std::lock_guard<std::mutex> lock(loader->mutex);
+            loader->sized.pop_front();
+        }
+
+        image_job job;
+        {
+            std::unique_lock<std::mutex> lock(loader->mutex);
+            if (wait) {
+                size_t sized = loader->sized.size();
+                loader->job_done.wait(lock, [loader, sized] {
+                    return loader->in_flight == 0 || !loader->finished.empty() || loader->sized.size() > sized;
+                });
+            }
+            if (loader->finished.empty()) {
+                if (!wait || loader->in_flight == 0) {
+                    return loader->in_flight;
+                }
+                continue;
+            }
+            job = loader->finished.front();
+            loader->finished.pop_front();
+            --loader->in_flight;
+        }
+
+        if (job.staging >= 0) {
+            asset_loader_upload_staged(loader, &job);
+        }
+        if (job.failure) {
+            printf("FAILED TO LOAD %s: %s\n", job.filename.c_str(), job.failure);
+            assert(job.failure == NULL);
+            continue;
+        }
+        if (job.staging < 0) {
+            *job.texture = upload_new_texture(job.width, job.height, job.channels, job.pixels);
+            loader->bytes_uploaded += (size_t) job.width * job.height * job.channels;
+            stbi_image_free(job.pixels);
+        }
+        printf("Loaded %s: %d %d %d\n", job.filename.c_str(), job.width, job.height, job.channels);
+    }
+}
+
+void asset_loader_stop(asset_loader *loader) {
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->quit = true;
+    }
+    loader->work_ready.notify_all();
+    for (size_t i = 0; i < loader->workers.size(); ++i) {
+        loader->workers[i].join();
+    }
+    loader->workers.clear();
+
+    // deleting a buffer unmaps it, and GL keeps it around until the copies out
+    // of it are done
+    for (int i = 0; i < TEXTURE_STAGING_BUFFERS; ++i) {
+        staging_buffer *buffer = &loader->staging[i];
+        if (buffer->fence) {
+            glDeleteSync(buffer->fence);
+        }
+        if (buffer->pbo) {
+            glDeleteBuffers(1, &buffer->pbo);
+        }
+        buffer->pbo = 0;
+        buffer->fence = 0;
+        buffer->mapped = false;
+    }
+}
+
+// Frame profiler. CPU zones are timed with glfwGetTime and GPU zones with
+// GL_TIMESTAMP queries, which are read back PROFILER_GPU_LATENCY frames later
+// so the CPU doesn't wait on the GPU. The last PROFILER_FRAMES frames are kept
+// in a ring for the overlay and written out as a Chrome trace on exit.
+#define PROFILER_FRAMES 240
+#define PROFILER_MAX_ZONES 32    // per frame, CPU and GPU zones together
+#define PROFILER_GPU_LATENCY 4   // frames before the timer queries are read
+#define PROFILER_REPORT_FRAMES 60
+
+enum profile_counter {
+    PROFILE_GLYPHS_DRAWN,
+    PROFILE_DRAW_CALLS,
+    PROFILE_BYTES_UPLOADED,
+    PROFILE_GLYPHS_CULLED,
+    PROFILE_COUNTERS
+};
+
+const char *profile_counter_names[PROFILE_COUNTERS] = {"glyphs drawn", "draw calls", "bytes uploaded", "glyphs culled"};
+
+struct profile_zone {
+    const char *name;  // kept as is, so a string literal
+    double begin, end; // seconds on the glfwGetTime clock, GPU zones too
+    bool gpu;
+};
+
+struct profile_frame {
+    double begin, end;
+    bool resolved; // GPU zone times are in
+    int zone_count;
+    profile_zone zones[PROFILER_MAX_ZONES];
+    double counters[PROFILE_COUNTERS];
+};
+
+struct profiler {
+    profile_frame *frames; // ring of PROFILER_FRAMES
+    int frame;             // number of the frame being recorded
+    bool gpu;              // timer queries are available
+    GLint64 gpu_base;      // GL_TIMESTAMP at cpu_base, in nanoseconds
+    double cpu_base;
+    GLuint queries[PROFILER_GPU_LATENCY][PROFILER_MAX_ZONES * 2];
+};
+
+void profiler_start(profiler *p, bool gpu_timers) {
+    p->frames = (profile_frame *) calloc(PROFILER_FRAMES, sizeof(profile_frame));
+    p->frame = 0;
+    p->gpu = gpu_timers;
+    p->gpu_base = 0;
+    p->cpu_base = glfwGetTime();
+    if (gpu_timers) {
+        glGenQueries(PROFILER_GPU_LATENCY * PROFILER_MAX_ZONES * 2, &p->queries[0][0]);
+        glGetInteger64v(GL_TIMESTAMP, &p->gpu_base);
+        p->cpu_base = glfwGetTime();
+    }
+}
+
+void profiler_stop(profiler *p) {
+    if (p->gpu) {
+        glDeleteQueries(PROFILER_GPU_LATENCY * PROFILER_MAX_ZONES * 2, &p->queries[0][0]);
+    }
+    free(p->frames);
+    p->frames = NULL;
+}
+
+profile_frame *profiler_frame(profiler *p, int frame) {
+    return &p->frames[frame % PROFILER_FRAMES];
+}
+
+// Reads back the GPU times of a recorded frame, waiting for them if the GPU
+// hasn't got that far yet.
+void profiler_resolve(profiler *p, int frame) {
+    profile_frame *f = profiler_frame(p, frame);
+    GLuint *queries = p->queries[frame % PROFILER_GPU_LATENCY];
+    for (int i = 0; i < f->zone_count; ++i) {
+        profile_zone *zone = &f->zones[i];
+        if (zone->gpu) {
+            GLuint64 begin, end;
+            glGetQueryObjectui64v(queries[i * 2], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+            zone->begin = p->cpu_base + (GLint64) (begin - p->gpu_base) * 1e-9;
+            zone->end = p->cpu_base + (GLint64) (end - p->gpu_base) * 1e-9;
+        }
+    }
+    f->resolved = true;
+}
+
+void profiler_begin_frame(profiler *p) {
+    // this frame's queries were last used PROFILER_GPU_LATENCY frames ago
+    if (p->gpu && p->frame >= PROFILER_GPU_LATENCY) {
+        profiler_resolve(p, p->frame - PROFILER_GPU_LATENCY);
+    }
+    profile_frame *f = profiler_frame(p, p->frame);
+    f->begin = f->end = glfwGetTime();
+    f->resolved = !p->gpu;
+    f->zone_count = 0;
+    for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+        f->counters[i] = 0;
+    }
+}
+
+void profiler_end_frame(profiler *p) {
+    profiler_frame(p, p->frame)->end = glfwGetTime();
+    ++p->frame;
+}
+
+// Returns the zone to hand to profile_end, or -1 if the frame has no room
+// left or it's a GPU zone without timer queries.
+int profile_begin(profiler *p, const char *name, bool gpu) {
+    profile_frame *f = profiler_frame(p, p->frame);
+    if (f->zone_count == PROFILER_MAX_ZONES || (gpu && !p->gpu)) {
+        return -1;
+    }
+    int i = f->zone_count++;
+    profile_zone *zone = &f->zones[i];
+    zone->name = name;
+    zone->gpu = gpu;
+    zone->begin = zone->end = glfwGetTime();
+    if (gpu) {
+        glQueryCounter(p->queries[p->frame % PROFILER_GPU_LATENCY][i * 2], GL_TIMESTAMP);
+    }
+    return i;
+}
+
+void profile_end(profiler *p, int zone) {
+    if (zone < 0) {
+        return;
+    }
+    profile_frame *f = profiler_frame(p, p->frame);
+    if (f->zones[zone].gpu) {
+        glQueryCounter(p->queries[p->frame % PROFILER_GPU_LATENCY][zone * 2 + 1], GL_TIMESTAMP);
+    }
+    else {
+        f->zones[zone].end = glfwGetTime();
+    }
+}
+
+void profile_count(profiler *p, profile_counter counter, double amount) {
+    profiler_frame(p, p->frame)->counters[counter] += amount;
+}
+
+struct profile_scope {
+    profiler *p;
+    int zone;
+    profile_scope(profiler *p, const char *name, bool gpu) : p(p), zone(profile_begin(p, name, gpu)) {}
+    ~profile_scope() { profile_end(p, zone); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(p, name) profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(p, name, false)
+#define PROFILE_GPU_SCOPE(p, name) profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(p, name, true)
+
+// Formats averages over the last PROFILER_REPORT_FRAMES frames whose GPU
+// times are in: frame time, each zone by name and the counters.
+void profiler_report(profiler *p, char *dest, size_t size) {
+    struct {const char *name; bool gpu; double total;} zones[PROFILER_MAX_ZONES];
+    int zone_count = 0;
+    double counters[PROFILE_COUNTERS] = {0};
+    double frame_total = 0, frame_max = 0;
+    int frames = 0;
+    for (int frame = p->frame - 1; frame >= 0 && frame > p->frame - PROFILER_FRAMES && frames < PROFILER_REPORT_FRAMES; --frame) {
+        profile_frame *f = profiler_frame(p, frame);
+        if (!f->resolved) {
+            continue;
+        }
+        ++frames;
+        frame_total += f->end - f->begin;
+        frame_max = M_MAX(frame_max, f->end - f->begin);
+        for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+            counters[i] += f->counters[i];
+        }
+        for (int i = 0; i < f->zone_count; ++i) {
+            profile_zone *zone = &f->zones[i];
+            int j = 0;
+            while (j < zone_count && !(zones[j].gpu == zone->gpu && strcmp(zones[j].name, zone->name) == 0)) {
+                ++j;
+            }
+            if (j == zone_count) {
+                if (zone_count == PROFILER_MAX_ZONES) {
+                    continue;
+                }
+                zones[j].name = zone->name;
+                zones[j].gpu = zone->gpu;
+                zones[j].total = 0;
+                ++zone_count;
+            }
+            zones[j].total += zone->end - zone->begin;
+        }
+    }
+
+    size_t used = 0;
+    if (size == 0) {
+        return;
+    }
+    dest[0] = '\0';
+    if (frames == 0) {
+        return;
+    }
+    used += snprintf(dest + used, size - used, "frame %.2f ms (max %.2f) over %d frames\n",
+                     1000.0 * frame_total / frames, 1000.0 * frame_max, frames);
+    for (int i = 0; i < zone_count && used < size; ++i) {
+        used += snprintf(dest + used, size - used, "%s %s %.3f ms\n",
+                         zones[i].gpu ? "gpu" : "cpu", zones[i].name, 1000.0 * zones[i].total / frames);
+    }
+    for (int i = 0; i < PROFILE_COUNTERS && used < size; ++i) {
+        used += snprintf(dest + used, size - used, "%s %.0f\n", profile_counter_names[i], counters[i] / frames);
+    }
+}
+
+// Writes the frames still in the ring as Chrome trace events, for
+// chrome://tracing or ui.perfetto.dev: the CPU and GPU zones on two tracks,
+// and a counter track each. Zone names aren't escaped.
+bool profiler_write_trace(profiler *p, const char *filename) {
+    int first = M_MAX(0, p->frame - PROFILER_FRAMES);
+    for (int frame = M_MAX(first, p->frame - PROFILER_GPU_LATENCY); frame < p->frame; ++frame) {
+        if (!profiler_frame(p, frame)->resolved) {
+            profiler_resolve(p, frame);
+        }
+    }
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+    double base = first < p->frame ? profiler_frame(p, first)->begin : 0;
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"cpu\"}},\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"gpu\"}}");
+    for (int frame = first; frame < p->frame; ++frame) {
+        profile_frame *f = profiler_frame(p, frame);
+        fprintf(file, ",\n{\"name\":\"frame %d\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                frame, 1e6 * (f->begin - base), 1e6 * (f->end - f->begin));
+        for (int i = 0; i < f->zone_count; ++i) {
+            profile_zone *zone = &f->zones[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    zone->name, zone->gpu ? 2 : 1, 1e6 * (zone->begin - base), 1e6 * (zone->end - zone->begin));
+        }
+        for (int i = 0; i < PROFILE_COUNTERS; ++i) {
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%.0f}}",
+                    profile_counter_names[i], 1e6 * (f->begin - base), f->counters[i]);
+        }
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(file) == 0;
+}
+
 int main(int argc, char const *argv[]) {
 	printf("Hello!\n");
 
@@ -258,6 +1335,9 @@ int main(int argc, char const *argv[]) {
     else {
         printf("Glfw initialized");
     }
+#if GL_ERROR_CHECKS
+    glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GL_TRUE);
+#endif
     window = glfwCreateWindow(WINDOW_W, WINDOW_H, "stb-true-type-demo", NULL, NULL);
     if(!window) {
         printf("Create window failed");
@@ -275,6 +1355,15 @@ int main(int argc, char const *argv[]) {
     glfwSetErrorCallback(error_callback);
     printf("Setting context");
     glfwMakeContextCurrent(window);
+    gl_errors_init(window);
+
+    int gl_major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    int gl_minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+
+    // startup is recorded as the first frame
+    profiler prof;
+    profiler_start(&prof, gl_major > 3 || (gl_major == 3 && gl_minor >= 3) || glfwExtensionSupported("GL_ARB_timer_query"));
+    profiler_begin_frame(&prof);
 
 	char vs_source[] =
         "attribute vec4 position;"
@@ -298,29 +1387,52 @@ int main(int argc, char const *argv[]) {
         "gl_FragColor = c;"
         "}";
 	printf("Compiling shader\n");
+    int zone = profile_begin(&prof, "shader compile", false);
     GLuint main_shader = compile_shader_program(vs_source,
     													  fs_source,
     													  "position", "color");
+    profile_end(&prof, zone);
 
 
 	printf("Setting up camera\n");
-    float3 camera_position;
-    float3 camera_direction;
-    float3 camera_up;
-
-	float view_matrix[] = M_MAT4_IDENTITY();
-	float projection_matrix[] = M_MAT4_IDENTITY();
+    // the camera never moves, so its matrices are baked at compile time
+    constexpr float3 camera_position = {0, 1, 100};
+    constexpr float3 camera_direction = {0 - camera_position.x, 0 - camera_position.y, 0 - camera_position.z};
+    constexpr float3 camera_up = {0, 1, 0};
+
+    constexpr float aspect = WINDOW_W / (float)WINDOW_H;
+    constexpr m_cx_mat4 projection = m_cx_mat4_perspective(10.0f, aspect, 0.1f, 999.0f);
+    constexpr m_cx_mat4 view = m_cx_mat4_lookat(camera_position, camera_direction, camera_up);
+    constexpr m_cx_mat4 view_projection = m_cx_mat4_mul(projection, view);
+    constexpr m_cx_mat4 inverse_view_projection = m_cx_mat4_inverse(view_projection);
+
+    // every element as m_mat4_perspective, m_mat4_lookat, m_mat4_mul and
+    // m_mat4_inverse compute it at runtime for the same inputs
+    static_assert(m_cx_mat4_equal(projection, m_cx_mat4{{
+        1.54235101f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.54235101f, 0.0f, 0.0f,
+        0.0f, 0.0f, -1.00020015f, -1.0f,
+        0.0f, 0.0f, -0.200020015f, 0.0f}}), "baked projection differs from m_mat4_perspective");
+    static_assert(m_cx_mat4_equal(view, m_cx_mat4{{
+        1.0f, 0.0f, -0.0f, 0.0f,
+        -0.0f, 0.999949992f, 0.00999950059f, 0.0f,
+        0.0f, -0.00999949966f, 0.999950051f, 0.0f,
+        -0.0f, -0.0f, -100.005005f, 1.0f}}), "baked view differs from m_mat4_lookat");
+    static_assert(m_cx_mat4_equal(view_projection, m_cx_mat4{{
+        1.54235101f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.54227388f, -0.010001502f, -0.00999950059f,
+        0.0f, -0.0154227382f, -1.0001502f, -0.999950051f,
+        0.0f, 0.0f, 99.8250046f, 100.005005f}}), "baked view projection differs from m_mat4_mul");
+    static_assert(m_cx_mat4_equal(inverse_view_projection, m_cx_mat4{{
+        0.648360848f, -0.0f, -0.0f, -0.0f,
+        -0.0f, 0.64833045f, -0.00648311432f, -0.0f,
+        -0.0f, -4.99949455f, -499.949463f, -4.99949503f,
+        -0.0f, 4.99049568f, 499.049591f, 5.00049591f}}), "baked inverse view projection differs from m_mat4_inverse");
+
+	const float *view_matrix = view.m;
+	const float *projection_matrix = projection.m;
 	float model_matrix[] = M_MAT4_IDENTITY();
 
-    float aspect = WINDOW_W / (float)WINDOW_H;
-    m_mat4_perspective(projection_matrix, 10.0, aspect, 0.1, 999.0);
-
-	set_float3(&camera_position, 0, 1, 100);
-	set_float3(&camera_direction, 0 - camera_position.x ,0 - camera_position.y , 0 - camera_position.z);
-	set_float3(&camera_up, 0,1,0);
-	
-	m_mat4_lookat(view_matrix, &camera_position, &camera_direction, &camera_up);
-
 	printf("Creating mesh\n");
 	int vertex_data_size = sizeof(float) * 6 * 5;
 	float* vertex_data = (float *) malloc(vertex_data_size);
@@ -396,16 +1508,30 @@ int main(int argc, char const *argv[]) {
 //    printf("font_init - pack_end\n");
 
     // Using simpler API with stbtt_BakeFontBitmap
+    zone = profile_begin(&prof, "font bake", false);
     stbtt_BakeFontBitmap(font_file,0, font_size, bitmap, bitmap_width, bitmap_height, font_first_char, font_char_count, cdata); // no guarantee this fits!
+    profile_end(&prof, zone);
 	
 	glEnable(GL_TEXTURE_2D);	
 	printf("font_init - uploading texture\n");
 
 	GLuint font_texture = 0;
 
-    stbi_write_png("font.png", bitmap_width, bitmap_height, 1, bitmap, 0);
-
-    font_texture = upload_new_texture(bitmap_width, bitmap_height, 1, bitmap);
+    font_atlas atlas;
+    zone = profile_begin(&prof, "atlas build", false);
+    font_atlas_build(&atlas, bitmap, bitmap_width, bitmap_height, cdata, font_char_count);
+    profile_end(&prof, zone);
+    printf("font_init - atlas with %d mip levels\n", atlas.levels);
+
+    stbi_write_png("font.png", bitmap_width, bitmap_height, 1, atlas.pixels[0], 0);
+
+    bool atlas_bc4 = FONT_ATLAS_BC4 && (gl_major >= 3 || glfwExtensionSupported("GL_ARB_texture_compression_rgtc"));
+    zone = profile_begin(&prof, "atlas upload", false);
+    int gpu_zone = profile_begin(&prof, "atlas upload", true);
+    font_texture = upload_font_atlas(&atlas, atlas_bc4);
+    profile_end(&prof, gpu_zone);
+    profile_end(&prof, zone);
+    font_atlas_free(&atlas);
     
     delete bitmap;
     delete font_file;
@@ -415,6 +1541,7 @@ int main(int argc, char const *argv[]) {
     int vertices_per_quad = 6;
    	int character_vertex_data_size = sizeof(float) * vertices_per_quad * elements_per_vertex * max_characters;
 	float* character_vertex_data = (float *) malloc(character_vertex_data_size);
+	float* visible_vertex_data = (float *) malloc(character_vertex_data_size);
     
     float x = 0;
     float y = -110;
@@ -423,7 +1550,10 @@ int main(int argc, char const *argv[]) {
     const int text_len = strlen(text);
     
     buf = character_vertex_data;
+    float3 *glyph_min = (float3 *) malloc(sizeof(float3) * text_len);
+    float3 *glyph_max = (float3 *) malloc(sizeof(float3) * text_len);
     stbtt_aligned_quad q;
+    zone = profile_begin(&prof, "text layout", false);
     for (int i = 0; i < text_len; ++i) {
     	char character = text[i];
     	int index_to_char = character - font_first_char;
@@ -448,38 +1578,57 @@ int main(int argc, char const *argv[]) {
             q.y1 = -q.y1;
             printf("x: %f y: %f\n", x, y);
             buf = push_textured_quad_scaled_arr(buf, q.x0, q.y0, q.x1, q.y1, q.s0, q.t0, q.s1, q.t1, 0.1, 0.1);
+            set_float3(&glyph_min[i], M_MIN(q.x0, q.x1) * 0.1f, M_MIN(q.y0, q.y1) * 0.1f, 1.0f);
+            set_float3(&glyph_max[i], M_MAX(q.x0, q.x1) * 0.1f, M_MAX(q.y0, q.y1) * 0.1f, 1.0f);
 	    }
     }
 
-    printf("Loading test texture\n");
-	GLuint test_texture = 0;
-	{
-		int width, height, channels;
-	    stbi_set_flip_vertically_on_load(true);
-	    unsigned char *pixels = stbi_load("texture_map.png", &width, &height, &channels, 0);
-	    assert(pixels != NULL);
-
-        test_texture = upload_new_texture(width, height, channels, pixels);
+    profile_end(&prof, zone);
 
-	    stbi_image_free(pixels);
+    printf("Building glyph bvh for picking\n");
+    glyph_picker picker;
+    {
+        PROFILE_SCOPE(&prof, "bvh build");
+        picker.inverse_view_projection = inverse_view_projection.m;
+        picker.text = text;
+        picker.hovered = -1;
+        if (!m_bvh_build(&picker.bvh, glyph_min, glyph_max, text_len)) {
+            printf("glyph bvh: out of memory\n");
+        }
+        else {
+            glfwSetWindowUserPointer(window, &picker);
+        }
+    }
 
-	    printf("Loaded test texture: %d %d %d\n", width, height, channels);
-	}
+    text_string hello;
+    hello.vertices = character_vertex_data;
+    hello.glyph_min = glyph_min;
+    hello.glyph_max = glyph_max;
+    hello.glyph_count = text_len;
+    text_string_update_box(&hello);
 
-	printf("Loading font texture from file\n");
+    printf("Loading test texture and font texture from file\n");
+	GLuint test_texture = 0;
 	GLuint font_texture_from_file = 0;
-	{
-		int width, height, channels;
-	    stbi_set_flip_vertically_on_load(true);
-	    unsigned char *pixels = stbi_load("font.png", &width, &height, &channels, 0);
-	    assert(pixels != NULL);
-
-        font_texture_from_file = upload_new_texture(width, height, channels, pixels);
-
-	    stbi_image_free(pixels);
-
-	    printf("Loaded font texture from file: %d %d %d\n", width, height, channels);
-	}
+    // the textures stream in while the render loop runs and stay 0 until then;
+    // without fences the workers decode into malloc'd memory as before
+    bool texture_streaming = gl_major > 3 || (gl_major == 3 && gl_minor >= 2) ||
+        (glfwExtensionSupported("GL_ARB_sync") && glfwExtensionSupported("GL_ARB_map_buffer_range"));
+    asset_loader loader;
+    int num_threads = std::thread::hardware_concurrency();
+    asset_loader_start(&loader, num_threads > 4 ? 4 : num_threads, texture_streaming);
+    asset_loader_load_image(&loader, "texture_map.png", true, &test_texture);
+    asset_loader_load_image(&loader, "font.png", true, &font_texture_from_file);
+    int textures_loading = 2;
+    profiler_end_frame(&prof);
+
+    // profiler overlay, laid out in window pixels every frame
+    constexpr m_cx_mat4 overlay_projection = m_cx_mat4_ortho(0, WINDOW_W, WINDOW_H, 0, -2, 2);
+    constexpr m_cx_mat4 overlay_view = m_cx_mat4_identity();
+    const int overlay_max_glyphs = 1024;
+    float *overlay_vertex_data = (float *) malloc(sizeof(float) * vertices_per_quad * elements_per_vertex * overlay_max_glyphs);
+    char overlay_text[2048];
+    size_t bytes_uploaded = 0;
 
     printf("Entering Render Loop\n");
     GL_ERR;
@@ -488,6 +1637,18 @@ int main(int argc, char const *argv[]) {
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
     while(!glfwWindowShouldClose(window)) {
+		profiler_begin_frame(&prof);
+
+		// GL calls have to stay on this thread, so the uploads happen here
+		if (textures_loading) {
+			PROFILE_SCOPE(&prof, "uploads");
+			textures_loading = asset_loader_upload_finished(&loader, false);
+			if (!textures_loading) {
+				asset_loader_stop(&loader);
+			}
+		}
+		profile_count(&prof, PROFILE_BYTES_UPLOADED, (double) (loader.bytes_uploaded - bytes_uploaded));
+		bytes_uploaded = loader.bytes_uploaded;
 		glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 		
 		
@@ -516,7 +1677,9 @@ int main(int argc, char const *argv[]) {
 			glEnableVertexAttribArray(uvs);
 			glVertexAttribPointer(uvs, 2, GL_FLOAT, GL_FALSE, stride, vertex_data + 3);
 
+			PROFILE_GPU_SCOPE(&prof, "quad draw");
 			glDrawArrays(GL_TRIANGLES, 0, 6);
+			profile_count(&prof, PROFILE_DRAW_CALLS, 1);
         }
         glUseProgram(0);
 		
@@ -540,20 +1703,88 @@ int main(int argc, char const *argv[]) {
 			int bytes_per_float = sizeof(float);
 			int stride = bytes_per_float * (5);
 
+			// only the glyphs inside the view frustum go to the vertex buffer
+			zone = profile_begin(&prof, "cull", false);
+			float4 planes[6];
+			m_mat4_frustum_planes(planes, view_projection.m);
+			cull_stats stats = {0, 0};
+			int visible_glyphs = cull_text(visible_vertex_data, vertices_per_quad * elements_per_vertex, &hello, 1, planes, &stats);
+			profile_end(&prof, zone);
+			profile_count(&prof, PROFILE_GLYPHS_CULLED, stats.culled);
+
 			glEnableVertexAttribArray(position);
-			glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, stride, character_vertex_data);
+			glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, stride, visible_vertex_data);
 			glEnableVertexAttribArray(uvs);
-			glVertexAttribPointer(uvs, 2, GL_FLOAT, GL_FALSE, stride, character_vertex_data + 3);
+			glVertexAttribPointer(uvs, 2, GL_FLOAT, GL_FALSE, stride, visible_vertex_data + 3);
 
-			glDrawArrays(GL_TRIANGLES, 0, vertices_per_quad * text_len);
+			PROFILE_GPU_SCOPE(&prof, "text draw");
+			glDrawArrays(GL_TRIANGLES, 0, vertices_per_quad * visible_glyphs);
+			profile_count(&prof, PROFILE_DRAW_CALLS, 1);
+			profile_count(&prof, PROFILE_GLYPHS_DRAWN, visible_glyphs);
         }
         glUseProgram(0);
 
+		// profiler overlay over everything else, from the frames before this one
+		glUseProgram(main_shader);
+		{
+			GLint position = glGetAttribLocation(main_shader, "position");
+			GLint uvs = glGetAttribLocation(main_shader, "uvs");
+
+			zone = profile_begin(&prof, "overlay layout", false);
+			profiler_report(&prof, overlay_text, sizeof(overlay_text));
+			if (picker.hovered >= 0) {
+				size_t used = strlen(overlay_text);
+				snprintf(overlay_text + used, sizeof(overlay_text) - used, "cursor over '%c' (glyph %d)\n",
+				         picker.text[picker.hovered], picker.hovered);
+			}
+			int overlay_glyphs = layout_text(overlay_vertex_data, overlay_max_glyphs, cdata, bitmap_width, bitmap_height,
+			                                 font_first_char, font_char_count, font_size, 8, 8, 0.08f, overlay_text);
+			profile_end(&prof, zone);
+
+			glUniformMatrix4fv(glGetUniformLocation(main_shader, "view_matrix"), 1, GL_FALSE, overlay_view.m);
+			glUniformMatrix4fv(glGetUniformLocation(main_shader, "projection_matrix"), 1, GL_FALSE, overlay_projection.m);
+			glBindTexture(GL_TEXTURE_2D, font_texture);
+
+			int stride = sizeof(float) * 5;
+			glEnableVertexAttribArray(position);
+			glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, stride, overlay_vertex_data);
+			glEnableVertexAttribArray(uvs);
+			glVertexAttribPointer(uvs, 2, GL_FLOAT, GL_FALSE, stride, overlay_vertex_data + 3);
+
+			glDisable(GL_DEPTH_TEST);
+			PROFILE_GPU_SCOPE(&prof, "overlay draw");
+			glDrawArrays(GL_TRIANGLES, 0, vertices_per_quad * overlay_glyphs);
+			glEnable(GL_DEPTH_TEST);
+			profile_count(&prof, PROFILE_DRAW_CALLS, 1);
+			profile_count(&prof, PROFILE_GLYPHS_DRAWN, overlay_glyphs);
+		}
+		glUseProgram(0);
 
 		GL_ERR;
-		glfwSwapBuffers(window);
+		{
+			PROFILE_SCOPE(&prof, "swap");
+			glfwSwapBuffers(window);
+		}
         glfwPollEvents();
+		GL_ERR_NEXT_FRAME;
+		profiler_end_frame(&prof);
+    }
+
+    if (textures_loading) {
+        asset_loader_upload_finished(&loader, true);
+        asset_loader_stop(&loader);
+    }
+    glfwSetWindowUserPointer(window, NULL);
+    m_bvh_destroy(&picker.bvh);
+    free(glyph_min);
+    free(glyph_max);
+    free(visible_vertex_data);
+    free(overlay_vertex_data);
+
+    if (profiler_write_trace(&prof, "profile.json")) {
+        printf("Wrote the last %d frames to profile.json\n", M_MIN(prof.frame, PROFILER_FRAMES));
     }
+    profiler_stop(&prof);
 
     glfwMakeContextCurrent(NULL);
     glfwDestroyWindow(window);
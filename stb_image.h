@@ -226,6 +226,13 @@ RECENT REVISION HISTORY:
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
 //
+// On x86-64 with GCC 5+, Clang or MSVC 2015+, the JPEG decoder also has AVX2
+// kernels (IDCT two blocks at a time, upsampling, color conversion, and
+// 2x2 chroma upsampling fused with color conversion). These are compiled
+// without needing -mavx2 and are picked at run time if the CPU and OS
+// support AVX2; they give the same results as the SSE2 and C versions.
+// Define STBI_NO_AVX2 to leave them out.
+//
 // If for some reason you do not want to use any of SIMD code, or if
 // you have issues compiling it, you can disable it entirely by
 // defining STBI_NO_SIMD.
@@ -282,6 +289,109 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Scaled JPEG decoding
+//
+// When only a thumbnail or a smaller mip is needed, the stbi_load*_scaled
+// functions take a desired_scale of 1, 2, 4 or 8 and decode JPEGs straight
+// to 1/desired_scale of their size (rounded up) using reduced 4x4, 2x2 or
+// DC-only IDCTs, which is much cheaper than a full decode plus a resize:
+//
+//     stbi_uc *thumb = stbi_load_scaled(filename, &x, &y, &n, 3, 4);
+//
+// Each pixel is the average of the block of full-size pixels it replaces,
+// to within 1. Subsampled chroma (4:2:0, 4:2:2) is decoded at the reduced
+// size too and then upsampled, so where colour changes quickly it is softer
+// than the box-filtered full image; libjpeg avoids this by decoding chroma
+// with a larger IDCT instead.
+//
+// Other formats ignore desired_scale and come back at full size, so always
+// use the returned *x and *y. Any other value of desired_scale fails.
+//
+// ===========================================================================
+//
+// Decoding into your own memory
+//
+// The stbi_load*_into functions decode into a buffer you provide, such as a
+// mapped pixel-unpack buffer, instead of returning a malloc'd image. You give
+// its size in pixels and the byte stride between rows; the image goes in the
+// top-left corner, must fit, and is written as desired_channels 8-bit
+// channels (or the file's channel count if desired_channels is 0):
+//
+//     stbi_info(filename, &w, &h, &n);
+//     ... map or allocate h rows of 'stride' bytes at 'pixels' ...
+//     ok = stbi_load_into(filename, &x, &y, &n, 4, pixels, w, h, stride);
+//
+// They return 1 on success and 0 on failure (see stbi_failure_reason); on
+// failure the buffer may be partly written. Vertical flipping is honored.
+// JPEGs and non-interlaced PNGs without tRNS or CgBI chunks are written
+// straight into the buffer a row at a time, with channel conversion and
+// flipping done as each row is stored, and the buffer is never read back.
+// Everything else is decoded as usual and then copied in.
+// The channel count from stbi_info counts the alpha a PNG tRNS chunk adds,
+// so it's what a desired_channels of 0 gives and can size the buffer.
+//
+// Decoding a band of rows at a time
+//
+// The stbi_load_rows* functions don't return an image at all; instead they
+// call you back with each band of band_rows rows (16 if you pass 0) as soon
+// as it's decoded, top to bottom, so you can upload it with glTexSubImage2D
+// while the rest is still decoding. Rows are tightly packed, w*channels
+// bytes each, and only valid during the callback. Return 0 from it to stop
+// the load, which then fails with "stopped":
+//
+//     int band(void *user, int y, int rows, const stbi_uc *pixels, int w, int h, int channels)
+//     {
+//        if (y == 0) ... create a w*h texture ...
+//        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, w, rows, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+//        return 1;
+//     }
+//     ok = stbi_load_rows(filename, &x, &y, &n, 4, 0, band, tex);
+//
+// Baseline JPEGs and non-interlaced PNGs without tRNS or CgBI chunks are
+// streamed: a JPEG keeps three rows of MCUs of its component planes and a
+// PNG inflates through a 32K window, so beyond the compressed PNG data the
+// memory needed is a few rows rather than a whole image. Anything else is
+// decoded in full and then handed out in bands. Vertical flipping is
+// ignored; bands always go top to bottom.
+//
+// Animated GIFs
+//
+// stbi_load_gif_from_memory returns every frame of an animation at once.
+// To play one back instead, open it with stbi_gif_frames_open (or the
+// _from_memory/_from_callbacks versions, whose data must outlive it) and
+// call stbi_gif_next_frame for each frame in turn. It returns 1 with the
+// canvas, w*h 4-channel RGBA pixels owned by the iterator and valid until
+// the next call, the frame's delay in milliseconds, and the rectangle of
+// the canvas that changed since the last frame (all of it the first
+// time); 0 after the last frame; or -1 if the first frame can't be
+// decoded. As with stbi_load_gif_from_memory, a file that is truncated or
+// corrupt after a good frame (or just lacks the trailer) ends there:
+//
+//     f = stbi_gif_frames_open(filename, &w, &h);
+//     while (stbi_gif_next_frame(f, &canvas, &delay, &rx, &ry, &rw, &rh) > 0) {
+//        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+//        glTexSubImage2D(GL_TEXTURE_2D, 0, rx, ry, rw, rh, GL_RGBA, GL_UNSIGNED_BYTE, canvas + (ry*w + rx)*4);
+//        ... wait 'delay' ms ...
+//     }
+//     stbi_gif_frames_free(f);
+//
+// Only the canvas is kept, not earlier frames, so "restore to previous"
+// disposal restores the canvas as it was before the last frame was drawn.
+// Vertical flipping is ignored.
+//
+// Reading the headers of many files
+//
+// stbi_info_batch fills in one stbi_info_result per filename: the size,
+// the channel count stbi_info would give, and the bits per channel (8, 16,
+// or 32 for HDR), or bits_per_channel 0 and a failure reason if the file
+// couldn't be read. The format is picked from the first bytes of the file
+// instead of trying each format's test in turn, only the header blocks are
+// read (with pread where available, so nothing is buffered past them), and
+// with STBI_THREADS the files are shared out over num_threads threads. It
+// returns how many files were read successfully.
+//
+// ===========================================================================
+//
 // ADDITIONAL CONFIGURATION
 //
 //  - You can suppress implementation of any of the decoders to reduce
@@ -315,6 +425,28 @@ RECENT REVISION HISTORY:
 //   - If you use STBI_NO_PNG (or _ONLY_ without PNG), and you still
 //     want the zlib decoder to be available, #define STBI_SUPPORT_ZLIB
 //
+// ===========================================================================
+//
+// THREADS
+//
+// Images can be decoded on several threads at once. The failure reason is
+// kept per thread, and the global flags set by stbi_set_flip_vertically_on_load,
+// stbi_set_unpremultiply_on_load and stbi_convert_iphone_png_to_rgb can be
+// overridden for the calling thread with the matching *_thread functions.
+// This relies on compiler support for thread-local storage; #define
+// STBI_NO_THREAD_LOCALS to turn it off (the *_thread functions then don't exist).
+//
+// #define STBI_THREADS to also let a single decode use several threads
+// (pthreads, or Win32 threads on Windows). Currently:
+//   - the seven passes of interlaced PNGs are unfiltered in parallel
+//   - baseline JPEGs with restart markers (DRI) have their restart
+//     intervals decoded in parallel; files without them decode serially.
+//     When loading through callbacks (including stbi_load), the rest of
+//     the stream is read into memory first so the markers can be found.
+//   - JPEG upsampling and color conversion run in bands of rows
+// stbi_set_decode_threads(n) sets how many threads one decode may use
+// (default 4, 1 to disable). Small images always decode serially.
+//
 
 
 #ifndef STBI_NO_STDIO
@@ -381,6 +513,46 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
+
+// animated GIFs one frame at a time into a reused RGBA canvas; see "Animated GIFs" above
+typedef struct stbi_gif_frames stbi_gif_frames;
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y);
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open          (char const *filename, int *x, int *y);
+#endif
+STBIDEF int              stbi_gif_next_frame (stbi_gif_frames *f, stbi_uc const **canvas, int *delay, int *rect_x, int *rect_y, int *rect_w, int *rect_h);
+STBIDEF void             stbi_gif_frames_free(stbi_gif_frames *f);
+#endif
+
+// as above, but into memory you own; returns 1 on success, 0 on failure
+STBIDEF int      stbi_load_from_memory_into   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_w, int out_h, int out_stride);
+STBIDEF int      stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_w, int out_h, int out_stride);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int      stbi_load_into            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_w, int out_h, int out_stride);
+STBIDEF int      stbi_load_from_file_into  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, stbi_uc *out, int out_w, int out_h, int out_stride);
+#endif
+
+// as above, but handing the image to 'emit' band_rows rows at a time; returns 1 on success, 0 on failure
+typedef int stbi_row_callback(void *user, int y, int rows, const stbi_uc *pixels, int w, int h, int channels);
+
+STBIDEF int      stbi_load_rows_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, int band_rows, stbi_row_callback *emit, void *emit_user);
+STBIDEF int      stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, int band_rows, stbi_row_callback *emit, void *emit_user);
+
+#ifndef STBI_NO_STDIO
+STBIDEF int      stbi_load_rows            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int band_rows, stbi_row_callback *emit, void *emit_user);
+STBIDEF int      stbi_load_rows_from_file  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, int band_rows, stbi_row_callback *emit, void *emit_user);
+#endif
+
+// as above, but JPEGs are decoded at 1/desired_scale size (1, 2, 4 or 8)
+STBIDEF stbi_uc *stbi_load_from_memory_scaled   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, int desired_scale);
+STBIDEF stbi_uc *stbi_load_from_callbacks_scaled(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, int desired_scale);
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled            (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int desired_scale);
+STBIDEF stbi_uc *stbi_load_from_file_scaled  (FILE *f, int *x, int *y, int *channels_in_file, int desired_channels, int desired_scale);
 #endif
 
 #ifdef STBI_WINDOWS_UTF8
@@ -451,6 +623,15 @@ STBIDEF int      stbi_info               (char const *filename,     int *x, int
 STBIDEF int      stbi_info_from_file     (FILE *f,                  int *x, int *y, int *comp);
 STBIDEF int      stbi_is_16_bit          (char const *filename);
 STBIDEF int      stbi_is_16_bit_from_file(FILE *f);
+
+typedef struct
+{
+   int x, y, comp;
+   int bits_per_channel;  // 8, 16, or 32 for HDR; 0 on failure
+   const char *failure;   // why it failed, or NULL
+} stbi_info_result;
+
+STBIDEF int      stbi_info_batch(char const * const *filenames, int count, stbi_info_result *results, int num_threads);
 #endif
 
 
@@ -467,6 +648,16 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// as above, but only applies to images loaded on the thread that calls the function
+// this function is only available if your compiler supports thread-local variables;
+// calling it will fail to link if your compiler doesn't
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply);
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert);
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
+
+// number of threads a single decode may use when built with STBI_THREADS
+STBIDEF void stbi_set_decode_threads(int num_threads);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -539,6 +730,15 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
+// pread and O_CLOEXEC are POSIX.1-2008; strict ISO modes (gcc -std=c99)
+// hide them on glibc unless a feature macro asks for them. g++ and clang++
+// always define _GNU_SOURCE there.
+#if defined(__APPLE__) || (defined(__unix__) && (!defined(__STRICT_ANSI__) || defined(_GNU_SOURCE) || \
+    (defined(_XOPEN_SOURCE) && _XOPEN_SOURCE >= 700) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L)))
+#include <fcntl.h>
+#include <unistd.h>  // pread, for stbi_info_batch
+#define STBI__PREAD
+#endif
 #endif
 
 #ifndef STBI_ASSERT
@@ -553,6 +753,35 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #endif
 
 
+#ifndef STBI_NO_THREAD_LOCALS
+   #if defined(__cplusplus) &&  __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL       thread_local
+   #elif defined(__GNUC__) && __GNUC__ < 5
+      #define STBI_THREAD_LOCAL       __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL       __declspec(thread)
+   #elif defined (__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL       _Thread_local
+   #endif
+
+   #ifndef STBI_THREAD_LOCAL
+      #if defined(__GNUC__)
+        #define STBI_THREAD_LOCAL       __thread
+      #endif
+   #endif
+#endif
+
+#ifdef STBI_THREADS
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
 #ifndef _MSC_VER
    #ifdef __cplusplus
    #define stbi_inline inline
@@ -569,12 +798,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -655,10 +886,20 @@ typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 
 #if _MSC_VER >= 1400  // not VC6
 #include <intrin.h> // __cpuid
+#define STBI__CPUID
+static void stbi__cpuid(int info[4], int leaf)
+{
+#if _MSC_VER >= 1600
+   __cpuidex(info,leaf,0);
+#else
+   __cpuid(info,leaf);
+#endif
+}
+
 static int stbi__cpuid3(void)
 {
    int info[4];
-   __cpuid(info,1);
+   stbi__cpuid(info,1);
    return info[3];
 }
 #else
@@ -676,7 +917,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -687,7 +928,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -697,6 +938,55 @@ static int stbi__sse2_available(void)
 }
 #endif
 
+#endif
+
+// AVX2 isn't part of the x86-64 baseline, so the AVX2 kernels are compiled
+// for explicitly and only used after checking cpuid
+#if !defined(STBI_NO_AVX2) && defined(STBI_SSE2) && defined(STBI__X64_TARGET)
+#if defined(_MSC_VER) && _MSC_VER >= 1900
+#define STBI_AVX2
+#define STBI_AVX2_TARGET
+#include <immintrin.h>
+#elif defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define STBI_AVX2
+#define STBI_AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(STBI_AVX2) && !defined(STBI_NO_JPEG)
+#ifndef STBI__CPUID
+#define STBI__CPUID
+static void stbi__cpuid(int info[4], int leaf)
+{
+   __cpuid_count(leaf,0,info[0],info[1],info[2],info[3]);
+}
+#endif
+
+// like stbi__sse2_available, this asks the CPU each time a decoder is set
+// up rather than caching the answer somewhere shared between threads
+static int stbi__avx2_available(void)
+{
+   int info[4], ecx1;
+   unsigned int xcr0;
+   stbi__cpuid(info,0);
+   if (info[0] < 7) return 0;
+   stbi__cpuid(info,1);
+   ecx1 = info[2];
+   stbi__cpuid(info,7);
+   // AVX2, and the OS saves xmm and ymm state (OSXSAVE, XCR0 bits 1-2)
+   if (!((info[1] >> 5) & 1) || !((ecx1 >> 27) & 1)) return 0;
+#ifdef _MSC_VER
+   xcr0 = (unsigned int) _xgetbv(0);
+#else
+   {
+      unsigned int edx;
+      __asm__ ("xgetbv" : "=a"(xcr0), "=d"(edx) : "c"(0));
+   }
+#endif
+   return (xcr0 & 6) == 6;
+}
 #endif
 #endif
 
@@ -719,6 +1009,19 @@ static int stbi__sse2_available(void)
 //
 //  stbi__context struct and start_xxx functions
 
+// caller-owned output for stbi_load_into; 8 bits per channel. For
+// stbi_load_rows, pixels is a band of our own that's passed to emit as it fills
+typedef struct
+{
+   stbi_uc *pixels;
+   int w, h, stride, n; // n is 0 until the loader knows the channel count
+   int flip;
+   stbi_row_callback *emit;
+   void *emit_user;
+   int band_rows;
+   int stopped; // emit returned 0
+} stbi__dest;
+
 // stbi__context structure is our basic context used by all images, so it
 // contains all the IO context, plus some basic image information
 typedef struct
@@ -735,6 +1038,9 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   int scale; // log2 of the requested downscale, see stbi_load_scaled
+   stbi__dest *dest; // if set, loaders that can write straight into it do
 } stbi__context;
 
 
@@ -745,6 +1051,8 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 {
    s->io.read = NULL;
    s->read_from_callbacks = 0;
+   s->scale = 0;
+   s->dest = NULL;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -756,6 +1064,8 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->io_user_data = user;
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
+   s->scale = 0;
+   s->dest = NULL;
    s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -873,8 +1183,12 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
+#ifndef STBI_THREAD_LOCAL
 // this is not threadsafe
 static const char *stbi__g_failure_reason;
+#else
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
+#endif
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -995,11 +1309,154 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
-static int stbi__vertically_flip_on_load = 0;
+static int stbi__vertically_flip_on_load_global = 0;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
 {
-    stbi__vertically_flip_on_load = flag_true_if_should_flip;
+   stbi__vertically_flip_on_load_global = flag_true_if_should_flip;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__vertically_flip_on_load  stbi__vertically_flip_on_load_global
+#else
+static STBI_THREAD_LOCAL int stbi__vertically_flip_on_load_local, stbi__vertically_flip_on_load_set;
+
+STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip)
+{
+   stbi__vertically_flip_on_load_local = flag_true_if_should_flip;
+   stbi__vertically_flip_on_load_set = 1;
+}
+
+#define stbi__vertically_flip_on_load  (stbi__vertically_flip_on_load_set       \
+                                         ? stbi__vertically_flip_on_load_local  \
+                                         : stbi__vertically_flip_on_load_global)
+#endif // STBI_THREAD_LOCAL
+
+static int stbi__decode_threads = 4;
+
+STBIDEF void stbi_set_decode_threads(int num_threads)
+{
+   stbi__decode_threads = num_threads < 1 ? 1 : num_threads;
+}
+
+#ifdef STBI_THREADS
+// Runs func on each of 'count' jobs of 'job_size' bytes, spread over up to
+// num_threads threads (stbi__decode_threads for stbi__run_jobs); the
+// calling thread takes part, and the jobs are done when this returns.
+typedef void stbi__job_func(void *job);
+
+#define STBI__MAX_THREADS 32
+
+typedef struct
+{
+   stbi__job_func *func;
+   char *jobs;
+   int job_size, count, thread, num_threads;
+} stbi__worker;
+
+static void stbi__run_worker(stbi__worker *w)
+{
+   int i;
+   for (i=w->thread; i < w->count; i += w->num_threads)
+      w->func(w->jobs + (size_t) i * w->job_size);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI stbi__worker_thread(LPVOID w) { stbi__run_worker((stbi__worker *) w); return 0; }
+#else
+static void *stbi__worker_thread(void *w) { stbi__run_worker((stbi__worker *) w); return NULL; }
+#endif
+
+static void stbi__run_jobs_on(stbi__job_func *func, void *jobs, int job_size, int count, int num_threads)
+{
+   stbi__worker workers[STBI__MAX_THREADS];
+#ifdef _WIN32
+   HANDLE handles[STBI__MAX_THREADS];
+#else
+   pthread_t handles[STBI__MAX_THREADS];
+   int started[STBI__MAX_THREADS];
+#endif
+   int t;
+   if (num_threads > count) num_threads = count;
+   if (num_threads > STBI__MAX_THREADS) num_threads = STBI__MAX_THREADS;
+   if (num_threads < 1) num_threads = 1;
+   for (t=0; t < num_threads; ++t) {
+      workers[t].func = func;
+      workers[t].jobs = (char *) jobs;
+      workers[t].job_size = job_size;
+      workers[t].count = count;
+      workers[t].thread = t;
+      workers[t].num_threads = num_threads;
+   }
+   // if a thread can't be started, its share runs here instead
+   for (t=1; t < num_threads; ++t) {
+#ifdef _WIN32
+      handles[t] = CreateThread(NULL, 0, stbi__worker_thread, &workers[t], 0, NULL);
+      if (handles[t] == NULL) stbi__run_worker(&workers[t]);
+#else
+      started[t] = pthread_create(&handles[t], NULL, stbi__worker_thread, &workers[t]) == 0;
+      if (!started[t]) stbi__run_worker(&workers[t]);
+#endif
+   }
+   stbi__run_worker(&workers[0]);
+   for (t=1; t < num_threads; ++t) {
+#ifdef _WIN32
+      if (handles[t] != NULL) {
+         WaitForSingleObject(handles[t], INFINITE);
+         CloseHandle(handles[t]);
+      }
+#else
+      if (started[t]) pthread_join(handles[t], NULL);
+#endif
+   }
+}
+
+static void stbi__run_jobs(stbi__job_func *func, void *jobs, int job_size, int count)
+{
+   stbi__run_jobs_on(func, jobs, job_size, count, stbi__decode_threads);
+}
+#endif // STBI_THREADS
+
+// called by loaders writing to s->dest once they know the output size
+static int stbi__dest_fits(stbi__context *s, int n)
+{
+   stbi__dest *d = s->dest;
+   if (d->emit) {
+      // size the band to the image
+      if (!d->pixels) {
+         if ((stbi__uint32) d->band_rows > s->img_y) d->band_rows = s->img_y;
+         d->pixels = (stbi_uc *) stbi__malloc_mad3(n, s->img_x, d->band_rows, 0);
+         if (!d->pixels) return stbi__err("outofmem", "Out of memory");
+      }
+      d->w = s->img_x;
+      d->h = s->img_y;
+      d->stride = n * s->img_x;
+   }
+   if (s->img_x > (stbi__uint32) d->w || s->img_y > (stbi__uint32) d->h || n * s->img_x > (stbi__uint32) d->stride)
+      return stbi__err("too big for buffer", "Image doesn't fit the output buffer");
+   d->n = n;
+   return 1;
+}
+
+static stbi_uc *stbi__dest_row(stbi__context *s, stbi__uint32 j)
+{
+   stbi__dest *d = s->dest;
+   if (d->emit) return d->pixels + (size_t) d->stride * (j % d->band_rows);
+   return d->pixels + (size_t) d->stride * (d->flip ? s->img_y-1-j : j);
+}
+
+// called once row j is stored; rows must arrive in order when streaming
+static int stbi__dest_done(stbi__context *s, stbi__uint32 j)
+{
+   stbi__dest *d = s->dest;
+   int rows;
+   if (!d->emit || ((j+1) % d->band_rows && j+1 < s->img_y)) return 1;
+   rows = j % d->band_rows + 1;
+   if (!d->emit(d->emit_user, j+1-rows, rows, d->pixels, d->w, d->h, d->n)) {
+      d->stopped = 1;
+      return stbi__err("stopped", "Row callback stopped the load");
+   }
+   return 1;
 }
 
 static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
@@ -1141,6 +1598,92 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    return (unsigned char *) result;
 }
 
+static unsigned char *stbi__load_scaled(stbi__context *s, int *x, int *y, int *comp, int req_comp, int desired_scale)
+{
+   switch (desired_scale) {
+      case 1: s->scale = 0; break;
+      case 2: s->scale = 1; break;
+      case 4: s->scale = 2; break;
+      case 8: s->scale = 3; break;
+      default: return stbi__errpuc("bad scale", "desired_scale must be 1, 2, 4 or 8");
+   }
+   return stbi__load_and_postprocess_8bit(s,x,y,comp,req_comp);
+}
+
+// decodes into d; loaders that know d write rows straight into it, and
+// anything else is copied in afterwards
+static int stbi__load_dest(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__dest *d)
+{
+   stbi__result_info ri;
+   void *result;
+   int i, j, n;
+
+   d->n = 0;
+   d->stopped = 0;
+   s->dest = d;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   s->dest = NULL;
+   if (result == NULL) return 0;
+   if (result == d->pixels) return 1; // the loader wrote it in place
+
+   // decoded the usual way, so copy it in, flipping and dropping to 8 bits as we go
+   n = req_comp ? req_comp : *comp;
+   s->img_x = *x;
+   s->img_y = *y;
+   s->dest = d;
+   if (!stbi__dest_fits(s, n)) {
+      s->dest = NULL;
+      STBI_FREE(result);
+      return 0;
+   }
+   for (j=0; j < *y; ++j) {
+      stbi_uc *row = stbi__dest_row(s, j);
+      if (ri.bits_per_channel != 8) {
+         stbi__uint16 *src = (stbi__uint16 *) result + (size_t) j * *x * n;
+         for (i=0; i < *x * n; ++i)
+            row[i] = (stbi_uc) ((src[i] >> 8) & 0xFF);
+      } else {
+         memcpy(row, (stbi_uc *) result + (size_t) j * *x * n, (size_t) *x * n);
+      }
+      if (!stbi__dest_done(s, j)) break;
+   }
+   s->dest = NULL;
+   STBI_FREE(result);
+   return !d->stopped;
+}
+
+static int stbi__load_into(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_w, int out_h, int out_stride)
+{
+   stbi__dest d;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (!out || out_w <= 0 || out_h <= 0 || out_stride / out_w < (req_comp ? req_comp : 1))
+      return stbi__err("bad buffer", "Invalid output buffer");
+   d.pixels = out;
+   d.w = out_w;
+   d.h = out_h;
+   d.stride = out_stride;
+   d.flip = stbi__vertically_flip_on_load;
+   d.emit = NULL;
+   return stbi__load_dest(s, x, y, comp, req_comp, &d);
+}
+
+static int stbi__load_rows(stbi__context *s, int *x, int *y, int *comp, int req_comp, int band_rows, stbi_row_callback *emit, void *emit_user)
+{
+   stbi__dest d;
+   int result;
+   if (req_comp < 0 || req_comp > 4) return stbi__err("bad req_comp", "Internal error");
+   if (!emit || band_rows < 0) return stbi__err("bad callback", "Invalid row callback");
+   d.pixels = NULL; // the band is allocated once the size is known
+   d.w = d.h = d.stride = 0;
+   d.flip = 0;
+   d.emit = emit;
+   d.emit_user = emit_user;
+   d.band_rows = band_rows ? band_rows : 16;
+   result = stbi__load_dest(s, x, y, comp, req_comp, &d);
+   STBI_FREE(d.pixels);
+   return result;
+}
+
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
@@ -1242,6 +1785,75 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    return result;
 }
 
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int desired_scale)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   unsigned char *result;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   result = stbi_load_from_file_scaled(f,x,y,comp,req_comp,desired_scale);
+   fclose(f);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_file_scaled(FILE *f, int *x, int *y, int *comp, int req_comp, int desired_scale)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_scaled(&s,x,y,comp,req_comp,desired_scale);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF int stbi_load_into(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_w, int out_h, int out_stride)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_from_file_into(f,x,y,comp,req_comp,out,out_w,out_h,out_stride);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_from_file_into(FILE *f, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_w, int out_h, int out_stride)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_into(&s,x,y,comp,req_comp,out,out_w,out_h,out_stride);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
+STBIDEF int stbi_load_rows(char const *filename, int *x, int *y, int *comp, int req_comp, int band_rows, stbi_row_callback *emit, void *emit_user)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   int result;
+   if (!f) return stbi__err("can't fopen", "Unable to open file");
+   result = stbi_load_rows_from_file(f,x,y,comp,req_comp,band_rows,emit,emit_user);
+   fclose(f);
+   return result;
+}
+
+STBIDEF int stbi_load_rows_from_file(FILE *f, int *x, int *y, int *comp, int req_comp, int band_rows, stbi_row_callback *emit, void *emit_user)
+{
+   int result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_rows(&s,x,y,comp,req_comp,band_rows,emit,emit_user);
+   if (result) {
+      // need to 'unget' all the characters in the IO buffer
+      fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
+   }
+   return result;
+}
+
 STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    stbi__uint16 *result;
@@ -1296,6 +1908,48 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF int stbi_load_from_memory_into(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_w, int out_h, int out_stride)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into(&s,x,y,comp,req_comp,out,out_w,out_h,out_stride);
+}
+
+STBIDEF int stbi_load_from_callbacks_into(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, stbi_uc *out, int out_w, int out_h, int out_stride)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into(&s,x,y,comp,req_comp,out,out_w,out_h,out_stride);
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int band_rows, stbi_row_callback *emit, void *emit_user)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows(&s,x,y,comp,req_comp,band_rows,emit,emit_user);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int band_rows, stbi_row_callback *emit, void *emit_user)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows(&s,x,y,comp,req_comp,band_rows,emit,emit_user);
+}
+
+STBIDEF stbi_uc *stbi_load_from_memory_scaled(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int desired_scale)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_scaled(&s,x,y,comp,req_comp,desired_scale);
+}
+
+STBIDEF stbi_uc *stbi_load_from_callbacks_scaled(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int desired_scale)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_scaled(&s,x,y,comp,req_comp,desired_scale);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1579,9 +2233,40 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
    return (stbi_uc) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert one row of x pixels; src and dest must not overlap
+static void stbi__convert_row(unsigned char *dest, unsigned char *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   if (req_comp == img_n) {
+      memcpy(dest, src, x * img_n);
+      return;
+   }
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0);
+   }
+   #undef STBI__CASE
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -1593,31 +2278,8 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0);
-      }
-      #undef STBI__CASE
-   }
+   for (j=0; j < (int) y; ++j)
+      stbi__convert_row(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x);
 
    STBI_FREE(data);
    return good;
@@ -1628,9 +2290,39 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
    return (stbi__uint16) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+static void stbi__convert_row16(stbi__uint16 *dest, stbi__uint16 *src, int img_n, int req_comp, unsigned int x)
+{
+   int i;
+   if (req_comp == img_n) {
+      memcpy(dest, src, x * img_n * 2);
+      return;
+   }
+
+   #define STBI__COMBO(a,b)  ((a)*8+(b))
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0);
+   }
+   #undef STBI__CASE
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
 
    if (req_comp == img_n) return data;
@@ -1642,31 +2334,8 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0);
-      }
-      #undef STBI__CASE
-   }
+   for (j=0; j < (int) y; ++j)
+      stbi__convert_row16(good + j * x * req_comp, data + j * x * img_n, img_n, req_comp, x);
 
    STBI_FREE(data);
    return good;
@@ -1811,11 +2480,20 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale; // decode at 1/(1<<scale) size; blocks come out (8>>scale) pixels square
+   void *scan_data; // callback stream pulled into memory for a threaded scan
+   int req_comp;    // kept for stbi__jpeg_stream_scan
+   int streamed;    // the rows went out to s->dest as the first scan decoded
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+   void (*idct_block2_kernel)(stbi_uc *out0, int stride0, stbi_uc *out1, int stride1, short data[128]); // optional
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
+   // optional: 2x2 chroma upsampling straight into YCbCr_to_RGB
+   void (*YCbCr_hv_2_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *cb_near, const stbi_uc *cb_far,
+                                    const stbi_uc *cr_near, const stbi_uc *cr_far, int count, int w_lores, int step);
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
+   stbi_uc *(*resample_row_generic_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -2327,6 +3005,97 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced IDCTs for scaled decoding, ported from libjpeg's jidctred.c. Each
+// output pixel is the average of the 2x2 or 4x4 pixels of the full IDCT it
+// stands for: the even frequencies above the output size average out, and
+// the odd ones are folded into the remaining taps. Constants are in the
+// 12-bit fixed point of stbi__idct_block, with 2 extra bits between passes.
+#define STBI__IDCT_RED4_ODD(s1,s3,s5,s7) \
+   o0 = (s7)*stbi__f2f(-0.211164243f) + (s5)*stbi__f2f( 1.451774981f)  \
+      + (s3)*stbi__f2f(-2.172734803f) + (s1)*stbi__f2f( 1.061594337f); \
+   o2 = (s7)*stbi__f2f(-0.509795579f) + (s5)*stbi__f2f(-0.601344887f)  \
+      + (s3)*stbi__f2f( 0.899976223f) + (s1)*stbi__f2f( 2.562915447f);
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[32],*v=val;
+   int e0,e2,e10,e12,o0,o2;
+   stbi_uc *o;
+   short *d = data;
+
+   // columns; column 4 averages out, so it's skipped
+   for (i=0; i < 8; ++i,++d,++v) {
+      if (i == 4) continue;
+      if (d[8]==0 && d[16]==0 && d[24]==0 && d[40]==0 && d[48]==0 && d[56]==0) {
+         v[0] = v[8] = v[16] = v[24] = d[0] * 4;
+         continue;
+      }
+      e0  = stbi__fsh(d[0]) * 2;
+      e2  = d[16]*stbi__f2f(1.847759065f) + d[48]*stbi__f2f(-0.765366865f);
+      e10 = e0 + e2;
+      e12 = e0 - e2;
+      STBI__IDCT_RED4_ODD(d[8],d[24],d[40],d[56])
+      v[ 0] = (e10 + o2 + 1024) >> 11;
+      v[24] = (e10 - o2 + 1024) >> 11;
+      v[ 8] = (e12 + o0 + 1024) >> 11;
+      v[16] = (e12 - o0 + 1024) >> 11;
+   }
+
+   // rows: remove the 1<<2 from the columns, 1<<13 from the constants and
+   // the 1<<3 of the two sqrt(8) scalings, rounding and adding 128
+   for (i=0, v=val, o=out; i < 4; ++i,v+=8,o+=out_stride) {
+      e0  = stbi__fsh(v[0]) * 2 + (1<<17) + (128<<18);
+      e2  = v[2]*stbi__f2f(1.847759065f) + v[6]*stbi__f2f(-0.765366865f);
+      e10 = e0 + e2;
+      e12 = e0 - e2;
+      STBI__IDCT_RED4_ODD(v[1],v[3],v[5],v[7])
+      o[0] = stbi__clamp((e10 + o2) >> 18);
+      o[3] = stbi__clamp((e10 - o2) >> 18);
+      o[1] = stbi__clamp((e12 + o0) >> 18);
+      o[2] = stbi__clamp((e12 - o0) >> 18);
+   }
+}
+
+#define STBI__IDCT_RED2_ODD(s1,s3,s5,s7) \
+   (  (s7)*stbi__f2f(-0.720959822f) + (s5)*stbi__f2f( 0.850430095f) \
+    + (s3)*stbi__f2f(-1.272758580f) + (s1)*stbi__f2f( 3.624509785f))
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   int e,o0;
+   short *d = data;
+
+   // columns; only the odd ones and the DC survive the averaging
+   for (i=0; i < 8; ++i,++d,++v) {
+      if (i == 2 || i == 4 || i == 6) continue;
+      if (d[8]==0 && d[24]==0 && d[40]==0 && d[56]==0) {
+         v[0] = v[8] = d[0] * 4;
+         continue;
+      }
+      e  = stbi__fsh(d[0]) * 4;
+      o0 = STBI__IDCT_RED2_ODD(d[8],d[24],d[40],d[56]);
+      v[0] = (e + o0 + 2048) >> 12;
+      v[8] = (e - o0 + 2048) >> 12;
+   }
+
+   for (i=0, v=val; i < 2; ++i,v+=8,out+=out_stride) {
+      e  = stbi__fsh(v[0]) * 4 + (1<<18) + (128<<19);
+      o0 = STBI__IDCT_RED2_ODD(v[1],v[3],v[5],v[7]);
+      out[0] = stbi__clamp((e + o0) >> 19);
+      out[1] = stbi__clamp((e - o0) >> 19);
+   }
+}
+
+#undef STBI__IDCT_RED4_ODD
+#undef STBI__IDCT_RED2_ODD
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0]+4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2508,6 +3277,216 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
 #endif // STBI_SSE2
 
+#ifdef STBI_AVX2
+// AVX2 version of stbi__idct_simd doing two blocks at once, one per 128-bit
+// lane: every step stays within its lane, so each block gets exactly the
+// SSE2 arithmetic. data holds the two blocks back to back.
+STBI_AVX2_TARGET
+static void stbi__idct_avx2(stbi_uc *out0, int stride0, stbi_uc *out1, int stride1, short data[128])
+{
+   __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m256i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+      __m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+      __m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+      __m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+      __m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+      __m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+      __m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+      __m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+         __m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+         out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi8(a, b); \
+      b = _mm256_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm256_unpacklo_epi16(a, b); \
+      b = _mm256_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m256i sum04 = _mm256_add_epi16(row0, row4); \
+         __m256i dif04 = _mm256_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m256i sum17 = _mm256_add_epi16(row1, row7); \
+         __m256i sum35 = _mm256_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   // load row r of the first block into the low lane, of the second into the high lane
+   #define dct_load(r) \
+      _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data + (r)*8))), \
+                              _mm_load_si128((const __m128i *) (data + 64 + (r)*8)), 1)
+
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m256i p0 = _mm256_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m256i p1 = _mm256_packus_epi16(row2, row3);
+      __m256i p2 = _mm256_packus_epi16(row4, row5);
+      __m256i p3 = _mm256_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      if (out1 == out0 + 8 && stride0 == stride1) {
+         // side by side: gather row k of both blocks into one 16-byte store
+         __m256i q0 = _mm256_permute4x64_epi64(p0, 0xd8);
+         __m256i q1 = _mm256_permute4x64_epi64(p1, 0xd8);
+         __m256i q2 = _mm256_permute4x64_epi64(p2, 0xd8);
+         __m256i q3 = _mm256_permute4x64_epi64(p3, 0xd8);
+         _mm_storeu_si128((__m128i *) out0, _mm256_castsi256_si128(q0)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_extracti128_si256(q0, 1)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_castsi256_si128(q2)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_extracti128_si256(q2, 1)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_castsi256_si128(q1)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_extracti128_si256(q1, 1)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_castsi256_si128(q3)); out0 += stride0;
+         _mm_storeu_si128((__m128i *) out0, _mm256_extracti128_si256(q3, 1));
+      } else {
+         int k;
+         for (k=0; k < 2; ++k) {
+            stbi_uc *out = k ? out1 : out0;
+            int out_stride = k ? stride1 : stride0;
+            __m128i b0 = k ? _mm256_extracti128_si256(p0, 1) : _mm256_castsi256_si128(p0);
+            __m128i b1 = k ? _mm256_extracti128_si256(p1, 1) : _mm256_castsi256_si128(p1);
+            __m128i b2 = k ? _mm256_extracti128_si256(p2, 1) : _mm256_castsi256_si128(p2);
+            __m128i b3 = k ? _mm256_extracti128_si256(p3, 1) : _mm256_castsi256_si128(p3);
+            _mm_storel_epi64((__m128i *) out, b0); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(b0, 0x4e)); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, b2); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(b2, 0x4e)); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, b1); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(b1, 0x4e)); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, b3); out += out_stride;
+            _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(b3, 0x4e));
+         }
+      }
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+}
+#endif // STBI_AVX2
+
 #ifdef STBI_NEON
 
 // NEON integer IDCT. should produce bit-identical
@@ -2750,13 +3729,220 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// Baseline blocks are IDCT'd as soon as they're decoded. With a two-block
+// kernel, each block waits here for the next one so they can go together.
+typedef struct
+{
+   STBI_SIMD_ALIGN(short, data[128]); // the next block is decoded into data + 64*n
+   stbi_uc *out;
+   int stride, n;
+} stbi__idct_queue;
+
+static void stbi__idct_queue_push(stbi__jpeg *z, stbi__idct_queue *q, stbi_uc *out, int stride)
+{
+   if (!z->idct_block2_kernel) {
+      z->idct_block_kernel(out, stride, q->data);
+   } else if (q->n) {
+      z->idct_block2_kernel(q->out, q->stride, out, stride, q->data);
+      q->n = 0;
+   } else {
+      q->out = out;
+      q->stride = stride;
+      q->n = 1;
+   }
+}
+
+static void stbi__idct_queue_flush(stbi__jpeg *z, stbi__idct_queue *q)
+{
+   if (q->n) z->idct_block_kernel(q->out, q->stride, q->data);
+   q->n = 0;
+}
+
+#ifdef STBI_THREADS
+// Each restart marker resets the bit reader and the DC predictors, so the
+// intervals of a baseline scan can be decoded independently. The scan is
+// located in memory up front, the markers found, and the intervals split
+// into bands that are decoded (and IDCT'd) in parallel. An interval only
+// counts if its data ends exactly at the next restart marker, as the serial
+// decoder requires to carry on; otherwise the whole scan is redone serially,
+// so corrupt files fail (or not) the same way with and without threads.
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc **start;  // interval i is the data from start[i] up to start[i+1]
+   int first, last;  // intervals in this band
+   int ok;
+} stbi__jpeg_band;
+
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int count)
+{
+   int m,k,x,y,bs = 8 >> z->scale;
+   stbi__idct_queue q;
+   q.n = 0;
+   for (m=first; m < first+count; ++m) {
+      if (z->scan_n == 1) {
+         // non-interleaved: every block is an MCU
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, q.data+64*q.n, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         stbi__idct_queue_push(z, &q, z->img_comp[n].data+z->img_comp[n].w2*(m/w)*bs+(m%w)*bs, z->img_comp[n].w2);
+      } else {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*bs;
+                  int y2 = (j*z->img_comp[n].v + y)*bs;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, q.data+64*q.n, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  stbi__idct_queue_push(z, &q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2);
+               }
+            }
+         }
+      }
+   }
+   stbi__idct_queue_flush(z, &q);
+   return 1;
+}
+
+static void stbi__jpeg_decode_band(void *job)
+{
+   stbi__jpeg_band *b = (stbi__jpeg_band *) job;
+   stbi__jpeg z = *b->z; // private bit reader and DC predictors
+   stbi__context s = *b->z->s;
+   int i;
+   z.s = &s;
+   b->ok = 0;
+   for (i=b->first; i < b->last; ++i) {
+      stbi__start_mem(&s, b->start[i], (int) (b->start[i+1] - b->start[i]));
+      stbi__jpeg_reset(&z);
+      if (!stbi__jpeg_decode_mcus(&z, i * z.restart_interval, z.restart_interval)) return;
+      if (z.code_bits < 24) stbi__grow_buffer_unsafe(&z);
+      if (!STBI__RESTART(z.marker) || s.img_buffer != b->start[i+1]) return;
+   }
+   b->ok = 1;
+}
+
+// pull the rest of a callback stream into memory and keep reading from there
+static int stbi__jpeg_buffer_stream(stbi__jpeg *z)
+{
+   stbi__context *s = z->s;
+   int len = (int) (s->img_buffer_end - s->img_buffer);
+   int cap = len + 65536;
+   stbi_uc *buf = (stbi_uc *) stbi__malloc(cap);
+   if (!buf) return stbi__err("outofmem", "Out of memory");
+   memcpy(buf, s->img_buffer, len);
+   for (;;) {
+      int n;
+      if (len == cap) {
+         stbi_uc *t;
+         if (cap > INT_MAX/2) { STBI_FREE(buf); return stbi__err("too large", "JPEG too large"); }
+         t = (stbi_uc *) STBI_REALLOC_SIZED(buf, cap, cap*2);
+         if (!t) { STBI_FREE(buf); return stbi__err("outofmem", "Out of memory"); }
+         buf = t;
+         cap *= 2;
+      }
+      n = (s->io.read)(s->io_user_data, (char *) buf + len, cap - len);
+      if (n <= 0) break;
+      len += n;
+   }
+   z->scan_data = buf;
+   s->io.read = NULL;
+   s->read_from_callbacks = 0;
+   s->img_buffer = buf;
+   s->img_buffer_end = buf + len;
+   return 1;
+}
+
+// returns -1 if the scan can't be split, or an interval didn't end cleanly at its
+// restart marker, so the caller decodes it serially
+static int stbi__parse_entropy_coded_data_threaded(stbi__jpeg *z)
+{
+   stbi__jpeg_band bands[STBI__MAX_THREADS*4];
+   stbi_uc **start, *p, *end;
+   int mcus, intervals, count, nbands, b, first;
+
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else
+      mcus = z->img_mcu_x * z->img_mcu_y;
+   intervals = (mcus + z->restart_interval-1) / z->restart_interval;
+   if (intervals < 2) return -1;
+
+   if (z->s->read_from_callbacks && !stbi__jpeg_buffer_stream(z)) return 0;
+   start = (stbi_uc **) stbi__malloc_mad2(intervals+1, sizeof(stbi_uc *), 0);
+   if (!start) return -1;
+
+   // find the restart markers; any other marker ends the scan
+   p = z->s->img_buffer;
+   end = z->s->img_buffer_end;
+   start[0] = p;
+   count = 1;
+   for (;;) {
+      stbi_uc *q;
+      while (p < end && *p != 0xff) ++p;
+      if (p == end) break;
+      q = p+1;
+      while (q < end && *q == 0xff) ++q; // fill bytes
+      if (q == end) { p = end; break; }
+      if (*q == 0) { p = q+1; continue; } // stuffed 0xff
+      if (!STBI__RESTART(*q)) break;
+      if (count == intervals) { count = 0; break; }
+      start[count++] = p = q+1;
+   }
+   if (count != intervals) {
+      // missing or extra restart markers; let the serial decoder deal with it
+      STBI_FREE(start);
+      return -1;
+   }
+
+   // all but the last interval go to the bands
+   nbands = stbi__decode_threads * 4;
+   if (nbands > STBI__MAX_THREADS*4) nbands = STBI__MAX_THREADS*4;
+   if (nbands > intervals-1) nbands = intervals-1;
+   for (b=0; b < nbands; ++b) {
+      bands[b].z = z;
+      bands[b].start = start;
+      bands[b].first = (int) ((stbi__uint64) (intervals-1) * b / nbands);
+      bands[b].last = (int) ((stbi__uint64) (intervals-1) * (b+1) / nbands);
+   }
+   stbi__run_jobs(stbi__jpeg_decode_band, bands, sizeof(bands[0]), nbands);
+   for (b=0; b < nbands; ++b) {
+      if (!bands[b].ok) {
+         STBI_FREE(start);
+         return -1;
+      }
+   }
+
+   // the last interval is decoded here, from the real stream, so the scan
+   // ends with the stream and marker state the serial decoder would leave
+   first = (intervals-1) * z->restart_interval;
+   z->s->img_buffer = start[intervals-1];
+   STBI_FREE(start);
+   if (!stbi__jpeg_decode_mcus(z, first, mcus - first)) return 0;
+   if (mcus - first == z->restart_interval && z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+   return 1;
+}
+#endif
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
+#ifdef STBI_THREADS
+   if (!z->progressive && z->restart_interval && stbi__decode_threads > 1 && z->s->img_x * z->s->img_y >= 256*256) {
+      int r = stbi__parse_entropy_coded_data_threaded(z);
+      if (r >= 0) return r;
+   }
+#endif
    if (!z->progressive) {
+      stbi__idct_queue q;
+      int bs = 8 >> z->scale; // output pixels per block side
+      q.n = 0;
       if (z->scan_n == 1) {
          int i,j;
-         STBI_SIMD_ALIGN(short, data[64]);
          int n = z->order[0];
          // non-interleaved data, we just need to process one block at a time,
          // in trivial scanline order
@@ -2767,22 +3953,22 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (!stbi__jpeg_decode_block(z, q.data+64*q.n, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               stbi__idct_queue_push(z, &q, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
                   // if it's NOT a restart, then just bail, so we get corrupt data
                   // rather than no data
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__idct_queue_flush(z, &q); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
          }
+         stbi__idct_queue_flush(z, &q);
          return 1;
       } else { // interleaved
          int i,j,k,x,y;
-         STBI_SIMD_ALIGN(short, data[64]);
          for (j=0; j < z->img_mcu_y; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
@@ -2792,11 +3978,11 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*bs;
+                        int y2 = (j*z->img_comp[n].v + y)*bs;
                         int ha = z->img_comp[n].ha;
-                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        if (!stbi__jpeg_decode_block(z, q.data+64*q.n, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        stbi__idct_queue_push(z, &q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2);
                      }
                   }
                }
@@ -2804,11 +3990,12 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                // so now count down the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
-                  if (!STBI__RESTART(z->marker)) return 1;
+                  if (!STBI__RESTART(z->marker)) { stbi__idct_queue_flush(z, &q); return 1; }
                   stbi__jpeg_reset(z);
                }
             }
          }
+         stbi__idct_queue_flush(z, &q);
          return 1;
       }
    } else {
@@ -2885,15 +4072,22 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
 {
    if (z->progressive) {
       // dequantize and idct the data
-      int i,j,n;
+      int i,j,n,bs = 8 >> z->scale;
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
          int h = (z->img_comp[n].y+7) >> 3;
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               stbi_uc *out = z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs;
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (z->idct_block2_kernel && i+1 < w) {
+                  // neighbouring blocks are adjacent in coeff, so do them together
+                  stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                  z->idct_block2_kernel(out, z->img_comp[n].w2, out+8, z->img_comp[n].w2, data);
+                  ++i;
+               } else
+                  z->idct_block_kernel(out, z->img_comp[n].w2, data);
             }
          }
       }
@@ -3064,6 +4258,17 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    return why;
 }
 
+// a component plane of w2 x rows pixels
+static int stbi__jpeg_alloc_plane(stbi__jpeg *z, int i, int rows)
+{
+   z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, rows, 15);
+   if (z->img_comp[i].raw_data == NULL)
+      return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
+   // align blocks for idct using mmx/sse
+   z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+   return 1;
+}
+
 static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 {
    stbi__context *s = z->s;
@@ -3123,21 +4328,23 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      //
+      // when decoding at reduced scale each block only produces 8>>scale pixels
+      // on a side, so the component planes shrink to match
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
-      if (z->img_comp[i].raw_data == NULL)
-         return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
-      // align blocks for idct using mmx/sse
-      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      z->img_comp[i].raw_data = NULL;
+      // when streaming rows, a baseline image's planes wait for the first
+      // scan, which decides whether they only need to hold a few MCU rows
+      if (!(s->dest && s->dest->emit) || z->progressive)
+         if (!stbi__jpeg_alloc_plane(z, i, z->img_comp[i].h2)) return 0;
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3180,6 +4387,8 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
    return 1;
 }
 
+static int stbi__jpeg_stream_scan(stbi__jpeg *z);
+
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
@@ -3188,12 +4397,24 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
    }
+   j->scan_data = NULL;
    j->restart_interval = 0;
    if (!stbi__decode_jpeg_header(j, STBI__SCAN_load)) return 0;
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
+         if (!j->img_comp[0].data) {
+            // first scan of a baseline image whose rows are being streamed
+            int k;
+            if (j->scan_n == j->s->img_n) {
+               if (!stbi__jpeg_stream_scan(j)) return 0;
+               j->streamed = 1;
+               return 1;
+            }
+            for (k=0; k < j->s->img_n; ++k)
+               if (!stbi__jpeg_alloc_plane(j, k, j->img_comp[k].h2)) return 0;
+         }
          if (!stbi__parse_entropy_coded_data(j)) return 0;
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
@@ -3592,12 +4813,227 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI_AVX2
+// output pixel x of stbi__resample_row_hv_2 for a row of w input pixels
+static stbi_uc stbi__hv_2_sample(const stbi_uc *in_near, const stbi_uc *in_far, int w, int x)
+{
+   int i = x >> 1;
+   int t = 3*in_near[i] + in_far[i];
+   if (x == 0 || x == 2*w-1) return stbi__div4(t+2);
+   if (x & 1) return stbi__div16(3*t + 3*in_near[i+1] + in_far[i+1] + 8);
+   return stbi__div16(3*t + 3*in_near[i-1] + in_far[i-1] + 8);
+}
+
+STBI_AVX2_TARGET
+static stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // same filter as stbi__resample_row_hv_2_simd, 16 pixels at a time
+   int i=0,t0,t1;
+
+   if (w == 1) {
+      out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   t1 = 3*in_near[0] + in_far[0];
+   for (; i < ((w-1) & ~15); i += 16) {
+      // vertical pass: 3*near + far = 4*near + (far - near)
+      __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+      __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+      __m256i curr  = _mm256_add_epi16(_mm256_slli_epi16(nearw, 2), _mm256_sub_epi16(farw, nearw));
+
+      // "prev" and "next" are curr shifted by one pixel, which has to cross
+      // the 128-bit lane boundary, with the neighbours of the block put in
+      __m256i lo_up = _mm256_permute2x128_si256(curr, curr, 0x08); // 0, curr.lo
+      __m256i hi_dn = _mm256_permute2x128_si256(curr, curr, 0x81); // curr.hi, 0
+      __m256i prev  = _mm256_insert_epi16(_mm256_alignr_epi8(curr, lo_up, 14), t1, 0);
+      __m256i next  = _mm256_insert_epi16(_mm256_alignr_epi8(hi_dn, curr, 2), 3*in_near[i+16] + in_far[i+16], 15);
+
+      // horizontal pass, even = 3*cur + prev, odd = 3*cur + next
+      __m256i curb  = _mm256_add_epi16(_mm256_slli_epi16(curr, 2), _mm256_set1_epi16(8));
+      __m256i even  = _mm256_add_epi16(_mm256_sub_epi16(prev, curr), curb);
+      __m256i odd   = _mm256_add_epi16(_mm256_sub_epi16(next, curr), curb);
+
+      // interleave even and odd pixels, undo scaling, pack and write
+      __m256i de0   = _mm256_srli_epi16(_mm256_unpacklo_epi16(even, odd), 4);
+      __m256i de1   = _mm256_srli_epi16(_mm256_unpackhi_epi16(even, odd), 4);
+      _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+
+      // "previous" value for next iter
+      t1 = 3*in_near[i+15] + in_far[i+15];
+   }
+
+   t0 = t1;
+   t1 = 3*in_near[i] + in_far[i];
+   out[i*2] = stbi__div16(3*t1 + t0 + 8);
+
+   for (++i; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+
+STBI_AVX2_TARGET
+static stbi_uc *stbi__resample_row_generic_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   // nearest-neighbor, with byte shuffles for the common 2x and 4x cases
+   int i=0,j;
+   STBI_NOTUSED(in_far);
+   if (hs == 2) {
+      __m256i dup = _mm256_setr_epi8(0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7, 8,8,9,9,10,10,11,11,12,12,13,13,14,14,15,15);
+      for (; i+16 <= w; i += 16) {
+         __m128i v = _mm_loadu_si128((const __m128i *) (in_near + i));
+         __m256i vv = _mm256_inserti128_si256(_mm256_castsi128_si256(v), v, 1);
+         _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_shuffle_epi8(vv, dup));
+      }
+   } else if (hs == 4) {
+      __m256i quad = _mm256_setr_epi8(0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3, 4,4,4,4,5,5,5,5,6,6,6,6,7,7,7,7);
+      for (; i+8 <= w; i += 8) {
+         __m128i v = _mm_loadl_epi64((const __m128i *) (in_near + i));
+         __m256i vv = _mm256_inserti128_si256(_mm256_castsi128_si256(v), v, 1);
+         _mm256_storeu_si256((__m256i *) (out + i*4), _mm256_shuffle_epi8(vv, quad));
+      }
+   }
+   for (; i < w; ++i)
+      for (j=0; j < hs; ++j)
+         out[i*hs+j] = in_near[i];
+   return out;
+}
+
+// YCbCr->RGB for 16 pixels with the fixed-point math of stbi__YCbCr_to_RGB_simd;
+// y, cb and cr hold 0..255 in 16-bit lanes. Writes 16*step bytes (step 3 or 4).
+STBI_AVX2_TARGET
+static void stbi__YCbCr16_to_RGB_avx2(stbi_uc *out, __m256i y, __m256i cb, __m256i cr, int step)
+{
+   __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+   __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+   __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+   __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+   __m256i c128 = _mm256_set1_epi16(128);
+   __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+   // same values the SSE2 byte unpacks produce: (y*256+128)>>4 and (c-128)*256
+   __m256i yws = _mm256_add_epi16(_mm256_slli_epi16(y, 4), _mm256_set1_epi16(8));
+   __m256i crw = _mm256_slli_epi16(_mm256_sub_epi16(cr, c128), 8);
+   __m256i cbw = _mm256_slli_epi16(_mm256_sub_epi16(cb, c128), 8);
+
+   // color transform
+   __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+   __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+   __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+   __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+   __m256i rws = _mm256_add_epi16(cr0, yws);
+   __m256i gwt = _mm256_add_epi16(cb0, yws);
+   __m256i bws = _mm256_add_epi16(yws, cb1);
+   __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+   // descale
+   __m256i rw = _mm256_srai_epi16(rws, 4);
+   __m256i bw = _mm256_srai_epi16(bws, 4);
+   __m256i gw = _mm256_srai_epi16(gws, 4);
+
+   // back to byte, and interleave channels within each lane
+   __m256i brb = _mm256_packus_epi16(rw, bw);
+   __m256i gxb = _mm256_packus_epi16(gw, xw);
+   __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+   __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+   __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+   __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+
+   if (step == 4) {
+      _mm256_storeu_si256((__m256i *) (out +  0), _mm256_permute2x128_si256(o0, o1, 0x20));
+      _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+   } else {
+      // drop alpha; the overlapping stores go in order so each fixes up the last one's tail
+      __m256i rgb = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1, 0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+      __m256i q0 = _mm256_shuffle_epi8(o0, rgb);
+      __m256i q1 = _mm256_shuffle_epi8(o1, rgb);
+      __m128i last = _mm256_extracti128_si256(q1, 1);
+      int tail = _mm_cvtsi128_si32(_mm_srli_si128(last, 8));
+      _mm_storeu_si128((__m128i *) (out +  0), _mm256_castsi256_si128(q0));
+      _mm_storeu_si128((__m128i *) (out + 12), _mm256_castsi256_si128(q1));
+      _mm_storeu_si128((__m128i *) (out + 24), _mm256_extracti128_si256(q0, 1));
+      _mm_storel_epi64((__m128i *) (out + 36), last);
+      memcpy(out + 44, &tail, 4);
+   }
+}
+
+STBI_AVX2_TARGET
+static void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+   if (step == 3 || step == 4) {
+      for (; i+15 < count; i += 16) {
+         __m256i yw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (y+i)));
+         __m256i cbw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcb+i)));
+         __m256i crw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcr+i)));
+         stbi__YCbCr16_to_RGB_avx2(out, yw, cbw, crw, step);
+         out += 16*step;
+      }
+   }
+   stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+// 2x2 upsampled chroma for output pixels 2i..2i+15, as stbi__resample_row_hv_2_simd
+// computes it, left in 16-bit lanes
+STBI_AVX2_TARGET
+static __m256i stbi__upsample16_avx2(const stbi_uc *in_near, const stbi_uc *in_far, int i)
+{
+   __m128i zero  = _mm_setzero_si128();
+   __m128i farw  = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far + i)), zero);
+   __m128i nearw = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i)), zero);
+   __m128i curr  = _mm_add_epi16(_mm_slli_epi16(nearw, 2), _mm_sub_epi16(farw, nearw));
+   int t1 = i ? 3*in_near[i-1] + in_far[i-1] : 3*in_near[0] + in_far[0];
+   __m128i prev  = _mm_insert_epi16(_mm_slli_si128(curr, 2), t1, 0);
+   __m128i next  = _mm_insert_epi16(_mm_srli_si128(curr, 2), 3*in_near[i+8] + in_far[i+8], 7);
+   __m128i curb  = _mm_add_epi16(_mm_slli_epi16(curr, 2), _mm_set1_epi16(8));
+   __m128i even  = _mm_add_epi16(_mm_sub_epi16(prev, curr), curb);
+   __m128i odd   = _mm_add_epi16(_mm_sub_epi16(next, curr), curb);
+   __m128i de0   = _mm_srli_epi16(_mm_unpacklo_epi16(even, odd), 4);
+   __m128i de1   = _mm_srli_epi16(_mm_unpackhi_epi16(even, odd), 4);
+   return _mm256_inserti128_si256(_mm256_castsi128_si256(de0), de1, 1);
+}
+
+// 2x2 chroma upsampling fused with color conversion, so the upsampled chroma
+// never goes through a line buffer. Same output as resampling both chroma
+// rows with stbi__resample_row_hv_2 and converting with YCbCr_to_RGB.
+STBI_AVX2_TARGET
+static void stbi__YCbCr_hv_2_to_RGB_avx2(stbi_uc *out, const stbi_uc *y, const stbi_uc *cb_near, const stbi_uc *cb_far,
+                                         const stbi_uc *cr_near, const stbi_uc *cr_far, int count, int w_lores, int step)
+{
+   stbi_uc cb[16], cr[16];
+   int i = 0, x, n;
+   for (; i < ((w_lores-1) & ~7); i += 8) {
+      __m256i yw = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (y + i*2)));
+      stbi__YCbCr16_to_RGB_avx2(out, yw, stbi__upsample16_avx2(cb_near, cb_far, i), stbi__upsample16_avx2(cr_near, cr_far, i), step);
+      out += 16*step;
+   }
+   // at most 16 pixels are left, including the right edge
+   n = count - i*2;
+   for (x=0; x < n; ++x) {
+      cb[x] = stbi__hv_2_sample(cb_near, cb_far, w_lores, i*2 + x);
+      cr[x] = stbi__hv_2_sample(cr_near, cr_far, w_lores, i*2 + x);
+   }
+   stbi__YCbCr_to_RGB_row(out, y + i*2, cb, cr, n, step);
+}
+#endif // STBI_AVX2
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
    j->idct_block_kernel = stbi__idct_block;
+   j->idct_block2_kernel = NULL;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
+   j->YCbCr_hv_2_to_RGB_kernel = NULL;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+   j->resample_row_generic_kernel = stbi__resample_row_generic;
 
 #ifdef STBI_SSE2
    if (stbi__sse2_available()) {
@@ -3607,17 +5043,39 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    }
 #endif
 
+#ifdef STBI_AVX2
+   if (stbi__avx2_available()) {
+      j->idct_block2_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+      j->YCbCr_hv_2_to_RGB_kernel = stbi__YCbCr_hv_2_to_RGB_avx2;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+      j->resample_row_generic_kernel = stbi__resample_row_generic_avx2;
+   }
+#endif
+
 #ifdef STBI_NEON
    j->idct_block_kernel = stbi__idct_simd;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->scale = j->s->scale;
+   if (j->scale) {
+      j->idct_block_kernel = j->scale == 1 ? stbi__idct_block_4x4
+                           : j->scale == 2 ? stbi__idct_block_2x2
+                           :                 stbi__idct_block_1x1;
+      j->idct_block2_kernel = NULL;
+   }
 }
 
 // clean up the temporary component buffers
 static void stbi__cleanup_jpeg(stbi__jpeg *j)
 {
    stbi__free_jpeg_components(j, j->s->img_n, 0);
+   if (j->scan_data) {
+      STBI_FREE(j->scan_data);
+      j->scan_data = NULL;
+   }
 }
 
 typedef struct
@@ -3628,6 +5086,7 @@ typedef struct
    int w_lores; // horizontal pixels pre-expansion
    int ystep;   // how far through vertical expansion we are
    int ypos;    // which pre-expansion row we're on
+   stbi_uc *ring, *ring_end; // a streamed plane is a ring of rows; else NULL
 } stbi__resample;
 
 // fast 0..255 * 0..255 => 0..255 rounded multiplication
@@ -3637,16 +5096,211 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+typedef struct
 {
+   stbi__jpeg *z;
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4];
+   stbi_uc *output;
+   stbi_uc *tail;       // if set, the last row is built here then copied out
+   int staged;          // ...or every row, when output is the caller's buffer
    int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   stbi__uint32 y0, y1; // output rows to produce
+} stbi__jpeg_rows;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+stbi_inline static void stbi__resample_next_row(stbi__resample *r, int h, int w2)
+{
+   if (++r->ystep >= r->vs) {
+      r->ystep = 0;
+      r->line0 = r->line1;
+      if (++r->ypos < h) {
+         r->line1 += w2;
+         if (r->line1 == r->ring_end) r->line1 = r->ring;
+      }
+   }
+}
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+// resample and color-convert output rows y0..y1-1
+static void stbi__jpeg_convert_rows(void *job)
+{
+   stbi__jpeg_rows *rows = (stbi__jpeg_rows *) job;
+   stbi__jpeg *z = rows->z;
+   stbi__resample *res_comp = rows->res_comp;
+   stbi_uc *output = rows->output;
+   int k, n = rows->n, decode_n = rows->decode_n, is_rgb = rows->is_rgb;
+   unsigned int i,j;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   stbi_uc *in0[4], *in1[4];
+   // 2x2 subsampled chroma can be upsampled on the fly by the color converter
+   int fused = z->YCbCr_hv_2_to_RGB_kernel && n >= 3 && z->s->img_n == 3 && !is_rgb &&
+               res_comp[0].hs == 1 && res_comp[0].vs == 1 &&
+               res_comp[1].hs == 2 && res_comp[1].vs == 2 &&
+               res_comp[2].hs == 2 && res_comp[2].vs == 2;
+
+   for (j=rows->y0; j < rows->y1; ++j) {
+      stbi_uc *dst = z->s->dest ? stbi__dest_row(z->s, j) : output + n * z->s->img_x * j;
+      stbi_uc *out = dst;
+      // 3-channel rows write one byte past their end, which would land in
+      // the first row of the next band while that band is running, or in
+      // memory we don't own
+      int use_tail = rows->tail && (rows->staged || j+1 == rows->y1);
+      if (use_tail) out = rows->tail;
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         in0[k] = y_bot ? r->line1 : r->line0;
+         in1[k] = y_bot ? r->line0 : r->line1;
+         if (!fused || k == 0)
+            coutput[k] = r->resample(rows->linebuf[k], in0[k], in1[k], r->w_lores, r->hs);
+         stbi__resample_next_row(r, z->img_comp[k].y, z->img_comp[k].w2);
+      }
+      if (fused) {
+         z->YCbCr_hv_2_to_RGB_kernel(out, coutput[0], in0[1], in1[1], in0[2], in1[2], z->s->img_x, res_comp[1].w_lores, n);
+      } else if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < z->s->img_x; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               for (i=0; i < z->s->img_x; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               if (n == 2) out[1] = 255; // n == 1 has no room for it
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               if (n == 2) out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+      if (use_tail)
+         memcpy(dst, rows->tail, n * z->s->img_x);
+      if (z->s->dest && !stbi__dest_done(z->s, j))
+         return;
+   }
+}
+
+#ifdef STBI_THREADS
+// splits the output into bands of rows, each with its own line buffers and
+// resampler state; returns 0 to leave the whole image to the caller
+static int stbi__jpeg_convert_threaded(stbi__jpeg_rows *all)
+{
+   stbi__jpeg *z = all->z;
+   stbi__jpeg_rows bands[STBI__MAX_THREADS];
+   stbi__resample r[4];
+   stbi_uc *linebufs;
+   int b, k, nbands = stbi__decode_threads;
+   stbi__uint32 j = 0;
+   if (nbands > STBI__MAX_THREADS) nbands = STBI__MAX_THREADS;
+   if (nbands < 2 || z->s->img_x * z->s->img_y < 256*256) return 0;
+   // each band gets decode_n line buffers and room for a tail row
+   linebufs = (stbi_uc *) stbi__malloc_mad3(nbands, all->decode_n + all->n, z->s->img_x + 3, 0);
+   if (!linebufs) return 0;
+   memcpy(r, all->res_comp, sizeof(r));
+   for (b=0; b < nbands; ++b) {
+      bands[b] = *all;
+      bands[b].y0 = (stbi__uint32) ((stbi__uint64) z->s->img_y * b / nbands);
+      bands[b].y1 = (stbi__uint32) ((stbi__uint64) z->s->img_y * (b+1) / nbands);
+      // step the resamplers to the band's first row, as the serial loop would
+      for (; j < bands[b].y0; ++j)
+         for (k=0; k < all->decode_n; ++k)
+            stbi__resample_next_row(&r[k], z->img_comp[k].y, z->img_comp[k].w2);
+      memcpy(bands[b].res_comp, r, sizeof(r));
+      for (k=0; k < all->decode_n; ++k)
+         bands[b].linebuf[k] = linebufs + (size_t) (b * (all->decode_n + all->n) + k) * (z->s->img_x + 3);
+      if (all->n == 3 && (b+1 < nbands || all->staged))
+         bands[b].tail = linebufs + (size_t) (b * (all->decode_n + all->n) + all->decode_n) * (z->s->img_x + 3);
+   }
+   stbi__run_jobs(stbi__jpeg_convert_rows, bands, sizeof(bands[0]), nbands);
+   STBI_FREE(linebufs);
+   return 1;
+}
+#endif
+
+// with a reduced IDCT the planes come out smaller; from here on the
+// image and component sizes are in output pixels
+static void stbi__jpeg_rescale(stbi__jpeg *z)
+{
+   if (z->scale) {
+      int k, round = (1 << z->scale) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale;
+      z->s->img_y = (z->s->img_y + round) >> z->scale;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale;
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale;
+      }
+   }
+}
+
+// sets up resampling and color conversion of the decoded planes into
+// rows->output, which is s->dest's buffer if there is one
+static int stbi__jpeg_rows_init(stbi__jpeg *z, stbi__jpeg_rows *rows, int req_comp)
+{
+   int k, n, decode_n, is_rgb;
+   stbi__resample *res_comp = rows->res_comp;
+
+   rows->tail = NULL;
+   rows->staged = 0;
 
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
@@ -3658,142 +5312,186 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    else
       decode_n = z->s->img_n;
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+      r->ring    = r->ring_end = NULL;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = z->resample_row_generic_kernel;
+   }
+
+   if (z->s->dest) {
+      // rows go straight to the caller's buffer; 3-channel ones are staged
+      // in a row of our own so we never write past them
+      if (!stbi__dest_fits(z->s, n)) return 0;
+      rows->output = z->s->dest->pixels;
+      if (n == 3) {
+         rows->tail = (stbi_uc *) stbi__malloc_mad2(n, z->s->img_x, 1);
+         if (!rows->tail) return stbi__err("outofmem", "Out of memory");
+         rows->staged = 1;
+      }
+   } else {
+      rows->output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+      if (!rows->output) return stbi__err("outofmem", "Out of memory");
+   }
+
+   rows->z = z;
+   rows->n = n;
+   rows->decode_n = decode_n;
+   rows->is_rgb = is_rgb;
+   rows->y0 = 0;
+   rows->y1 = z->s->img_y;
+   for (k=0; k < decode_n; ++k)
+      rows->linebuf[k] = z->img_comp[k].linebuf;
+   return 1;
+}
 
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
-
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
+// decodes row m of MCUs (or of blocks, for a single component), w of them,
+// into its slot of the planes' rings; gh[k] is the height of component k's
+// rows in the ring
+static int stbi__jpeg_stream_group(stbi__jpeg *z, stbi__idct_queue *q, int m, int w, int *gh, int *stop)
+{
+   int i,k,x,y,bs = 8 >> z->scale;
+   for (i=0; i < w; ++i) {
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         int bx = z->scan_n == 1 ? 1 : z->img_comp[n].h;
+         int by = z->scan_n == 1 ? 1 : z->img_comp[n].v;
+         for (y=0; y < by; ++y) {
+            for (x=0; x < bx; ++x) {
+               int x2 = (i*bx + x)*bs;
+               int y2 = (m%3)*gh[n] + y*bs;
+               int ha = z->img_comp[n].ha;
+               if (!stbi__jpeg_decode_block(z, q->data+64*q->n, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+               stbi__idct_queue_push(z, q, z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2);
             }
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
+      }
+      if (--z->todo <= 0) {
+         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+         // if it's NOT a restart, then just stop, so we get corrupt data
+         // rather than no data
+         if (!STBI__RESTART(z->marker)) { *stop = 1; break; }
+         stbi__jpeg_reset(z);
+      }
+   }
+   stbi__idct_queue_flush(z, q);
+   return 1;
+}
+
+// Streams the first scan of a baseline image to s->dest when it holds every
+// component. The planes only hold three rows of MCUs: once MCU row m+1 is
+// decoded, the output rows of MCU row m have the chroma rows above and below
+// that upsampling needs, so they're converted and handed on. Decoding is
+// serial here, restart intervals or not.
+static int stbi__jpeg_stream_scan(stbi__jpeg *z)
+{
+   stbi__jpeg_rows rows;
+   stbi__idct_queue q;
+   int bs = 8 >> z->scale; // output pixels per block side
+   int gh[4], gout, groups, w;
+   int m, k, ok = 1, stop = 0;
+
+   if (z->scan_n == 1) {
+      // non-interleaved, so a single component image; its rows of blocks
+      // are decoded one at a time
+      w = (z->img_comp[0].x+7) >> 3;
+      groups = (z->img_comp[0].y+7) >> 3;
+      gh[0] = gout = bs;
+   } else {
+      w = z->img_mcu_x;
+      groups = z->img_mcu_y;
+      for (k=0; k < z->s->img_n; ++k)
+         gh[k] = z->img_comp[k].v * bs;
+      gout = z->img_v_max * bs;
+   }
+   for (k=0; k < z->s->img_n; ++k)
+      if (!stbi__jpeg_alloc_plane(z, k, 3 * gh[k])) return 0;
+
+   stbi__jpeg_rescale(z);
+   if (!stbi__jpeg_rows_init(z, &rows, z->req_comp)) {
+      if (rows.staged) STBI_FREE(rows.tail);
+      return 0;
+   }
+   for (k=0; k < rows.decode_n; ++k) {
+      rows.res_comp[k].ring = z->img_comp[k].data;
+      rows.res_comp[k].ring_end = z->img_comp[k].data + z->img_comp[k].w2 * 3 * gh[k];
+   }
+
+   stbi__jpeg_reset(z);
+   q.n = 0;
+   for (m=0; m <= groups && ok; ++m) {
+      if (m < groups && !stop)
+         ok = stbi__jpeg_stream_group(z, &q, m, w, gh, &stop);
+      if (m > 0 && ok) {
+         // the previous group's rows now have everything they need
+         stbi__uint32 y0 = (stbi__uint32) (m-1) * gout;
+         rows.y0 = y0;
+         rows.y1 = y0 + gout < z->s->img_y ? y0 + gout : z->s->img_y;
+         if (rows.y0 < rows.y1) {
+            stbi__jpeg_convert_rows(&rows);
+            if (z->s->dest->stopped) ok = 0;
          }
       }
-      stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
    }
+   if (rows.staged) STBI_FREE(rows.tail);
+   return ok;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi_uc *output;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   // load a jpeg image from whichever source, but leave in YCbCr format
+   z->req_comp = req_comp;
+   z->streamed = 0;
+   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+
+   if (z->streamed) {
+      output = z->s->dest->pixels;
+   } else {
+      // resample and color-convert
+      stbi__jpeg_rows rows;
+      stbi__jpeg_rescale(z);
+      if (!stbi__jpeg_rows_init(z, &rows, req_comp)) {
+         if (rows.staged) STBI_FREE(rows.tail);
+         stbi__cleanup_jpeg(z);
+         return NULL;
+      }
+      output = rows.output;
+      // can't error after this so, this is safe (other than a row callback stopping us)
+#ifdef STBI_THREADS
+      // a row callback needs the rows in order
+      if ((z->s->dest && z->s->dest->emit) || !stbi__jpeg_convert_threaded(&rows))
+#endif
+         stbi__jpeg_convert_rows(&rows);
+      if (rows.staged) STBI_FREE(rows.tail);
+      if (z->s->dest && z->s->dest->stopped) { stbi__cleanup_jpeg(z); return NULL; }
+   }
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
@@ -3848,14 +5546,25 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - fast huffman, with two literals per lookup where they fit
+//      - 64-bit bit buffer refilled 8 bytes at a time
+//      - wide match copies while there's room in the output buffer
 
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  11 // accelerate all cases in default tables, and most in dynamic ones
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// the fast decode loop may write this many bytes for one symbol (a
+// 258-byte match rounded up to 16-byte copies), so it only runs while
+// that much room is left in the output
+#define STBI__ZFAST_OUT   (258 + 16)
+
+#if defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET) || defined(_M_ARM) || defined(_M_ARM64) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define STBI__ZLITTLE_ENDIAN
+#endif
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3942,14 +5651,27 @@ typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   int num_zeros; // bytes of zero padding read past zbuffer_end
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
 
+   // if set, output is passed to drain when the buffer fills, which returns
+   // how much it used (or -1 to fail), and the buffer then only keeps the
+   // window back references can reach plus whatever wasn't used
+   int (*drain)(void *user, stbi_uc *data, int len);
+   void *drain_user;
+   char *zdrained; // output before this has been used
+
    stbi__zhuffman z_length, z_distance;
+
+   // literal/length lookup that decodes up to two literals at once:
+   // bits 0-7 = bits used, 8-9 = symbol count (0 = use slow path),
+   // 16-24 = first symbol, 24-31 = second literal
+   stbi__uint32 lit_fast[1 << STBI__ZFAST_BITS];
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -3958,20 +5680,36 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return *z->zbuffer++;
 }
 
+// the fast refill below leaves copies of not-yet-consumed input bytes above
+// num_bits in code_buffer; OR-ing the same bytes in again is harmless
 static void stbi__fill_bits(stbi__zbuf *z)
 {
    do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      if (z->zbuffer < z->zbuffer_end)
+         z->code_buffer |= (stbi__uint64) *z->zbuffer++ << z->num_bits;
+      else
+         ++z->num_zeros;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#ifdef STBI__ZLITTLE_ENDIAN
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__uint64) p[0]       | ((stbi__uint64) p[1] << 8)  | ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+         ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) | ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+#endif
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) z->code_buffer & ((1 << n) - 1);
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -3982,7 +5720,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -3999,7 +5737,7 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
    int b,s;
    if (a->num_bits < 16) stbi__fill_bits(a);
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+   b = z->fast[(int) a->code_buffer & STBI__ZFAST_MASK];
    if (b) {
       s = b >> 9;
       a->code_buffer >>= s;
@@ -4009,14 +5747,39 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+static int stbi__zdrain(stbi__zbuf *z)
+{
+   char *keep;
+   int used = z->drain(z->drain_user, (stbi_uc *) z->zdrained, (int) (z->zout - z->zdrained));
+   if (used < 0) return 0;
+   z->zdrained += used;
+   // distances go back at most 32768 bytes
+   keep = z->zout - z->zout_start > 32768 ? z->zout - 32768 : z->zout_start;
+   if (keep > z->zdrained) keep = z->zdrained;
+   if (keep > z->zout_start) {
+      int n = (int) (z->zout - keep);
+      memmove(z->zout_start, keep, n);
+      z->zdrained -= keep - z->zout_start;
+      z->zout = z->zout_start + n;
+   }
+   return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
-   int cur, limit, old_limit;
+   int cur, limit, old_limit, drained;
    z->zout = zout;
+   if (z->drain) {
+      if (!stbi__zdrain(z)) return 0;
+      if (z->zout_end - z->zout >= n) return 1;
+   }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
+   drained = (int) (z->zdrained - z->zout_start);
+   if (limit < STBI__ZFAST_OUT) // an initial size of 0 would never grow
+      limit = STBI__ZFAST_OUT;
    while (cur + n > limit)
       limit *= 2;
    q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
@@ -4025,6 +5788,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    z->zout_start = q;
    z->zout       = q + cur;
    z->zout_end   = q + limit;
+   z->zdrained   = q + drained;
    return 1;
 }
 
@@ -4042,11 +5806,146 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// builds a->lit_fast from the fast table of the literal/length code
+static void stbi__zbuild_lit_fast(stbi__zbuf *a)
+{
+   stbi__uint16 *fast = a->z_length.fast;
+   int i;
+   for (i=0; i < (1 << STBI__ZFAST_BITS); ++i) {
+      int b = fast[i], s, v;
+      if (!b) {
+         a->lit_fast[i] = 0;
+         continue;
+      }
+      s = b >> 9;
+      v = b & 511;
+      a->lit_fast[i] = (stbi__uint32) (s | (1 << 8) | (v << 16));
+      if (v < 256) {
+         // the bits after the first code are all real if the second code fits in what's left
+         int b2 = fast[i >> s];
+         if (b2 && (b2 & 511) < 256 && s + (b2 >> 9) <= STBI__ZFAST_BITS)
+            a->lit_fast[i] = (stbi__uint32) ((s + (b2 >> 9)) | (2 << 8) | ((stbi__uint32) v << 16) | ((stbi__uint32) (b2 & 255) << 24));
+      }
+   }
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
+   stbi__zbuild_lit_fast(a);
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (a->z_expandable && a->zout_end - zout < STBI__ZFAST_OUT) {
+         if (!stbi__zexpand(a, zout, STBI__ZFAST_OUT)) return 0;
+         zout = a->zout;
+      }
+
+      // fast path: at least 8 bytes of input and STBI__ZFAST_OUT bytes of
+      // output left, so one refill covers a whole length/distance pair
+      // (at most 15+5+15+13 bits) and copies can overrun by up to 15 bytes
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - zout >= STBI__ZFAST_OUT) {
+         stbi__uint64 cb = a->code_buffer;
+         int nb = a->num_bits;
+         stbi_uc *in = a->zbuffer;
+         do {
+            stbi__uint32 e;
+            int len, dist, n;
+            stbi_uc *p;
+            cb |= stbi__zload64(in) << nb;
+            in += (63 - nb) >> 3;
+            nb |= 56;
+
+            e = a->lit_fast[(int) cb & STBI__ZFAST_MASK];
+            if ((e >> 8) & 3) {
+               cb >>= e & 255;
+               nb -= e & 255;
+               z = (e >> 16) & 511;
+               if (((e >> 8) & 3) == 2) {
+                  zout[0] = (char) z;
+                  zout[1] = (char) (e >> 24);
+                  zout += 2;
+                  continue;
+               }
+            } else {
+               a->code_buffer = cb; a->num_bits = nb;
+               z = stbi__zhuffman_decode_slowpath(a, &a->z_length);
+               cb = a->code_buffer; nb = a->num_bits;
+               if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+            }
+            if (z < 256) {
+               *zout++ = (char) z;
+               continue;
+            }
+            if (z == 256) {
+               a->code_buffer = cb;
+               a->num_bits = nb;
+               a->zbuffer = in;
+               a->zout = zout;
+               return 1;
+            }
+            z -= 257;
+            if (z >= 29) return stbi__err("bad huffman code","Corrupt PNG");
+            n = stbi__zlength_extra[z];
+            len = stbi__zlength_base[z] + (int) (cb & ((1 << n) - 1));
+            cb >>= n;
+            nb -= n;
+
+            z = a->z_distance.fast[(int) cb & STBI__ZFAST_MASK];
+            if (z) {
+               cb >>= z >> 9;
+               nb -= z >> 9;
+               z &= 511;
+            } else {
+               a->code_buffer = cb; a->num_bits = nb;
+               z = stbi__zhuffman_decode_slowpath(a, &a->z_distance);
+               cb = a->code_buffer; nb = a->num_bits;
+            }
+            if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG");
+            n = stbi__zdist_extra[z];
+            dist = stbi__zdist_base[z] + (int) (cb & ((1 << n) - 1));
+            cb >>= n;
+            nb -= n;
+            if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+
+            p = (stbi_uc *) (zout - dist);
+            if (dist >= 16) {
+               // each 16-byte chunk only reads bytes that are already written
+               char *end = zout + len;
+               do {
+                  memcpy(zout, p, 16);
+                  zout += 16;
+                  p += 16;
+               } while (zout < end);
+               zout = end;
+            } else if (dist == 1) { // run of one byte; common in images.
+               stbi__uint64 v = *p * (stbi__uint64) 0x0101010101010101;
+               char *end = zout + len;
+               do {
+                  memcpy(zout, &v, 8);
+                  zout += 8;
+               } while (zout < end);
+               zout = end;
+            } else if (dist >= 8) {
+               char *end = zout + len;
+               do {
+                  memcpy(zout, p, 8);
+                  zout += 8;
+                  p += 8;
+               } while (zout < end);
+               zout = end;
+            } else {
+               do *zout++ = *p++; while (--len);
+            }
+         } while (in + 8 <= a->zbuffer_end && a->zout_end - zout >= STBI__ZFAST_OUT);
+         a->code_buffer = cb;
+         a->num_bits = nb;
+         a->zbuffer = in;
+         continue;
+      }
+
+      // a truncated stream reads as endless zero bits; don't decode those forever
+      if (a->num_zeros > 64) return stbi__err("unexpected end","Corrupt PNG");
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4062,10 +5961,11 @@ static int stbi__parse_huffman_block(stbi__zbuf *a)
             return 1;
          }
          z -= 257;
+         if (z >= 29) return stbi__err("bad huffman code","Corrupt PNG");
          len = stbi__zlength_base[z];
          if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
          z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+         if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG");
          dist = stbi__zdist_base[z];
          if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
          if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
@@ -4136,20 +6036,19 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
 static int stbi__parse_uncompressed_block(stbi__zbuf *a)
 {
    stbi_uc header[4];
-   int len,nlen,k;
+   int len,nlen,k,held;
    if (a->num_bits & 7)
       stbi__zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
-   k = 0;
-   while (a->num_bits > 0) {
-      header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
-      a->code_buffer >>= 8;
-      a->num_bits -= 8;
-   }
-   STBI_ASSERT(a->num_bits == 0);
-   // now fill header the normal way
-   while (k < 4)
-      header[k++] = stbi__zget8(a);
+   // give the whole bytes still in the bit buffer back to the input; the most
+   // recent ones may be zero padding from past the end of the input
+   held = a->num_bits >> 3;
+   k = held < a->num_zeros ? held : a->num_zeros;
+   a->zbuffer -= held - k;
+   a->num_zeros -= k;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   for (k=0; k < 4; ++k)
+      header[k] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
@@ -4210,6 +6109,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->num_zeros = 0;
    a->code_buffer = 0;
    do {
       final = stbi__zreceive(a,1);
@@ -4238,6 +6138,8 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->drain = NULL;
+   a->zdrained = obuf;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4357,6 +6259,11 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int direct;       // store each row in s->dest as it's unfiltered, keeping only two in out
+   stbi_uc *palette; // ...expanding through this if pal_n is 3 or 4
+   int pal_n;
+   int color;
+   stbi__uint32 rows_done; // direct: rows unfiltered so far, as they're inflated
 } stbi__png;
 
 
@@ -4371,30 +6278,525 @@ enum {
    STBI__F_paeth_first
 };
 
-static stbi_uc first_row_filter[5] =
+static stbi_uc first_row_filter[5] =
+{
+   STBI__F_none,
+   STBI__F_sub,
+   STBI__F_none,
+   STBI__F_avg_first,
+   STBI__F_paeth_first
+};
+
+static int stbi__paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p-a);
+   int pb = abs(p-b);
+   int pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// SIMD unfiltering of 8-bit rows with 3 or 4 bytes per pixel (optionally
+// expanding 3 to 4 with alpha=255), for the 'pixels' pixels after the first
+// one, which the caller has already written. Up and Sub take 16 bytes of
+// the row at a time, Sub as a prefix sum over the pixels in the vector.
+// Avg and Paeth need the finished pixel to their left; Avg keeps the chain
+// from one pixel to the next short and batches the loads and stores, Paeth
+// goes a pixel at a time but branch-free across its channels.
+
+stbi_inline static stbi__uint32 stbi__png_load_px(const stbi_uc *p, int n)
+{
+   return p[0] | (p[1] << 8) | (p[2] << 16) | (n == 4 ? (stbi__uint32) p[3] << 24 : 0);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, stbi__uint32 v, int n)
+{
+   p[0] = (stbi_uc) v;
+   p[1] = (stbi_uc) (v >> 8);
+   p[2] = (stbi_uc) (v >> 16);
+   if (n == 4) p[3] = (stbi_uc) (v >> 24);
+}
+
+#ifdef STBI_SSE2
+// spreads the 4 RGB pixels in the low 12 bytes out to 4 bytes each, alpha 0
+stbi_inline static __m128i stbi__png_spread3(__m128i v)
+{
+   __m128i rgb = _mm_setr_epi32(0xffffff, 0, 0, 0);
+   __m128i p0 = _mm_and_si128(v, rgb);
+   __m128i p1 = _mm_and_si128(_mm_slli_si128(v, 1), _mm_slli_si128(rgb, 4));
+   __m128i p2 = _mm_and_si128(_mm_slli_si128(v, 2), _mm_slli_si128(rgb, 8));
+   __m128i p3 = _mm_and_si128(_mm_slli_si128(v, 3), _mm_slli_si128(rgb, 12));
+   return _mm_or_si128(_mm_or_si128(p0, p1), _mm_or_si128(p2, p3));
+}
+
+static void stbi__png_unfilter_row_simd(int filter, stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int pixels, int img_n, int out_n)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i alpha = _mm_cvtsi32_si128(img_n != out_n ? (int) 0xff000000 : 0);
+   __m128i a = _mm_cvtsi32_si128((int) stbi__png_load_px(cur - out_n, out_n));
+   __m128i c = zero;
+   int nk = pixels * img_n, i = 0;
+
+   // paeth of a, 0 and 0 is a
+   if (filter == STBI__F_paeth_first)
+      filter = STBI__F_sub;
+
+   if (filter == STBI__F_up) {
+      if (img_n == out_n) {
+         for (; i+16 <= nk; i += 16) {
+            __m128i r = _mm_loadu_si128((__m128i *) (raw+i));
+            __m128i b = _mm_loadu_si128((__m128i *) (prior+i));
+            _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(r, b));
+         }
+         for (; i < nk; ++i)
+            cur[i] = STBI__BYTECAST(raw[i] + prior[i]);
+         return;
+      }
+      alpha = _mm_shuffle_epi32(alpha, 0);
+      for (; i*3+16 <= nk; i += 4) {
+         __m128i r = stbi__png_spread3(_mm_loadu_si128((__m128i *) (raw + i*3)));
+         __m128i b = _mm_loadu_si128((__m128i *) (prior + i*4));
+         _mm_storeu_si128((__m128i *) (cur + i*4), _mm_or_si128(_mm_add_epi8(r, b), alpha));
+      }
+      alpha = _mm_cvtsi32_si128((int) 0xff000000);
+   } else if (filter == STBI__F_sub) {
+      // each pixel is the sum of the raw pixels up to it, so add in the
+      // vector shifted by 1, 2 (and 4) pixels, starting from the last one
+      if (img_n == 4) {
+         for (; i*4+16 <= nk; i += 4) {
+            __m128i x = _mm_add_epi8(_mm_loadu_si128((__m128i *) (raw + i*4)), a);
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            _mm_storeu_si128((__m128i *) (cur + i*4), x);
+            a = _mm_srli_si128(x, 12);
+         }
+      } else if (out_n == 3) {
+         // five pixels, and a byte the next store (or the tail) overwrites
+         __m128i rgb = _mm_cvtsi32_si128(0xffffff);
+         for (; i*3+16 <= nk; i += 5) {
+            __m128i x = _mm_add_epi8(_mm_loadu_si128((__m128i *) (raw + i*3)), a);
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 12));
+            _mm_storeu_si128((__m128i *) (cur + i*3), x);
+            a = _mm_and_si128(_mm_srli_si128(x, 12), rgb);
+         }
+      } else {
+         __m128i rgb = _mm_cvtsi32_si128(0xffffff), alpha4 = _mm_shuffle_epi32(alpha, 0);
+         a = _mm_and_si128(a, rgb);
+         for (; i*3+16 <= nk; i += 4) {
+            __m128i x = _mm_add_epi8(_mm_loadu_si128((__m128i *) (raw + i*3)), a);
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+            _mm_storeu_si128((__m128i *) (cur + i*4), _mm_or_si128(stbi__png_spread3(x), alpha4));
+            a = _mm_and_si128(_mm_srli_si128(x, 9), rgb);
+         }
+      }
+   } else if (filter == STBI__F_avg || filter == STBI__F_avg_first) {
+      // avg_epu8 rounds up where the filter wants floor((a+b)/2), but on the
+      // complements it's exact: ~x = avg(~a,~b) - raw. So this works on
+      // complemented pixels, each costing a shift, an average and a subtract
+      // after the one to its left, and masks them together for the store.
+      // The first row averages with 0, or with 255 for the alpha being added.
+      __m128i ones = _mm_set1_epi8(-1), nb = _mm_xor_si128(ones, _mm_shuffle_epi32(alpha, 0));
+      __m128i na = _mm_xor_si128(a, ones), t, o;
+      if (out_n == 4) {
+         __m128i px = _mm_setr_epi32(-1, 0, 0, 0);
+         for (; i*img_n+16 <= nk; i += 4) {
+            __m128i r = _mm_loadu_si128((__m128i *) (raw + i*img_n));
+            if (img_n == 3) r = stbi__png_spread3(r);
+            if (filter == STBI__F_avg) nb = _mm_xor_si128(_mm_loadu_si128((__m128i *) (prior + i*4)), ones);
+            t = _mm_sub_epi8(_mm_avg_epu8(na, nb), r);
+            o = _mm_and_si128(t, px);
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 4), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 4)));
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 4), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 8)));
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 4), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 12)));
+            _mm_storeu_si128((__m128i *) (cur + i*4), _mm_xor_si128(o, ones));
+            na = _mm_srli_si128(t, 12);
+         }
+      } else {
+         // five pixels, and a byte the next store (or the tail) overwrites
+         __m128i px = _mm_cvtsi32_si128(0xffffff);
+         for (; i*3+16 <= nk; i += 5) {
+            __m128i r = _mm_loadu_si128((__m128i *) (raw + i*3));
+            if (filter == STBI__F_avg) nb = _mm_xor_si128(_mm_loadu_si128((__m128i *) (prior + i*3)), ones);
+            t = _mm_sub_epi8(_mm_avg_epu8(na, nb), r);
+            o = _mm_and_si128(t, px);
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 3), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 3)));
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 3), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 6)));
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 3), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 9)));
+            t = _mm_sub_epi8(_mm_avg_epu8(_mm_slli_si128(t, 3), nb), r);
+            o = _mm_or_si128(o, _mm_and_si128(t, _mm_slli_si128(px, 12)));
+            _mm_storeu_si128((__m128i *) (cur + i*3), _mm_xor_si128(o, ones));
+            na = _mm_srli_si128(t, 12);
+         }
+      }
+      // the rest a pixel at a time, in the same form
+      raw += i*img_n;
+      cur += i*out_n;
+      prior += i*out_n;
+      for (; i < pixels; ++i, raw += img_n, cur += out_n, prior += out_n) {
+         if (filter == STBI__F_avg)
+            nb = _mm_xor_si128(_mm_cvtsi32_si128((int) stbi__png_load_px(prior, out_n)), ones);
+         na = _mm_sub_epi8(_mm_avg_epu8(na, nb), _mm_cvtsi32_si128((int) stbi__png_load_px(raw, img_n)));
+         stbi__png_store_px(cur, ~(stbi__uint32) _mm_cvtsi128_si32(na), out_n);
+      }
+      return;
+   } else if (filter == STBI__F_paeth) {
+      // there's no prior row on the first row, so only paeth may look at it
+      c = _mm_cvtsi32_si128((int) stbi__png_load_px(prior - out_n, out_n));
+   }
+
+   // the rest of the row a pixel at a time
+   if (i) {
+      raw += i*img_n;
+      cur += i*out_n;
+      prior += i*out_n;
+      a = _mm_cvtsi32_si128((int) stbi__png_load_px(cur - out_n, out_n));
+   }
+   for (; i < pixels; ++i, raw += img_n, cur += out_n, prior += out_n) {
+      __m128i r = _mm_cvtsi32_si128((int) stbi__png_load_px(raw, img_n));
+      __m128i b, x;
+      switch (filter) {
+         case STBI__F_sub:
+            x = _mm_add_epi8(r, a);
+            break;
+         case STBI__F_up:
+            x = _mm_add_epi8(r, _mm_cvtsi32_si128((int) stbi__png_load_px(prior, out_n)));
+            break;
+         default: { // STBI__F_paeth, in 16-bit lanes
+            __m128i a16, b16, c16, pa, pb, pc, use_a, use_b, pred;
+            b = _mm_cvtsi32_si128((int) stbi__png_load_px(prior, out_n));
+            a16 = _mm_unpacklo_epi8(a, zero);
+            b16 = _mm_unpacklo_epi8(b, zero);
+            c16 = _mm_unpacklo_epi8(c, zero);
+            // p = a+b-c, so p-a = b-c, p-b = a-c, p-c = (b-c)+(a-c)
+            pa = _mm_sub_epi16(b16, c16);
+            pb = _mm_sub_epi16(a16, c16);
+            pc = _mm_add_epi16(pa, pb);
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            use_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)); // inverted
+            use_b = _mm_cmpgt_epi16(pb, pc); // inverted
+            pred = _mm_or_si128(_mm_andnot_si128(use_b, b16), _mm_and_si128(use_b, c16));
+            pred = _mm_or_si128(_mm_andnot_si128(use_a, a16), _mm_and_si128(use_a, pred));
+            x = _mm_add_epi8(r, _mm_packus_epi16(pred, pred));
+            c = b;
+            break;
+         }
+      }
+      x = _mm_or_si128(x, alpha);
+      stbi__png_store_px(cur, (stbi__uint32) _mm_cvtsi128_si32(x), out_n);
+      a = x;
+   }
+}
+#else // STBI_NEON
+// spreads the 4 RGB pixels in the low 12 bytes out to 4 bytes each, alpha 0
+stbi_inline static uint8x16_t stbi__png_spread3(uint8x16_t v)
+{
+   static const stbi_uc lo[8] = { 0,1,2,255,3,4,5,255 }, hi[8] = { 6,7,8,255,9,10,11,255 };
+   uint8x8x2_t t;
+   t.val[0] = vget_low_u8(v);
+   t.val[1] = vget_high_u8(v);
+   return vcombine_u8(vtbl2_u8(t, vld1_u8(lo)), vtbl2_u8(t, vld1_u8(hi)));
+}
+
+static void stbi__png_unfilter_row_simd(int filter, stbi_uc *cur, stbi_uc *prior, stbi_uc *raw, int pixels, int img_n, int out_n)
+{
+   stbi__uint32 ex = img_n != out_n ? 0xff000000 : 0;
+   uint32x4_t none = vdupq_n_u32(0);
+   uint8x16_t zero = vdupq_n_u8(0), alpha4 = vreinterpretq_u8_u32(vdupq_n_u32(ex));
+   uint8x16_t rgb = vreinterpretq_u8_u32(vsetq_lane_u32(0xffffff, none, 0));
+   uint8x16_t a = vreinterpretq_u8_u32(vsetq_lane_u32(stbi__png_load_px(cur - out_n, out_n), none, 0));
+   uint8x8_t alpha = vget_low_u8(alpha4), a1, c = vdup_n_u8(0);
+   int nk = pixels * img_n, i = 0;
+
+   // paeth of a, 0 and 0 is a
+   if (filter == STBI__F_paeth_first)
+      filter = STBI__F_sub;
+
+   if (filter == STBI__F_up) {
+      if (img_n == out_n) {
+         for (; i+16 <= nk; i += 16)
+            vst1q_u8(cur+i, vaddq_u8(vld1q_u8(raw+i), vld1q_u8(prior+i)));
+         for (; i < nk; ++i)
+            cur[i] = STBI__BYTECAST(raw[i] + prior[i]);
+         return;
+      }
+      for (; i*3+16 <= nk; i += 4) {
+         uint8x16_t r = stbi__png_spread3(vld1q_u8(raw + i*3));
+         vst1q_u8(cur + i*4, vorrq_u8(vaddq_u8(r, vld1q_u8(prior + i*4)), alpha4));
+      }
+   } else if (filter == STBI__F_sub) {
+      // each pixel is the sum of the raw pixels up to it, so add in the
+      // vector shifted by 1, 2 (and 4) pixels, starting from the last one
+      if (img_n == 4) {
+         for (; i*4+16 <= nk; i += 4) {
+            uint8x16_t x = vaddq_u8(vld1q_u8(raw + i*4), a);
+            x = vaddq_u8(x, vextq_u8(zero, x, 12));
+            x = vaddq_u8(x, vextq_u8(zero, x, 8));
+            vst1q_u8(cur + i*4, x);
+            a = vextq_u8(x, zero, 12);
+         }
+      } else if (out_n == 3) {
+         // five pixels, and a byte the next store (or the tail) overwrites
+         for (; i*3+16 <= nk; i += 5) {
+            uint8x16_t x = vaddq_u8(vld1q_u8(raw + i*3), a);
+            x = vaddq_u8(x, vextq_u8(zero, x, 13));
+            x = vaddq_u8(x, vextq_u8(zero, x, 10));
+            x = vaddq_u8(x, vextq_u8(zero, x, 4));
+            vst1q_u8(cur + i*3, x);
+            a = vandq_u8(vextq_u8(x, zero, 12), rgb);
+         }
+      } else {
+         for (; i*3+16 <= nk; i += 4) {
+            uint8x16_t x = vaddq_u8(vld1q_u8(raw + i*3), vandq_u8(a, rgb));
+            x = vaddq_u8(x, vextq_u8(zero, x, 13));
+            x = vaddq_u8(x, vextq_u8(zero, x, 10));
+            vst1q_u8(cur + i*4, vorrq_u8(stbi__png_spread3(x), alpha4));
+            a = vextq_u8(x, zero, 9);
+         }
+      }
+   } else if (filter == STBI__F_avg || filter == STBI__F_avg_first) {
+      // vhadd is floor((a+b)/2), so each pixel costs a shift, an average and
+      // an add after the one to its left, and they're merged for the store.
+      // The first row averages with 0, or with 255 for the alpha being added.
+      uint8x16_t b = alpha4, t, o;
+      if (out_n == 4) {
+         uint8x16_t px = vreinterpretq_u8_u32(vsetq_lane_u32(0xffffffff, none, 0));
+         for (; i*img_n+16 <= nk; i += 4) {
+            uint8x16_t r = vld1q_u8(raw + i*img_n);
+            if (img_n == 3) r = stbi__png_spread3(r);
+            if (filter == STBI__F_avg) b = vld1q_u8(prior + i*4);
+            t = vaddq_u8(vhaddq_u8(a, b), r);
+            o = vandq_u8(t, px);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 12), b), r);
+            o = vbslq_u8(vextq_u8(zero, px, 12), t, o);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 12), b), r);
+            o = vbslq_u8(vextq_u8(zero, px, 8), t, o);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 12), b), r);
+            o = vbslq_u8(vextq_u8(zero, px, 4), t, o);
+            vst1q_u8(cur + i*4, o);
+            a = vextq_u8(t, zero, 12);
+         }
+      } else {
+         // five pixels, and a byte the next store (or the tail) overwrites
+         for (; i*3+16 <= nk; i += 5) {
+            uint8x16_t r = vld1q_u8(raw + i*3);
+            if (filter == STBI__F_avg) b = vld1q_u8(prior + i*3);
+            t = vaddq_u8(vhaddq_u8(a, b), r);
+            o = vandq_u8(t, rgb);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 13), b), r);
+            o = vbslq_u8(vextq_u8(zero, rgb, 13), t, o);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 13), b), r);
+            o = vbslq_u8(vextq_u8(zero, rgb, 10), t, o);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 13), b), r);
+            o = vbslq_u8(vextq_u8(zero, rgb, 7), t, o);
+            t = vaddq_u8(vhaddq_u8(vextq_u8(zero, t, 13), b), r);
+            o = vbslq_u8(vextq_u8(zero, rgb, 4), t, o);
+            vst1q_u8(cur + i*3, o);
+            a = vextq_u8(t, zero, 12);
+         }
+      }
+      // the rest a pixel at a time
+      raw += i*img_n;
+      cur += i*out_n;
+      prior += i*out_n;
+      a1 = vget_low_u8(a);
+      for (; i < pixels; ++i, raw += img_n, cur += out_n, prior += out_n) {
+         uint8x8_t r = vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(raw, img_n)));
+         uint8x8_t b1 = filter == STBI__F_avg ? vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(prior, out_n))) : alpha;
+         a1 = vadd_u8(r, vhadd_u8(a1, b1));
+         stbi__png_store_px(cur, vget_lane_u32(vreinterpret_u32_u8(a1), 0), out_n);
+      }
+      return;
+   } else if (filter == STBI__F_paeth) {
+      // there's no prior row on the first row, so only paeth may look at it
+      c = vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(prior - out_n, out_n)));
+   }
+
+   // the rest of the row a pixel at a time
+   if (i) {
+      raw += i*img_n;
+      cur += i*out_n;
+      prior += i*out_n;
+   }
+   a1 = vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(cur - out_n, out_n)));
+   for (; i < pixels; ++i, raw += img_n, cur += out_n, prior += out_n) {
+      uint8x8_t r = vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(raw, img_n)));
+      uint8x8_t b, x;
+      if (filter == STBI__F_sub)
+         x = vadd_u8(r, a1);
+      else if (filter == STBI__F_up)
+         x = vadd_u8(r, vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(prior, out_n))));
+      else { // STBI__F_paeth
+         uint16x8_t pa, pb, pc;
+         uint8x8_t use_a, use_b;
+         b = vreinterpret_u8_u32(vdup_n_u32(stbi__png_load_px(prior, out_n)));
+         // p = a+b-c, so |p-a| = |b-c|, |p-b| = |a-c|, |p-c| = |a+b-2c|
+         pa = vmovl_u8(vabd_u8(b, c));
+         pb = vmovl_u8(vabd_u8(a1, c));
+         pc = vabdq_u16(vaddl_u8(a1, b), vshll_n_u8(c, 1));
+         use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+         use_b = vmovn_u16(vcleq_u16(pb, pc));
+         x = vadd_u8(r, vbsl_u8(use_a, a1, vbsl_u8(use_b, b, c)));
+         c = b;
+      }
+      x = vorr_u8(x, alpha);
+      stbi__png_store_px(cur, vget_lane_u32(vreinterpret_u32_u8(x), 0), out_n);
+      a1 = x;
+   }
+}
+#endif
+#endif
+
+static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
+
+// create the png data from post-deflated data
+static void stbi__png_palette_row(stbi_uc *p, stbi_uc *orig, stbi__uint32 count, stbi_uc *palette, int pal_img_n)
 {
-   STBI__F_none,
-   STBI__F_sub,
-   STBI__F_none,
-   STBI__F_avg_first,
-   STBI__F_paeth_first
-};
+   stbi__uint32 i;
+   if (pal_img_n == 3) {
+      for (i=0; i < count; ++i) {
+         int n = orig[i]*4;
+         p[0] = palette[n  ];
+         p[1] = palette[n+1];
+         p[2] = palette[n+2];
+         p += 3;
+      }
+   } else {
+      for (i=0; i < count; ++i) {
+         int n = orig[i]*4;
+         p[0] = palette[n  ];
+         p[1] = palette[n+1];
+         p[2] = palette[n+2];
+         p[3] = palette[n+3];
+         p += 4;
+      }
+   }
+}
 
-static int stbi__paeth(int a, int b, int c)
+// unpack a row of 1/2/4-bit samples at 'in' into bytes at 'cur', adding
+// alpha if out_n says so; 'in' may sit at the end of the 'cur' row
+static void stbi__png_expand_bits(stbi_uc *cur, stbi_uc *in, stbi__uint32 x, int img_n, int out_n, int depth, int color)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   int k;
+   // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
+   // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
+   stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
+   stbi_uc *start = cur;
+
+   // note that the final byte might overshoot and write more data than desired.
+   // we can allocate enough data that this never writes out of memory, but it
+   // could also overwrite the next scanline. can it overwrite non-empty data
+   // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
+   // so we need to explicitly clamp the final ones
+
+   if (depth == 4) {
+      for (k=x*img_n; k >= 2; k-=2, ++in) {
+         *cur++ = scale * ((*in >> 4)       );
+         *cur++ = scale * ((*in     ) & 0x0f);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 4)       );
+   } else if (depth == 2) {
+      for (k=x*img_n; k >= 4; k-=4, ++in) {
+         *cur++ = scale * ((*in >> 6)       );
+         *cur++ = scale * ((*in >> 4) & 0x03);
+         *cur++ = scale * ((*in >> 2) & 0x03);
+         *cur++ = scale * ((*in     ) & 0x03);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 6)       );
+      if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
+      if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
+   } else if (depth == 1) {
+      for (k=x*img_n; k >= 8; k-=8, ++in) {
+         *cur++ = scale * ((*in >> 7)       );
+         *cur++ = scale * ((*in >> 6) & 0x01);
+         *cur++ = scale * ((*in >> 5) & 0x01);
+         *cur++ = scale * ((*in >> 4) & 0x01);
+         *cur++ = scale * ((*in >> 3) & 0x01);
+         *cur++ = scale * ((*in >> 2) & 0x01);
+         *cur++ = scale * ((*in >> 1) & 0x01);
+         *cur++ = scale * ((*in     ) & 0x01);
+      }
+      if (k > 0) *cur++ = scale * ((*in >> 7)       );
+      if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
+      if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
+      if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
+      if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
+      if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
+      if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
+   }
+   if (img_n != out_n) {
+      int q;
+      // insert alpha = 255
+      cur = start;
+      if (img_n == 1) {
+         for (q=x-1; q >= 0; --q) {
+            cur[q*2+1] = 255;
+            cur[q*2+0] = cur[q];
+         }
+      } else {
+         STBI_ASSERT(img_n == 3);
+         for (q=x-1; q >= 0; --q) {
+            cur[q*4+3] = 255;
+            cur[q*4+2] = cur[q*3+2];
+            cur[q*4+1] = cur[q*3+1];
+            cur[q*4+0] = cur[q*3+0];
+         }
+      }
+   }
 }
 
-static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
+// direct output: finish unfiltered row j (still as the file stores it)
+// into the caller's buffer. 'row' is one of the two rows kept in a->out,
+// which are followed by scratch for unpacking and converting
+static int stbi__png_store_row(stbi__png *a, stbi_uc *row, stbi__uint32 j, int out_n, int depth, int color)
+{
+   stbi__context *s = a->s;
+   stbi__uint32 i, x = s->img_x;
+   int bytes = (depth == 16 ? 2 : 1);
+   stbi_uc *unpacked = a->out + 2 * x * out_n * bytes;
+   stbi_uc *src = row;
+   int n = out_n;
 
-// create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+   if (depth < 8) {
+      stbi__png_expand_bits(unpacked, row + x*out_n - (((s->img_n * x * depth) + 7) >> 3), x, s->img_n, out_n, depth, color);
+      src = unpacked;
+   } else if (depth == 16) {
+      // channel conversion happens at 16 bits, as stbi__load_and_postprocess_8bit would
+      stbi__uint16 *in16 = (stbi__uint16 *) unpacked, *out16 = in16 + x*out_n;
+      stbi_uc *out = stbi__dest_row(s, j);
+      for (i=0; i < x*out_n; ++i)
+         in16[i] = (stbi__uint16) ((row[i*2] << 8) | row[i*2+1]);
+      stbi__convert_row16(out16, in16, out_n, s->dest->n, x);
+      for (i=0; i < x * s->dest->n; ++i)
+         out[i] = (stbi_uc) (out16[i] >> 8);
+      return stbi__dest_done(s, j);
+   }
+   if (a->pal_n) {
+      stbi_uc *expanded = unpacked + x*out_n;
+      stbi__png_palette_row(expanded, src, x, a->palette, a->pal_n);
+      src = expanded;
+      n = a->pal_n;
+   }
+   stbi__convert_row(stbi__dest_row(s, j), src, n, s->dest->n, x);
+   return stbi__dest_done(s, j);
+}
+
+// unfilters rows y0..y-1; only direct output can start past row 0, carrying
+// on from the rows left in a->out
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y0, stbi__uint32 y, int depth, int color)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
@@ -4406,25 +6808,40 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
+#if defined(STBI_SSE2)
+   int simd = depth == 8 && (img_n == 3 || img_n == 4) && stbi__sse2_available();
+#elif defined(STBI_NEON)
+   int simd = depth == 8 && (img_n == 3 || img_n == 4);
+#endif
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   STBI_ASSERT(y0 == 0 || a->direct);
+   if (a->direct) { // two rows for unfiltering, plus room for stbi__png_store_row
+      if (y0 == 0)
+         a->out = (stbi_uc *) stbi__malloc_mad2(x, 2*output_bytes + 2*(out_n + 4), 0);
+   } else
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
    img_width_bytes = (((img_n * x * depth) + 7) >> 3);
-   img_len = (img_width_bytes + 1) * y;
+   img_len = (img_width_bytes + 1) * (y - y0);
 
    // we used to check for exact match between raw_len and img_len on non-interlaced PNGs,
    // but issue #276 reported a PNG in the wild that had extra data at the end (all zeros),
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
-   for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
+   for (j=y0; j < y; ++j) {
+      stbi_uc *row = a->direct ? a->out + stride*(j&1) : a->out + stride*j;
+      stbi_uc *cur = row;
       stbi_uc *prior;
       int filter = *raw++;
 
+      // the previous row is done, and still intact in the other half of out
+      if (a->direct && j)
+         if (!stbi__png_store_row(a, a->out + stride*((j-1)&1), j-1, out_n, depth, color)) return 0;
+
       if (filter > 4)
          return stbi__err("invalid filter","Corrupt PNG");
 
@@ -4434,7 +6851,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          filter_bytes = 1;
          width = img_width_bytes;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+      prior = a->direct && !(j&1) ? cur + stride : cur - stride; // bugfix: need to compute this after 'cur +=' computation above
 
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
@@ -4472,6 +6889,14 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          prior += 1;
       }
 
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+      if (simd && filter != STBI__F_none) {
+         stbi__png_unfilter_row_simd(filter, cur, prior, raw, x-1, img_n, out_n);
+         raw += (x-1)*img_n;
+         continue;
+      }
+#endif
+
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (depth < 8 || img_n == out_n) {
          int nk = (width - 1)*filter_bytes;
@@ -4510,7 +6935,7 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          // the loop above sets the high byte of the pixels' alpha, but for
          // 16 bit png files we also need the low byte set. we'll do that here.
          if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
+            cur = row; // start at the beginning of the row again
             for (i=0; i < x; ++i,cur+=output_bytes) {
                cur[filter_bytes+1] = 255;
             }
@@ -4518,77 +6943,21 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       }
    }
 
+   if (a->direct) {
+      if (y < s->img_y) return 1; // more rows to come
+      if (!stbi__png_store_row(a, a->out + stride*((y-1)&1), y-1, out_n, depth, color)) return 0;
+      STBI_FREE(a->out);
+      a->out = NULL;
+      return 1;
+   }
+
    // we make a separate pass to expand bits to pixels; for performance,
    // this could run two scanlines behind the above code, so it won't
    // intefere with filtering but will still be in the cache.
    if (depth < 8) {
       for (j=0; j < y; ++j) {
          stbi_uc *cur = a->out + stride*j;
-         stbi_uc *in  = a->out + stride*j + x*out_n - img_width_bytes;
-         // unpack 1/2/4-bit into a 8-bit buffer. allows us to keep the common 8-bit path optimal at minimal cost for 1/2/4-bit
-         // png guarante byte alignment, if width is not multiple of 8/4/2 we'll decode dummy trailing data that will be skipped in the later loop
-         stbi_uc scale = (color == 0) ? stbi__depth_scale_table[depth] : 1; // scale grayscale values to 0..255 range
-
-         // note that the final byte might overshoot and write more data than desired.
-         // we can allocate enough data that this never writes out of memory, but it
-         // could also overwrite the next scanline. can it overwrite non-empty data
-         // on the next scanline? yes, consider 1-pixel-wide scanlines with 1-bit-per-pixel.
-         // so we need to explicitly clamp the final ones
-
-         if (depth == 4) {
-            for (k=x*img_n; k >= 2; k-=2, ++in) {
-               *cur++ = scale * ((*in >> 4)       );
-               *cur++ = scale * ((*in     ) & 0x0f);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 4)       );
-         } else if (depth == 2) {
-            for (k=x*img_n; k >= 4; k-=4, ++in) {
-               *cur++ = scale * ((*in >> 6)       );
-               *cur++ = scale * ((*in >> 4) & 0x03);
-               *cur++ = scale * ((*in >> 2) & 0x03);
-               *cur++ = scale * ((*in     ) & 0x03);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 6)       );
-            if (k > 1) *cur++ = scale * ((*in >> 4) & 0x03);
-            if (k > 2) *cur++ = scale * ((*in >> 2) & 0x03);
-         } else if (depth == 1) {
-            for (k=x*img_n; k >= 8; k-=8, ++in) {
-               *cur++ = scale * ((*in >> 7)       );
-               *cur++ = scale * ((*in >> 6) & 0x01);
-               *cur++ = scale * ((*in >> 5) & 0x01);
-               *cur++ = scale * ((*in >> 4) & 0x01);
-               *cur++ = scale * ((*in >> 3) & 0x01);
-               *cur++ = scale * ((*in >> 2) & 0x01);
-               *cur++ = scale * ((*in >> 1) & 0x01);
-               *cur++ = scale * ((*in     ) & 0x01);
-            }
-            if (k > 0) *cur++ = scale * ((*in >> 7)       );
-            if (k > 1) *cur++ = scale * ((*in >> 6) & 0x01);
-            if (k > 2) *cur++ = scale * ((*in >> 5) & 0x01);
-            if (k > 3) *cur++ = scale * ((*in >> 4) & 0x01);
-            if (k > 4) *cur++ = scale * ((*in >> 3) & 0x01);
-            if (k > 5) *cur++ = scale * ((*in >> 2) & 0x01);
-            if (k > 6) *cur++ = scale * ((*in >> 1) & 0x01);
-         }
-         if (img_n != out_n) {
-            int q;
-            // insert alpha = 255
-            cur = a->out + stride*j;
-            if (img_n == 1) {
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*2+1] = 255;
-                  cur[q*2+0] = cur[q];
-               }
-            } else {
-               STBI_ASSERT(img_n == 3);
-               for (q=x-1; q >= 0; --q) {
-                  cur[q*4+3] = 255;
-                  cur[q*4+2] = cur[q*3+2];
-                  cur[q*4+1] = cur[q*3+1];
-                  cur[q*4+0] = cur[q*3+0];
-               }
-            }
-         }
+         stbi__png_expand_bits(cur, cur + x*out_n - img_width_bytes, x, img_n, out_n, depth, color);
       }
    } else if (depth == 16) {
       // force the image data from big-endian to platform-native.
@@ -4606,45 +6975,110 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    return 1;
 }
 
+// one Adam7 pass: unfiltered into its own buffer, then scattered into 'final'
+typedef struct
+{
+   stbi__png a; // copy of the decoder state, for its own a.out
+   stbi_uc *final, *data;
+   stbi__uint32 data_len;
+   int pass, x, y, out_n, depth, color, ok;
+   const char *failure;
+} stbi__png_pass;
+
+static void stbi__png_decode_pass(void *job)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__png_pass *p = (stbi__png_pass *) job;
+   int out_bytes = p->out_n * (p->depth == 16 ? 2 : 1);
+   int i,j;
+   p->ok = stbi__create_png_image_raw(&p->a, p->data, p->data_len, p->out_n, p->x, 0, p->y, p->depth, p->color);
+   if (!p->ok) {
+      p->failure = stbi__g_failure_reason; // per-thread, so pass it back
+      return;
+   }
+   for (j=0; j < p->y; ++j) {
+      for (i=0; i < p->x; ++i) {
+         int out_y = j*yspc[p->pass]+yorig[p->pass];
+         int out_x = i*xspc[p->pass]+xorig[p->pass];
+         memcpy(p->final + out_y*p->a.s->img_x*out_bytes + out_x*out_bytes,
+                p->a.out + (j*p->x+i)*out_bytes, out_bytes);
+      }
+   }
+   STBI_FREE(p->a.out);
+}
+
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
 {
    int bytes = (depth == 16 ? 2 : 1);
    int out_bytes = out_n * bytes;
    stbi_uc *final;
-   int p;
+   stbi__png_pass passes[7];
+   int p, n = 0;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, 0, a->s->img_y, depth, color);
 
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
+   if (!final) return stbi__err("outofmem", "Out of memory");
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
       int xspc[]  = { 8,8,4,4,2,2,1 };
       int yspc[]  = { 8,8,8,4,4,2,2 };
-      int i,j,x,y;
+      int x,y;
       // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
       x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
-            STBI_FREE(final);
-            return 0;
-         }
-         for (j=0; j < y; ++j) {
-            for (i=0; i < x; ++i) {
-               int out_y = j*yspc[p]+yorig[p];
-               int out_x = i*xspc[p]+xorig[p];
-               memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
-                      a->out + (j*x+i)*out_bytes, out_bytes);
-            }
-         }
-         STBI_FREE(a->out);
+         stbi__png_pass *q = &passes[n++];
+         q->a = *a;
+         q->a.out = NULL;
+         q->final = final;
+         q->data = image_data;
+         q->data_len = image_data_len;
+         q->pass = p;
+         q->x = x;
+         q->y = y;
+         q->out_n = out_n;
+         q->depth = depth;
+         q->color = color;
+         q->ok = 0;
+         q->failure = NULL;
+         // a short pass fails in stbi__create_png_image_raw, and the rest aren't run
+         if (image_data_len < img_len) break;
          image_data += img_len;
          image_data_len -= img_len;
       }
    }
+
+#ifdef STBI_THREADS
+   if (stbi__decode_threads > 1 && a->s->img_x * a->s->img_y >= 256*256) {
+      stbi__run_jobs(stbi__png_decode_pass, passes, sizeof(passes[0]), n);
+   } else
+#endif
+   {
+      for (p=0; p < n; ++p) {
+         stbi__png_decode_pass(&passes[p]);
+         if (!passes[p].ok) break;
+      }
+   }
+
+   for (p=0; p < n; ++p) {
+      if (!passes[p].ok) {
+         int k;
+         // failed passes may still own a partial buffer
+         for (k=p; k < n; ++k)
+            if (!passes[k].ok && passes[k].a.out)
+               STBI_FREE(passes[k].a.out);
+         STBI_FREE(final);
+         stbi__g_failure_reason = passes[p].failure;
+         return 0;
+      }
+   }
    a->out = final;
 
    return 1;
@@ -4702,8 +7136,8 @@ static int stbi__compute_transparency16(stbi__png *z, stbi__uint16 tc[3], int ou
 
 static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int pal_img_n)
 {
-   stbi__uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   stbi_uc *p, *temp_out, *orig = a->out;
+   stbi__uint32 pixel_count = a->s->img_x * a->s->img_y;
+   stbi_uc *p, *temp_out;
 
    p = (stbi_uc *) stbi__malloc_mad2(pixel_count, pal_img_n, 0);
    if (p == NULL) return stbi__err("outofmem", "Out of memory");
@@ -4711,24 +7145,7 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    // between here and free(out) below, exitting would leak
    temp_out = p;
 
-   if (pal_img_n == 3) {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p += 3;
-      }
-   } else {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p[3] = palette[n+3];
-         p += 4;
-      }
-   }
+   stbi__png_palette_row(p, a->out, pixel_count, palette, pal_img_n);
    STBI_FREE(a->out);
    a->out = temp_out;
 
@@ -4737,19 +7154,46 @@ static int stbi__expand_png_palette(stbi__png *a, stbi_uc *palette, int len, int
    return 1;
 }
 
-static int stbi__unpremultiply_on_load = 0;
-static int stbi__de_iphone_flag = 0;
+static int stbi__unpremultiply_on_load_global = 0;
+static int stbi__de_iphone_flag_global = 0;
 
 STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
-   stbi__unpremultiply_on_load = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_global = flag_true_if_should_unpremultiply;
 }
 
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 {
-   stbi__de_iphone_flag = flag_true_if_should_convert;
+   stbi__de_iphone_flag_global = flag_true_if_should_convert;
+}
+
+#ifndef STBI_THREAD_LOCAL
+#define stbi__unpremultiply_on_load  stbi__unpremultiply_on_load_global
+#define stbi__de_iphone_flag  stbi__de_iphone_flag_global
+#else
+static STBI_THREAD_LOCAL int stbi__unpremultiply_on_load_local, stbi__unpremultiply_on_load_set;
+static STBI_THREAD_LOCAL int stbi__de_iphone_flag_local, stbi__de_iphone_flag_set;
+
+STBIDEF void stbi_set_unpremultiply_on_load_thread(int flag_true_if_should_unpremultiply)
+{
+   stbi__unpremultiply_on_load_local = flag_true_if_should_unpremultiply;
+   stbi__unpremultiply_on_load_set = 1;
 }
 
+STBIDEF void stbi_convert_iphone_png_to_rgb_thread(int flag_true_if_should_convert)
+{
+   stbi__de_iphone_flag_local = flag_true_if_should_convert;
+   stbi__de_iphone_flag_set = 1;
+}
+
+#define stbi__unpremultiply_on_load  (stbi__unpremultiply_on_load_set           \
+                                       ? stbi__unpremultiply_on_load_local      \
+                                       : stbi__unpremultiply_on_load_global)
+#define stbi__de_iphone_flag  (stbi__de_iphone_flag_set                         \
+                                ? stbi__de_iphone_flag_local                    \
+                                : stbi__de_iphone_flag_global)
+#endif // STBI_THREAD_LOCAL
+
 static void stbi__de_iphone(stbi__png *z)
 {
    stbi__context *s = z->s;
@@ -4795,6 +7239,67 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+// exact size of the zlib-decoded image data: a filter byte plus the packed
+// pixels for each row, of each of the seven passes if interlaced
+static stbi__uint32 stbi__png_raw_size(stbi__uint32 img_x, stbi__uint32 img_y, int bits_per_pixel, int interlaced)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__uint32 total = 0;
+   int p;
+   if (!interlaced)
+      return (((img_x * bits_per_pixel + 7) >> 3) + 1) * img_y;
+   for (p=0; p < 7; ++p) {
+      stbi__uint32 x = (img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      stbi__uint32 y = (img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      if (x && y)
+         total += (((x * bits_per_pixel + 7) >> 3) + 1) * y;
+   }
+   return total;
+}
+
+// direct output: rows are unfiltered as soon as they're inflated
+static int stbi__png_drain(void *user, stbi_uc *data, int len)
+{
+   stbi__png *z = (stbi__png *) user;
+   stbi__context *s = z->s;
+   stbi__uint32 bpl = (((s->img_n * s->img_x * z->depth) + 7) >> 3) + 1;
+   stbi__uint32 rows = (stbi__uint32) len / bpl;
+   if (z->rows_done == s->img_y) return len; // ignore anything past the image
+   if (rows > s->img_y - z->rows_done) rows = s->img_y - z->rows_done;
+   if (!rows) return 0;
+   if (!stbi__create_png_image_raw(z, data, rows * bpl, s->img_out_n, s->img_x, z->rows_done, z->rows_done + rows, z->depth, z->color)) return -1;
+   z->rows_done += rows;
+   return (int) (rows * bpl);
+}
+
+// inflates the ilen bytes of z->idata through a buffer that holds little
+// more than the 32K window, rather than the whole image
+static int stbi__png_inflate_rows(stbi__png *z, stbi__uint32 ilen)
+{
+   stbi__context *s = z->s;
+   stbi__zbuf a;
+   int bpl = (int) (((s->img_n * s->img_x * z->depth) + 7) >> 3) + 1;
+   int ok, size = 65536 + 2*bpl + STBI__ZFAST_OUT;
+   char *p = (char *) stbi__malloc(size);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+   a.zbuffer = z->idata;
+   a.zbuffer_end = z->idata + ilen;
+   a.zout_start = a.zout = a.zdrained = p;
+   a.zout_end = p + size;
+   a.z_expandable = 1;
+   a.drain = stbi__png_drain;
+   a.drain_user = z;
+   z->rows_done = 0;
+   ok = stbi__parse_zlib(&a, 1) && stbi__zdrain(&a);
+   STBI_FREE(a.zout_start);
+   if (!ok) return 0;
+   if (z->rows_done < s->img_y) return stbi__err("not enough pixels","Corrupt PNG");
+   return 1;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
@@ -4807,6 +7312,8 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->direct = 0;
+   z->pal_n = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -4837,7 +7344,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return stbi__err("too large", "Image too large to decode");
-               if (scan == STBI__SCAN_header) return 1;
+               // if SCAN_header, still have to scan for a tRNS, which adds alpha
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
@@ -4875,6 +7382,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             } else {
                if (!(s->img_n & 1)) return stbi__err("tRNS with alpha","Corrupt PNG");
                if (c.length != (stbi__uint32) s->img_n*2) return stbi__err("bad tRNS len","Corrupt PNG");
+               if (scan == STBI__SCAN_header) { ++s->img_n; return 1; }
                has_trans = 1;
                if (z->depth == 16) {
                   for (k = 0; k < s->img_n; ++k) tc16[k] = (stbi__uint16)stbi__get16be(s); // copy the values as-is
@@ -4888,7 +7396,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          case STBI__PNG_TYPE('I','D','A','T'): {
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return stbi__err("no PLTE","Corrupt PNG");
-            if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (scan == STBI__SCAN_header) { if (pal_img_n) s->img_n = pal_img_n; return 1; }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
                stbi__uint32 idata_limit_old = idata_limit;
@@ -4906,20 +7414,35 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
+            stbi__uint32 raw_len;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
+            // rows can go straight to the caller's buffer unless there's a
+            // whole-image pass to do afterwards, and then they're unfiltered
+            // as they're inflated
+            if (s->dest && !interlace && !has_trans && !is_iphone) {
+               if (!stbi__dest_fits(s, req_comp ? req_comp : pal_img_n ? pal_img_n : s->img_n)) return 0;
+               z->direct = 1;
+               z->palette = palette;
+               z->pal_n = pal_img_n;
+               z->color = color;
+               if (!stbi__png_inflate_rows(z, ioff)) return 0;
+               STBI_FREE(z->idata); z->idata = NULL;
+               if (pal_img_n) s->img_n = pal_img_n;
+               s->img_out_n = s->dest->n;
+               return 1;
+            }
+            // the header tells us exactly how much data to expect; leave
+            // room past it so the fast inflate loop can run to the end
+            raw_len = stbi__png_raw_size(s->img_x, s->img_y, s->img_n * z->depth, interlace);
+            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len + STBI__ZFAST_OUT, (int *) &raw_len, !is_iphone);
+            if (z->expanded == NULL) return 0; // zlib should set error
+            STBI_FREE(z->idata); z->idata = NULL;
             if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
             if (has_trans) {
                if (z->depth == 16) {
@@ -4950,8 +7473,12 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
+               #ifndef STBI_THREAD_LOCAL
                // not threadsafe
                static char invalid_chunk[] = "XXXX PNG chunk not known";
+               #else
+               static STBI_THREAD_LOCAL char invalid_chunk[] = "XXXX PNG chunk not known";
+               #endif
                invalid_chunk[0] = STBI__BYTECAST(c.type >> 24);
                invalid_chunk[1] = STBI__BYTECAST(c.type >> 16);
                invalid_chunk[2] = STBI__BYTECAST(c.type >>  8);
@@ -4972,11 +7499,11 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
    void *result=NULL;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
    if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
-      if (p->depth < 8)
+      if (p->depth < 8 || p->direct)
          ri->bits_per_channel = 8;
       else
          ri->bits_per_channel = p->depth;
-      result = p->out;
+      result = p->direct ? p->s->dest->pixels : p->out;
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
          if (ri->bits_per_channel == 8)
@@ -6215,6 +8742,7 @@ typedef struct
    int cur_x, cur_y;
    int line_size;
    int delay;
+   int frame_x, frame_y, frame_w, frame_h; // last image descriptor
 } stbi__gif;
 
 static int stbi__gif_test_raw(stbi__context *s)
@@ -6415,7 +8943,7 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
 {
    int dispose;
    int first_frame;
-   int pi;
+   int pi, px, py;
    int pcount;
    STBI_NOTUSED(req_comp);
 
@@ -6448,17 +8976,17 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
          dispose = 2; // if I don't have an image to revert back to, default to the old background
       }
 
-      if (dispose == 3) { // use previous graphic
-         for (pi = 0; pi < pcount; ++pi) {
-            if (g->history[pi]) {
-               memcpy( &g->out[pi * 4], &two_back[pi * 4], 4 );
-            }
-         }
-      } else if (dispose == 2) {
-         // restore what was changed last frame to background before that frame;
-         for (pi = 0; pi < pcount; ++pi) {
-            if (g->history[pi]) {
-               memcpy( &g->out[pi * 4], &g->background[pi * 4], 4 );
+      if (dispose == 3 || dispose == 2) {
+         // 3: use previous graphic
+         // 2: restore what was changed last frame to background before that frame;
+         // only the last frame's rectangle has any history
+         stbi_uc *from = dispose == 3 ? two_back : g->background;
+         for (py = g->frame_y; py < g->frame_y + g->frame_h; ++py) {
+            for (px = g->frame_x; px < g->frame_x + g->frame_w; ++px) {
+               pi = py * g->w + px;
+               if (g->history[pi]) {
+                  memcpy( &g->out[pi * 4], &from[pi * 4], 4 );
+               }
             }
          }
       } else {
@@ -6468,13 +8996,11 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
          // 0:  not specified.
       }
 
-      // background is what out is after the undoing of the previou frame;
-      memcpy( g->background, g->out, 4 * g->w * g->h );
+      // clear my history;
+      for (py = g->frame_y; py < g->frame_y + g->frame_h; ++py)
+         memset( &g->history[py * g->w + g->frame_x], 0x00, g->frame_w );
    }
 
-   // clear my history;
-   memset( g->history, 0x00, g->w * g->h );        // pixels that were affected previous frame
-
    for (;;) {
       int tag = stbi__get8(s);
       switch (tag) {
@@ -6490,6 +9016,15 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
             if (((x + w) > (g->w)) || ((y + h) > (g->h)))
                return stbi__errpuc("bad Image Descriptor", "Corrupt GIF");
 
+            // background is what out is after the undoing of the previous frame;
+            // it's only read back inside this frame's rectangle
+            g->frame_x = x;
+            g->frame_y = y;
+            g->frame_w = w;
+            g->frame_h = h;
+            for (py = y; py < y + h; ++py)
+               memcpy( &g->background[(py * g->w + x) * 4], &g->out[(py * g->w + x) * 4], 4 * w );
+
             g->line_size = g->w * 4;
             g->start_x = x * 4;
             g->start_y = y * g->line_size;
@@ -6622,7 +9157,7 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
             }
             memcpy( out + ((layers - 1) * stride), u, stride );
             if (layers >= 2) {
-               two_back = out - 2 * stride;
+               two_back = out + (layers - 2) * stride;
             }
 
             if (delays) {
@@ -6680,6 +9215,135 @@ static int stbi__gif_info(stbi__context *s, int *x, int *y, int *comp)
 {
    return stbi__gif_info_raw(s,x,y,comp);
 }
+
+struct stbi_gif_frames
+{
+   stbi__context s;
+   stbi__gif g;
+   int state;  // 0 before the first frame, 1 after one, -1 at the end, -2 on error
+   #ifndef STBI_NO_STDIO
+   FILE *f;
+   #endif
+};
+
+static stbi_gif_frames *stbi__gif_frames_start(stbi_gif_frames *f, int *x, int *y)
+{
+   if (!stbi__gif_info_raw(&f->s, x, y, NULL)) {
+      STBI_FREE(f);
+      return NULL;
+   }
+   stbi__rewind(&f->s);  // the header is still in the first buffer
+   return f;
+}
+
+static stbi_gif_frames *stbi__gif_frames_alloc(void)
+{
+   stbi_gif_frames *f = (stbi_gif_frames *) stbi__malloc(sizeof(*f));
+   if (!f) return (stbi_gif_frames *) stbi__errpuc("outofmem", "Out of memory");
+   memset(f, 0, sizeof(*f));
+   return f;
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_memory(stbi_uc const *buffer, int len, int *x, int *y)
+{
+   stbi_gif_frames *f = stbi__gif_frames_alloc();
+   if (!f) return NULL;
+   stbi__start_mem(&f->s, buffer, len);
+   return stbi__gif_frames_start(f, x, y);
+}
+
+STBIDEF stbi_gif_frames *stbi_gif_frames_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y)
+{
+   stbi_gif_frames *f = stbi__gif_frames_alloc();
+   if (!f) return NULL;
+   stbi__start_callbacks(&f->s, (stbi_io_callbacks *) clbk, user);
+   return stbi__gif_frames_start(f, x, y);
+}
+
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_gif_frames *stbi_gif_frames_open(char const *filename, int *x, int *y)
+{
+   FILE *file = stbi__fopen(filename, "rb");
+   stbi_gif_frames *f;
+   if (!file) return (stbi_gif_frames *) stbi__errpuc("can't fopen", "Unable to open file");
+   f = stbi__gif_frames_alloc();
+   if (!f) {
+      fclose(file);
+      return NULL;
+   }
+   f->f = file;
+   stbi__start_file(&f->s, file);
+   if (!stbi__gif_frames_start(f, x, y)) {  // frees f
+      fclose(file);
+      return NULL;
+   }
+   return f;
+}
+#endif
+
+STBIDEF int stbi_gif_next_frame(stbi_gif_frames *f, stbi_uc const **canvas, int *delay, int *rect_x, int *rect_y, int *rect_w, int *rect_h)
+{
+   stbi__gif *g = &f->g;
+   int lx0 = g->frame_x, ly0 = g->frame_y, lx1 = lx0 + g->frame_w, ly1 = ly0 + g->frame_h;
+   int disposed = f->state > 0 && ((g->eflags & 0x1C) >> 2) >= 2;
+   int x0, y0, x1, y1;
+   stbi_uc *u;
+   if (f->state < 0) return f->state == -1 ? 0 : -1;
+
+   // with no earlier frames kept, "restore to previous" falls back to
+   // restoring the background, the canvas before the last frame was drawn
+   u = stbi__gif_load_next(&f->s, g, NULL, 4, NULL);
+   if (u == (stbi_uc *) &f->s) {
+      f->state = -1;
+      return 0;
+   }
+   if (!u) {
+      // like stbi_load_gif, once a frame has been returned anything that
+      // doesn't decode (often just a missing trailer) ends the animation
+      f->state = f->state > 0 ? -1 : -2;
+      return f->state == -1 ? 0 : -1;
+   }
+
+   // what changed is this frame's rectangle, plus the last one if it was disposed of
+   x0 = g->frame_x; x1 = x0 + g->frame_w;
+   y0 = g->frame_y; y1 = y0 + g->frame_h;
+   if (f->state == 0) {
+      x0 = y0 = 0;
+      x1 = g->w;
+      y1 = g->h;
+   } else if (disposed && lx1 > lx0 && ly1 > ly0) {
+      if (x1 <= x0 || y1 <= y0) {
+         x0 = lx0; x1 = lx1;
+         y0 = ly0; y1 = ly1;
+      } else {
+         if (lx0 < x0) x0 = lx0;
+         if (ly0 < y0) y0 = ly0;
+         if (lx1 > x1) x1 = lx1;
+         if (ly1 > y1) y1 = ly1;
+      }
+   }
+   f->state = 1;
+
+   *canvas = g->out;
+   if (delay)  *delay  = g->delay;
+   if (rect_x) *rect_x = x0;
+   if (rect_y) *rect_y = y0;
+   if (rect_w) *rect_w = x1 - x0;
+   if (rect_h) *rect_h = y1 - y0;
+   return 1;
+}
+
+STBIDEF void stbi_gif_frames_free(stbi_gif_frames *f)
+{
+   if (!f) return;
+   STBI_FREE(f->g.out);
+   STBI_FREE(f->g.history);
+   STBI_FREE(f->g.background);
+   #ifndef STBI_NO_STDIO
+   if (f->f) fclose(f->f);
+   #endif
+   STBI_FREE(f);
+}
 #endif
 
 // *************************************************************************************************
@@ -7300,6 +9964,202 @@ STBIDEF int stbi_is_16_bit_from_file(FILE *f)
    fseek(f,pos,SEEK_SET);
    return r;
 }
+
+// stbi_info_batch reads through callbacks that fetch only what the parser
+// asks for (128 bytes at a time) at an offset, so skips cost nothing
+typedef struct
+{
+#ifdef STBI__PREAD
+   int fd;
+#else
+   FILE *f;
+#endif
+   long off;
+   int eof;
+} stbi__header_file;
+
+static int stbi__header_read(void *user, char *data, int size)
+{
+   stbi__header_file *h = (stbi__header_file *) user;
+   int n;
+#ifdef STBI__PREAD
+   ssize_t r = pread(h->fd, data, (size_t) size, (off_t) h->off);
+   n = r < 0 ? 0 : (int) r;
+#else
+   n = fseek(h->f, h->off, SEEK_SET) ? 0 : (int) fread(data, 1, size, h->f);
+#endif
+   h->off += n;
+   h->eof = n < size;
+   return n;
+}
+
+static void stbi__header_skip(void *user, int n)
+{
+   ((stbi__header_file *) user)->off += n;
+}
+
+static int stbi__header_eof(void *user)
+{
+   return ((stbi__header_file *) user)->eof;
+}
+
+// returns -1 if the first bytes don't match any format but TGA
+static int stbi__info_magic(stbi__context *s, int *x, int *y, int *comp, int *bits)
+{
+   stbi_uc *p = s->img_buffer;
+   *bits = 8;
+   if (s->img_buffer_end - p < 2) return -1;
+   switch (p[0]) {
+      #ifndef STBI_NO_JPEG
+      case 0xff:
+         if (p[1] != 0xd8) break;
+         return stbi__jpeg_info(s, x, y, comp);
+      #endif
+      #ifndef STBI_NO_PNG
+      case 0x89: {
+         stbi__png png;
+         if (p[1] != 'P') break;
+         png.s = s;
+         if (!stbi__png_info_raw(&png, x, y, comp)) return 0;
+         if (png.depth == 16) *bits = 16;
+         return 1;
+      }
+      #endif
+      #ifndef STBI_NO_GIF
+      case 'G':
+         if (p[1] != 'I') break;
+         return stbi__gif_info(s, x, y, comp);
+      #endif
+      #ifndef STBI_NO_BMP
+      case 'B':
+         if (p[1] != 'M') break;
+         return stbi__bmp_info(s, x, y, comp);
+      #endif
+      #ifndef STBI_NO_PSD
+      case '8':
+         if (p[1] != 'B') break;
+         if (!stbi__psd_info(s, x, y, comp)) return 0;
+         stbi__rewind(s);  // the header is still in the first buffer
+         if (stbi__psd_is16(s)) *bits = 16;
+         return 1;
+      #endif
+      #ifndef STBI_NO_PIC
+      case 0x53:
+         if (p[1] != 0x80) break;
+         return stbi__pic_info(s, x, y, comp);
+      #endif
+      #ifndef STBI_NO_PNM
+      case 'P':
+         if (p[1] != '5' && p[1] != '6') break;
+         return stbi__pnm_info(s, x, y, comp);
+      #endif
+      #ifndef STBI_NO_HDR
+      case '#':
+         if (p[1] != '?') break;
+         *bits = 32;
+         return stbi__hdr_info(s, x, y, comp);
+      #endif
+      default:
+         break;
+   }
+   return -1;
+}
+
+static void stbi__info_one(char const *filename, stbi_info_result *res)
+{
+   stbi_io_callbacks io;
+   stbi__header_file h;
+   stbi__context s;
+   int r;
+   res->x = res->y = res->comp = res->bits_per_channel = 0;
+   res->failure = NULL;
+#ifdef STBI__PREAD
+   h.fd = open(filename, O_RDONLY | O_CLOEXEC);
+   if (h.fd < 0) {
+#else
+   h.f = stbi__fopen(filename, "rb");
+   if (h.f) setvbuf(h.f, NULL, _IONBF, 0);
+   else {
+#endif
+      stbi__err("can't fopen", "Unable to open file");
+      res->failure = stbi__g_failure_reason;
+      return;
+   }
+   io.read = stbi__header_read;
+   io.skip = stbi__header_skip;
+   io.eof  = stbi__header_eof;
+   stbi__g_failure_reason = NULL;
+   h.off = 0;
+   h.eof = 0;
+   stbi__start_callbacks(&s, &io, &h);
+   r = stbi__info_magic(&s, &res->x, &res->y, &res->comp, &res->bits_per_channel);
+   // a TGA can't start with any of those magics, since its second byte
+   // (the color map type) is 0 or 1
+   #ifndef STBI_NO_TGA
+   if (r < 0 && stbi__tga_info(&s, &res->x, &res->y, &res->comp)) r = 1;
+   #endif
+   if (r <= 0) {
+      // some info functions fail quietly
+      if (r < 0 || !stbi__g_failure_reason)
+         stbi__err("unknown image type", "Image not of any known type, or corrupt");
+      res->x = res->y = res->comp = res->bits_per_channel = 0;
+      res->failure = stbi__g_failure_reason;
+   }
+#ifdef STBI__PREAD
+   close(h.fd);
+#else
+   fclose(h.f);
+#endif
+}
+
+typedef struct
+{
+   char const * const *filenames;
+   stbi_info_result *results;
+   int count;
+} stbi__info_job;
+
+static void stbi__info_files(void *job)
+{
+   stbi__info_job *j = (stbi__info_job *) job;
+   int i;
+   for (i=0; i < j->count; ++i)
+      stbi__info_one(j->filenames[i], &j->results[i]);
+}
+
+STBIDEF int stbi_info_batch(char const * const *filenames, int count, stbi_info_result *results, int num_threads)
+{
+   int i, ok = 0;
+#ifdef STBI_THREADS
+   // small runs of files, dealt out to the threads in turn
+   enum { per_job = 16 };
+   int njobs = (count + per_job - 1) / per_job;
+   stbi__info_job *jobs = NULL;
+   if (num_threads > 1 && njobs > 1)
+      jobs = (stbi__info_job *) stbi__malloc_mad2(njobs, sizeof(*jobs), 0);
+   if (jobs) {
+      for (i=0; i < njobs; ++i) {
+         jobs[i].filenames = filenames + i*per_job;
+         jobs[i].results = results + i*per_job;
+         jobs[i].count = count - i*per_job < per_job ? count - i*per_job : per_job;
+      }
+      stbi__run_jobs_on(stbi__info_files, jobs, sizeof(*jobs), njobs, num_threads);
+      STBI_FREE(jobs);
+   } else
+#else
+   STBI_NOTUSED(num_threads);
+#endif
+   {
+      stbi__info_job all;
+      all.filenames = filenames;
+      all.results = results;
+      all.count = count;
+      stbi__info_files(&all);
+   }
+   for (i=0; i < count; ++i)
+      ok += results[i].bits_per_channel != 0;
+   return ok;
+}
 #endif // !STBI_NO_STDIO
 
 STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
@@ -21,6 +21,11 @@
 // implement them to the same API, but with a different init
 // function.
 //
+// For atlases whose contents change over time (e.g. a glyph cache that
+// evicts cold glyphs) there is also a dynamic shelf packer, see
+// stbrp_dyn_init() below, which supports freeing rectangles and reuses
+// their space without repacking everything else.
+//
 // Credits
 //
 //  Library
@@ -71,9 +76,10 @@
 extern "C" {
 #endif
 
-typedef struct stbrp_context stbrp_context;
-typedef struct stbrp_node    stbrp_node;
-typedef struct stbrp_rect    stbrp_rect;
+typedef struct stbrp_context    stbrp_context;
+typedef struct stbrp_node       stbrp_node;
+typedef struct stbrp_rect       stbrp_rect;
+typedef struct stbrp_index_node stbrp_index_node;
 
 #ifdef STBRP_LARGE_RECTS
 typedef int            stbrp_coord;
@@ -153,6 +159,19 @@ STBRP_DEF void stbrp_setup_heuristic (stbrp_context *context, int heuristic);
 // heuristics will produce better/worse results for different data sets.
 // If you call init again, this will be reset to the default.
 
+STBRP_DEF int stbrp_index_nodes_needed (int width);
+STBRP_DEF int stbrp_setup_index (stbrp_context *context, stbrp_index_node *index, int num_index_nodes);
+// Optionally call this function after init but before doing any packing to
+// give the packer extra storage for an index of the skyline heights (you need
+// stbrp_index_nodes_needed(width) of them). Without the index, every
+// candidate position re-walks the skyline nodes under the rectangle, which
+// gets slow for wide targets (e.g. 4096 or 8192) with many small rects; with
+// it, each candidate is answered in O(log width). Packing results are
+// identical either way. Returns 0 (and packs without the index) if there
+// are too few index nodes.
+//
+// The 'index' memory has the same lifetime requirements as 'nodes'.
+
 enum
 {
     STBRP_HEURISTIC_Skyline_default=0,
@@ -161,6 +180,44 @@ enum
 };
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Dynamic packing
+//
+// The skyline packer above can only grow; once a rectangle is placed its
+// space is never given back. The dynamic packer organizes the target into
+// horizontal shelves, each holding a row of spans, so individual rectangles
+// can be freed again. Freed spans are coalesced with free neighbours, and
+// shelves that become completely empty are merged with empty neighbouring
+// shelves (or given back to the unused area at the top) so that they can be
+// reused for rectangles of a different height.
+
+typedef struct stbrp_dyn_context stbrp_dyn_context;
+typedef struct stbrp_dyn_node    stbrp_dyn_node;
+
+STBRP_DEF void stbrp_dyn_init(stbrp_dyn_context *context, int width, int height, stbrp_dyn_node *nodes, int num_nodes);
+// Initialize a dynamic packer for a 'width' by 'height' target, using the
+// storage provided by 'nodes'. Every live rectangle needs one node, plus one
+// node per shelf and per free span. 2*max_live_rects + 2 nodes is plenty;
+// when nodes run out, stbrp_dyn_alloc() fails until something is freed.
+//
+// The 'nodes' memory must stay valid for as long as the context is used.
+
+STBRP_DEF int stbrp_dyn_alloc(stbrp_dyn_context *context, int width, int height, stbrp_coord *x, stbrp_coord *y);
+// Place a single rectangle. On success stores its position in 'x' and 'y'
+// and returns a non-negative handle to pass to stbrp_dyn_free(); returns -1
+// if there is no room (or the rectangle is empty).
+
+STBRP_DEF void stbrp_dyn_free(stbrp_dyn_context *context, int handle);
+// Release a rectangle previously returned by stbrp_dyn_alloc(). Its space
+// becomes available to subsequent allocations.
+
+STBRP_DEF int stbrp_dyn_pack_rects(stbrp_dyn_context *context, stbrp_rect *rects, int num_rects, int *handles);
+// Like stbrp_pack_rects(), but for a dynamic context: places the rectangles
+// (tallest first, which gives tighter shelves) and, if 'handles' is not
+// NULL, stores the handle of rects[i] in handles[i] (-1 if it wasn't packed
+// or is empty). Returns 1 if all rectangles were packed.
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // the details of the following structures don't matter to you, but they must
@@ -172,6 +229,12 @@ struct stbrp_node
     stbrp_node  *next;
 };
 
+struct stbrp_index_node
+{
+    int max_y, sum_y;      // over the columns this node covers
+    int assign;            // pending "all columns are this height", or -1
+};
+
 struct stbrp_context
 {
     int width;
@@ -183,6 +246,29 @@ struct stbrp_context
     stbrp_node *active_head;
     stbrp_node *free_head;
     stbrp_node extra[2]; // we allocate two extra nodes so optimal user-node-count is 'width' not 'width+2'
+    stbrp_index_node *index;
+    int index_width;     // number of leaf columns in 'index', a power of two >= width
+};
+
+struct stbrp_dyn_node
+{
+    stbrp_coord  x,y,w,h;  // span: x,w within its shelf; shelf: y,h and w = widest free span
+    int          next;     // span: next span to the right; shelf: next shelf upwards
+    int          prev;     // span: previous span to the left; shelf: previous shelf downwards
+    int          link;     // span: owning shelf; shelf: leftmost span
+    int          flags;
+};
+
+struct stbrp_dyn_context
+{
+    int width;
+    int height;
+    int top;               // everything at or above 'top' doesn't belong to a shelf yet
+    int first_shelf;       // lowest shelf, -1 if none
+    int last_shelf;        // highest shelf, -1 if none
+    int free_head;         // unused nodes
+    int num_nodes;
+    stbrp_dyn_node *nodes;
 };
 
 #ifdef __cplusplus
@@ -267,6 +353,8 @@ STBRP_DEF void stbrp_init_target(stbrp_context *context, int width, int height,
    context->width = width;
    context->height = height;
    context->num_nodes = num_nodes;
+   context->index = NULL;
+   context->index_width = 0;
    stbrp_setup_allow_out_of_mem(context, 0);
 
    // node 0 is the full width, node 1 is the sentinel (lets us not store width explicitly)
@@ -282,14 +370,99 @@ STBRP_DEF void stbrp_init_target(stbrp_context *context, int width, int height,
    context->extra[1].next = NULL;
 }
 
+// walking the skyline is cheaper than an index query when the rect only
+// covers a few nodes, so only switch to the index past this many
+#define STBRP__INDEX_MIN_WALK 16
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// skyline index: a segment tree over the per-column heights, storing the
+// max and the sum of each range. Updates assign a constant height to a
+// range, so they're applied lazily. Node 1 is the root, node n has
+// children 2n and 2n+1.
+//
+
+STBRP_DEF int stbrp_index_nodes_needed(int width)
+{
+   int leaves = 1;
+   while (leaves < width)
+      leaves <<= 1;
+   return 2*leaves;
+}
+
+STBRP_DEF int stbrp_setup_index(stbrp_context *context, stbrp_index_node *index, int num_index_nodes)
+{
+   int needed = stbrp_index_nodes_needed(context->width);
+   if (num_index_nodes < needed) {
+      context->index = NULL;
+      return 0;
+   }
+   context->index = index;
+   context->index_width = needed/2;
+   // the whole target starts at height 0; children get filled in lazily
+   index[1].max_y = 0;
+   index[1].sum_y = 0;
+   index[1].assign = 0;
+   return 1;
+}
+
+static void stbrp__index_set(stbrp_index_node *t, int n, int width, int y)
+{
+   t[n].max_y = y;
+   t[n].sum_y = y * width;
+   t[n].assign = y;
+}
+
+static void stbrp__index_assign(stbrp_index_node *t, int n, int l, int r, int x0, int x1, int y)
+{
+   int mid = (l+r) >> 1;
+   if (x1 <= l || r <= x0)
+      return;
+   if (x0 <= l && r <= x1) {
+      stbrp__index_set(t, n, r-l, y);
+      return;
+   }
+   if (t[n].assign >= 0) {
+      stbrp__index_set(t, 2*n  , mid-l, t[n].assign);
+      stbrp__index_set(t, 2*n+1, r-mid, t[n].assign);
+      t[n].assign = -1;
+   }
+   stbrp__index_assign(t, 2*n  , l, mid, x0, x1, y);
+   stbrp__index_assign(t, 2*n+1, mid, r, x0, x1, y);
+   t[n].max_y = t[2*n].max_y > t[2*n+1].max_y ? t[2*n].max_y : t[2*n+1].max_y;
+   t[n].sum_y = t[2*n].sum_y + t[2*n+1].sum_y;
+}
+
+static void stbrp__index_query(stbrp_index_node *t, int n, int l, int r, int x0, int x1, int *max_y, int *sum_y)
+{
+   int mid = (l+r) >> 1;
+   if (x1 <= l || r <= x0)
+      return;
+   if (x0 <= l && r <= x1) {
+      if (t[n].max_y > *max_y)
+         *max_y = t[n].max_y;
+      *sum_y += t[n].sum_y;
+      return;
+   }
+   if (t[n].assign >= 0) {
+      // constant over the whole range, no need to descend
+      int lo = l > x0 ? l : x0;
+      int hi = r < x1 ? r : x1;
+      if (t[n].assign > *max_y)
+         *max_y = t[n].assign;
+      *sum_y += t[n].assign * (hi-lo);
+      return;
+   }
+   stbrp__index_query(t, 2*n  , l, mid, x0, x1, max_y, sum_y);
+   stbrp__index_query(t, 2*n+1, mid, r, x0, x1, max_y, sum_y);
+}
+
 // find minimum y position if it starts at x1
 static int stbrp__skyline_find_min_y(stbrp_context *c, stbrp_node *first, int x0, int width, int *pwaste)
 {
    stbrp_node *node = first;
    int x1 = x0 + width;
-   int min_y, visited_width, waste_area;
-
-   STBRP__NOTUSED(c);
+   int min_y, visited_width, waste_area, steps;
 
    STBRP_ASSERT(first->x <= x0);
 
@@ -306,7 +479,17 @@ static int stbrp__skyline_find_min_y(stbrp_context *c, stbrp_node *first, int x0
    min_y = 0;
    waste_area = 0;
    visited_width = 0;
+   steps = 0;
    while (node->x < x1) {
+      if (c->index && ++steps > STBRP__INDEX_MIN_WALK) {
+         // lots of nodes under the rect; ask the index instead. the waste
+         // is the area between the skyline and min_y under the rect
+         int sum_y = 0;
+         min_y = 0;
+         stbrp__index_query(c->index, 1, 0, c->index_width, x0, x1, &min_y, &sum_y);
+         *pwaste = min_y * width - sum_y;
+         return min_y;
+      }
       if (node->y > min_y) {
          // raise min_y higher.
          // we've accounted for all waste up to min_y,
@@ -361,6 +544,13 @@ static stbrp__findresult stbrp__skyline_find_best_pos(stbrp_context *c, int widt
    prev = &c->active_head;
    while (node->x + width <= c->width) {
       int y,waste;
+      // the rect can't sit lower than the node it starts on, so skip
+      // positions that can't beat the current best
+      if (node->y > best_y || (node->y == best_y && c->heuristic == STBRP_HEURISTIC_Skyline_BL_sortHeight)) {
+         prev = &node->next;
+         node = node->next;
+         continue;
+      }
       y = stbrp__skyline_find_min_y(c, node, node->x, width, &waste);
       if (c->heuristic == STBRP_HEURISTIC_Skyline_BL_sortHeight) { // actually just want to test BL
          // bottom left
@@ -419,6 +609,10 @@ static stbrp__findresult stbrp__skyline_find_best_pos(stbrp_context *c, int widt
             node = node->next;
          }
          STBRP_ASSERT(node->next->x > xpos && node->x <= xpos);
+         if (node->y > best_y) {
+            tail = tail->next;
+            continue;
+         }
          y = stbrp__skyline_find_min_y(c, node, xpos, width, &waste);
          if (y + height <= c->height) {
             if (y <= best_y) {
@@ -493,6 +687,9 @@ static stbrp__findresult stbrp__skyline_pack_rectangle(stbrp_context *context, i
    if (cur->x < res.x + width)
       cur->x = (stbrp_coord) (res.x + width);
 
+   if (context->index)
+      stbrp__index_assign(context->index, 1, 0, context->index_width, res.x, res.x + width, res.y + height);
+
 #ifdef _DEBUG
    cur = context->active_head;
    while (cur->x < context->width) {
@@ -583,6 +780,293 @@ STBRP_DEF int stbrp_pack_rects(stbrp_context *context, stbrp_rect *rects, int nu
    // return the all_rects_packed status
    return all_rects_packed;
 }
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// dynamic shelf packer
+//
+
+enum
+{
+   STBRP__DYN_span_used = 1,
+   STBRP__DYN_span_free = 2,
+   STBRP__DYN_shelf     = 4
+};
+
+static int stbrp__dyn_new_node(stbrp_dyn_context *c)
+{
+   int n = c->free_head;
+   if (n >= 0) {
+      c->free_head = c->nodes[n].next;
+      c->nodes[n].next = c->nodes[n].prev = c->nodes[n].link = -1;
+   }
+   return n;
+}
+
+static void stbrp__dyn_release_node(stbrp_dyn_context *c, int n)
+{
+   c->nodes[n].flags = 0;
+   c->nodes[n].next = c->free_head;
+   c->free_head = n;
+}
+
+STBRP_DEF void stbrp_dyn_init(stbrp_dyn_context *c, int width, int height, stbrp_dyn_node *nodes, int num_nodes)
+{
+   int i;
+#ifndef STBRP_LARGE_RECTS
+   STBRP_ASSERT(width <= 0xffff && height <= 0xffff);
+#endif
+
+   for (i=0; i < num_nodes; ++i) {
+      nodes[i].flags = 0;
+      nodes[i].next = i+1 < num_nodes ? i+1 : -1;
+   }
+   c->width = width;
+   c->height = height;
+   c->top = 0;
+   c->first_shelf = c->last_shelf = -1;
+   c->free_head = num_nodes > 0 ? 0 : -1;
+   c->num_nodes = num_nodes;
+   c->nodes = nodes;
+}
+
+// recompute the widest free span of a shelf
+static void stbrp__dyn_update_shelf(stbrp_dyn_context *c, int shelf)
+{
+   int n, widest = 0;
+   for (n = c->nodes[shelf].link; n >= 0; n = c->nodes[n].next)
+      if (c->nodes[n].flags == STBRP__DYN_span_free && c->nodes[n].w > widest)
+         widest = c->nodes[n].w;
+   c->nodes[shelf].w = (stbrp_coord) widest;
+}
+
+static int stbrp__dyn_shelf_is_empty(stbrp_dyn_context *c, int shelf)
+{
+   return c->nodes[shelf].w == c->width;
+}
+
+// create a shelf from 'y' to 'y+h' with a single free span, linked after 'prev'
+static int stbrp__dyn_new_shelf(stbrp_dyn_context *c, int y, int h, int prev)
+{
+   int shelf, span, next;
+   if (c->free_head < 0 || c->nodes[c->free_head].next < 0)
+      return -1;
+   shelf = stbrp__dyn_new_node(c);
+   span  = stbrp__dyn_new_node(c);
+
+   c->nodes[span].x = 0;
+   c->nodes[span].w = (stbrp_coord) c->width;
+   c->nodes[span].link = shelf;
+   c->nodes[span].flags = STBRP__DYN_span_free;
+
+   c->nodes[shelf].x = 0;
+   c->nodes[shelf].y = (stbrp_coord) y;
+   c->nodes[shelf].h = (stbrp_coord) h;
+   c->nodes[shelf].w = (stbrp_coord) c->width;
+   c->nodes[shelf].link = span;
+   c->nodes[shelf].flags = STBRP__DYN_shelf;
+
+   next = prev >= 0 ? c->nodes[prev].next : c->first_shelf;
+   c->nodes[shelf].prev = prev;
+   c->nodes[shelf].next = next;
+   if (prev >= 0) c->nodes[prev].next = shelf; else c->first_shelf = shelf;
+   if (next >= 0) c->nodes[next].prev = shelf; else c->last_shelf = shelf;
+   return shelf;
+}
+
+static void stbrp__dyn_remove_shelf(stbrp_dyn_context *c, int shelf)
+{
+   int prev = c->nodes[shelf].prev, next = c->nodes[shelf].next;
+   if (prev >= 0) c->nodes[prev].next = next; else c->first_shelf = next;
+   if (next >= 0) c->nodes[next].prev = prev; else c->last_shelf = prev;
+   stbrp__dyn_release_node(c, c->nodes[shelf].link); // an empty shelf has exactly one span
+   stbrp__dyn_release_node(c, shelf);
+}
+
+// take 'width' pixels from the left of free span 'span'
+static int stbrp__dyn_take_span(stbrp_dyn_context *c, int span, int width)
+{
+   stbrp_dyn_node *s = &c->nodes[span];
+   if (s->w > width) {
+      int rest = stbrp__dyn_new_node(c);
+      if (rest < 0)
+         return -1;
+      c->nodes[rest].x = (stbrp_coord) (s->x + width);
+      c->nodes[rest].w = (stbrp_coord) (s->w - width);
+      c->nodes[rest].link = s->link;
+      c->nodes[rest].flags = STBRP__DYN_span_free;
+      c->nodes[rest].prev = span;
+      c->nodes[rest].next = s->next;
+      if (s->next >= 0)
+         c->nodes[s->next].prev = rest;
+      s->next = rest;
+      s->w = (stbrp_coord) width;
+   }
+   s->flags = STBRP__DYN_span_used;
+   stbrp__dyn_update_shelf(c, s->link);
+   return span;
+}
+
+// best-fitting free span of at least 'width' in a shelf
+static int stbrp__dyn_find_span(stbrp_dyn_context *c, int shelf, int width)
+{
+   int n, best = -1, best_w = c->width+1;
+   for (n = c->nodes[shelf].link; n >= 0; n = c->nodes[n].next) {
+      stbrp_dyn_node *s = &c->nodes[n];
+      if (s->flags == STBRP__DYN_span_free && s->w >= width && s->w < best_w) {
+         best = n;
+         best_w = s->w;
+         if (best_w == width)
+            break;
+      }
+   }
+   return best;
+}
+
+STBRP_DEF int stbrp_dyn_alloc(stbrp_dyn_context *c, int width, int height, stbrp_coord *x, stbrp_coord *y)
+{
+   int shelf, best = -1, best_h = c->height+1, best_empty = -1, span;
+
+   if (width <= 0 || height <= 0 || width > c->width || height > c->height)
+      return -1;
+
+   // look for a partially used shelf that fits snugly (wastes at most half
+   // the rectangle height), and remember the smallest empty shelf that fits
+   for (shelf = c->first_shelf; shelf >= 0; shelf = c->nodes[shelf].next) {
+      stbrp_dyn_node *s = &c->nodes[shelf];
+      if (s->h < height || s->w < width)
+         continue;
+      if (stbrp__dyn_shelf_is_empty(c, shelf)) {
+         if (best_empty < 0 || s->h < c->nodes[best_empty].h)
+            best_empty = shelf;
+      } else if (s->h < best_h) {
+         best = shelf;
+         best_h = s->h;
+      }
+   }
+
+   if (best < 0 || best_h > height + height/2) {
+      if (best_empty >= 0) {
+         // reuse an empty shelf, giving back what we don't need as a new empty shelf
+         stbrp_dyn_node *s = &c->nodes[best_empty];
+         if (s->h > height) {
+            int excess = s->h - height;
+            if (stbrp__dyn_new_shelf(c, s->y + height, excess, best_empty) >= 0)
+               c->nodes[best_empty].h = (stbrp_coord) height;
+         }
+         best = best_empty;
+      } else if (c->top + height <= c->height) {
+         // open a new shelf at the top
+         int fresh = stbrp__dyn_new_shelf(c, c->top, height, c->last_shelf);
+         if (fresh >= 0) {
+            c->top += height;
+            best = fresh;
+         }
+      }
+      // otherwise fall back to a loose fit in a taller shelf, if we found one
+   }
+
+   if (best < 0)
+      return -1;
+
+   span = stbrp__dyn_find_span(c, best, width);
+   STBRP_ASSERT(span >= 0);
+   span = stbrp__dyn_take_span(c, span, width);
+   if (span < 0)
+      return -1;
+
+   *x = c->nodes[span].x;
+   *y = c->nodes[best].y;
+   return span;
+}
+
+STBRP_DEF void stbrp_dyn_free(stbrp_dyn_context *c, int handle)
+{
+   int shelf, n;
+   stbrp_dyn_node *s;
+
+   STBRP_ASSERT(handle >= 0 && handle < c->num_nodes);
+   s = &c->nodes[handle];
+   STBRP_ASSERT(s->flags == STBRP__DYN_span_used);
+   shelf = s->link;
+   s->flags = STBRP__DYN_span_free;
+
+   // coalesce with the free span to the right
+   n = s->next;
+   if (n >= 0 && c->nodes[n].flags == STBRP__DYN_span_free) {
+      s->w = (stbrp_coord) (s->w + c->nodes[n].w);
+      s->next = c->nodes[n].next;
+      if (s->next >= 0)
+         c->nodes[s->next].prev = handle;
+      stbrp__dyn_release_node(c, n);
+   }
+
+   // coalesce with the free span to the left
+   n = s->prev;
+   if (n >= 0 && c->nodes[n].flags == STBRP__DYN_span_free) {
+      c->nodes[n].w = (stbrp_coord) (c->nodes[n].w + s->w);
+      c->nodes[n].next = s->next;
+      if (s->next >= 0)
+         c->nodes[s->next].prev = n;
+      stbrp__dyn_release_node(c, handle);
+   }
+
+   stbrp__dyn_update_shelf(c, shelf);
+   if (!stbrp__dyn_shelf_is_empty(c, shelf))
+      return;
+
+   // the shelf is empty; merge it with empty shelves above and below
+   n = c->nodes[shelf].next;
+   if (n >= 0 && stbrp__dyn_shelf_is_empty(c, n)) {
+      c->nodes[shelf].h = (stbrp_coord) (c->nodes[shelf].h + c->nodes[n].h);
+      stbrp__dyn_remove_shelf(c, n);
+   }
+   n = c->nodes[shelf].prev;
+   if (n >= 0 && stbrp__dyn_shelf_is_empty(c, n)) {
+      c->nodes[n].h = (stbrp_coord) (c->nodes[n].h + c->nodes[shelf].h);
+      stbrp__dyn_remove_shelf(c, shelf);
+      shelf = n;
+   }
+
+   // the highest shelf goes back to the unused area
+   if (shelf == c->last_shelf) {
+      c->top = c->nodes[shelf].y;
+      stbrp__dyn_remove_shelf(c, shelf);
+   }
+}
+
+STBRP_DEF int stbrp_dyn_pack_rects(stbrp_dyn_context *c, stbrp_rect *rects, int num_rects, int *handles)
+{
+   int i, all_rects_packed = 1;
+
+   for (i=0; i < num_rects; ++i)
+      rects[i].was_packed = i;
+
+   STBRP_SORT(rects, num_rects, sizeof(rects[0]), rect_height_compare);
+
+   for (i=0; i < num_rects; ++i) {
+      int handle = -1;
+      if (rects[i].w == 0 || rects[i].h == 0) {
+         rects[i].x = rects[i].y = 0;  // empty rect needs no space
+      } else {
+         handle = stbrp_dyn_alloc(c, rects[i].w, rects[i].h, &rects[i].x, &rects[i].y);
+         if (handle < 0)
+            rects[i].x = rects[i].y = STBRP__MAXVAL;
+      }
+      if (handles)
+         handles[rects[i].was_packed] = handle;
+   }
+
+   STBRP_SORT(rects, num_rects, sizeof(rects[0]), rect_original_order);
+
+   for (i=0; i < num_rects; ++i) {
+      rects[i].was_packed = !(rects[i].x == STBRP__MAXVAL && rects[i].y == STBRP__MAXVAL);
+      if (!rects[i].was_packed)
+         all_rects_packed = 0;
+   }
+
+   return all_rects_packed;
+}
 #endif
 
 /*
@@ -563,6 +563,7 @@ typedef struct
     unsigned short x0,y0,x1,y1; // coordinates of bbox in bitmap
     float xoff,yoff,xadvance;
     float xoff2,yoff2;
+    int page;                   // which page (texture array layer) the bitmap is on, see stbtt_PackBeginPages
 } stbtt_packedchar;
 
 typedef struct stbtt_pack_context stbtt_pack_context;
@@ -585,6 +586,19 @@ STBTT_DEF int  stbtt_PackBegin(stbtt_pack_context *spc, unsigned char *pixels, i
 STBTT_DEF void stbtt_PackEnd  (stbtt_pack_context *spc);
 // Cleans up the packing context and frees all memory.
 
+STBTT_DEF int  stbtt_PackBeginPages(stbtt_pack_context *spc, unsigned char *pages, int width, int height, int stride_in_bytes, int max_pages, int padding, void *alloc_context);
+// Like stbtt_PackBegin, but packs into up to 'max_pages' bitmaps (e.g. the
+// layers of a texture array) stored one after another in 'pages', each
+// height*stride_in_bytes bytes. When a page fills up, stbtt_PackFontRange(s)
+// continue on the next one instead of failing; the page used for each
+// character is stored in stbtt_packedchar::page. Only pages that actually
+// get used are cleared, see stbtt_PackGetNumPages.
+//
+// Returns 0 on failure, 1 on success.
+
+STBTT_DEF int  stbtt_PackGetNumPages(const stbtt_pack_context *spc);
+// Number of pages that have been packed into so far (at least 1).
+
 #define STBTT_POINT_SIZE(x)   (-(x))
 
 STBTT_DEF int  stbtt_PackFontRange(stbtt_pack_context *spc, const unsigned char *fontdata, int font_index, float font_size,
@@ -618,6 +632,17 @@ STBTT_DEF int  stbtt_PackFontRanges(stbtt_pack_context *spc, const unsigned char
 // calls to stbtt_PackFontRange. Note that you can call this multiple
 // times within a single PackBegin/PackEnd.
 
+STBTT_DEF int  stbtt_PackChoosePageSize(const unsigned char *fontdata, int font_index, stbtt_pack_range *ranges, int num_ranges,
+                                        int padding, unsigned int h_oversample, unsigned int v_oversample,
+                                        int max_size, int *page_width, int *page_height);
+// Picks the power-of-two page size (at most max_size on a side, with sides at
+// most a factor of 2 apart) for which packing these ranges needs the least
+// total texture memory over all pages. Stores the size in page_width and
+// page_height and returns the number of pages needed, or 0 if some character
+// doesn't fit into a max_size page. Pass the same padding and oversampling
+// you'll use for packing; allocate pages*width*height bytes and pass them to
+// stbtt_PackBeginPages.
+
 STBTT_DEF void stbtt_PackSetOversampling(stbtt_pack_context *spc, unsigned int h_oversample, unsigned int v_oversample);
 // Oversampling a font increases the quality by allowing higher-quality subpixel
 // positioning, and is especially valuable at smaller text sizes.
@@ -631,6 +656,10 @@ STBTT_DEF void stbtt_PackSetOversampling(stbtt_pack_context *spc, unsigned int h
 // oversampled textures with bilinear filtering. Look at the readme in
 // stb/tests/oversample for information about oversampled fonts
 //
+// The box prefilter that goes with oversampling makes one pass over each
+// glyph, 16 columns at a time with SSE2 for oversampling up to 8 (define
+// STBTT_NO_SIMD to use plain C).
+//
 // To use with PackFontRangesGather etc., you must set it before calls
 // call to PackFontRangesGatherRects.
 
@@ -672,6 +701,8 @@ struct stbtt_pack_context {
     unsigned int   h_oversample, v_oversample;
     unsigned char *pixels;
     void  *nodes;
+    unsigned char *first_page;
+    int   page, num_pages, max_pages;
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1083,6 +1114,12 @@ enum { // languageID for STBTT_PLATFORM_ID_MAC
 
 typedef int stbtt__test_oversample_pow2[(STBTT_MAX_OVERSAMPLE & (STBTT_MAX_OVERSAMPLE-1)) == 0 ? 1 : -1];
 
+// the oversampling prefilters use SSE2 when the compiler targets it
+#if !defined(STBTT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBTT__SSE2
+#include <emmintrin.h>
+#endif
+
 #ifndef STBTT_RASTERIZER_VERSION
 #define STBTT_RASTERIZER_VERSION 2
 #endif
@@ -3797,6 +3834,10 @@ STBTT_DEF int stbtt_PackBegin(stbtt_pack_context *spc, unsigned char *pixels, in
    spc->h_oversample = 1;
    spc->v_oversample = 1;
    spc->skip_missing = 0;
+   spc->first_page = pixels;
+   spc->page = 0;
+   spc->num_pages = 1;
+   spc->max_pages = 1;
 
    stbrp_init_target(context, pw-padding, ph-padding, nodes, num_nodes);
 
@@ -3812,6 +3853,148 @@ STBTT_DEF void stbtt_PackEnd  (stbtt_pack_context *spc)
    STBTT_free(spc->pack_info, spc->user_allocator_context);
 }
 
+STBTT_DEF int stbtt_PackBeginPages(stbtt_pack_context *spc, unsigned char *pages, int pw, int ph, int stride_in_bytes, int max_pages, int padding, void *alloc_context)
+{
+   if (max_pages < 1 || !stbtt_PackBegin(spc, pages, pw, ph, stride_in_bytes, padding, alloc_context))
+      return 0;
+   spc->max_pages = max_pages;
+   return 1;
+}
+
+STBTT_DEF int stbtt_PackGetNumPages(const stbtt_pack_context *spc)
+{
+   return spc->num_pages;
+}
+
+// move on to a fresh page; the skyline starts over
+static int stbtt__PackNextPage(stbtt_pack_context *spc)
+{
+   if (spc->num_pages >= spc->max_pages)
+      return 0;
+   spc->page = spc->num_pages++;
+   stbrp_init_target((stbrp_context *) spc->pack_info, spc->width-spc->padding, spc->height-spc->padding, (stbrp_node *) spc->nodes, spc->width-spc->padding);
+   if (spc->first_page) {
+      spc->pixels = spc->first_page + (size_t) spc->page * spc->height * spc->stride_in_bytes;
+      STBTT_memset(spc->pixels, 0, (size_t) spc->height * spc->stride_in_bytes);
+   }
+   return 1;
+}
+
+// Pack rects onto the current page, spilling onto new pages until they all
+// fit or we run out of pages. Records the page of each rect in page_of[],
+// -1 if it couldn't be packed. 'scratch' must hold num_rects rects.
+static int stbtt__PackRectsPaged(stbtt_pack_context *spc, stbrp_rect *rects, int num_rects, int *page_of, stbrp_rect *scratch)
+{
+   int i, remaining = 0, fresh_page = 0;
+
+   for (i=0; i < num_rects; ++i) {
+      page_of[i] = -1;
+      if (rects[i].w == 0 || rects[i].h == 0) {
+         rects[i].x = rects[i].y = 0;
+         rects[i].was_packed = 1;
+      } else {
+         rects[i].was_packed = 0;
+         ++remaining;
+      }
+   }
+
+   while (remaining) {
+      int n = 0, packed = 0;
+      for (i=0; i < num_rects; ++i) {
+         if (!rects[i].was_packed) {
+            scratch[n] = rects[i];
+            scratch[n].id = i;
+            ++n;
+         }
+      }
+      stbrp_pack_rects((stbrp_context *) spc->pack_info, scratch, n);
+      for (i=0; i < n; ++i) {
+         if (scratch[i].was_packed) {
+            stbrp_rect *r = &rects[scratch[i].id];
+            r->x = scratch[i].x;
+            r->y = scratch[i].y;
+            r->was_packed = 1;
+            page_of[scratch[i].id] = spc->page;
+            ++packed;
+         }
+      }
+      remaining -= packed;
+      if (remaining == 0)
+         break;
+      // if nothing fit on an empty page, nothing ever will; likewise don't
+      // start a page if all that's left is too big for any page
+      if (packed == 0 && fresh_page)
+         break;
+      for (i=0; i < num_rects; ++i)
+         if (!rects[i].was_packed && rects[i].w <= spc->width-spc->padding && rects[i].h <= spc->height-spc->padding)
+            break;
+      if (i == num_rects || !stbtt__PackNextPage(spc))
+         break;
+      fresh_page = 1;
+   }
+
+   return remaining == 0;
+}
+
+STBTT_DEF int stbtt_PackChoosePageSize(const unsigned char *fontdata, int font_index, stbtt_pack_range *ranges, int num_ranges,
+                                       int padding, unsigned int h_oversample, unsigned int v_oversample,
+                                       int max_size, int *page_width, int *page_height)
+{
+   stbtt_fontinfo info;
+   stbtt_pack_context spc;
+   stbrp_rect *rects, *scratch;
+   int *page_of;
+   int i, n = 0, w, best_pages = 0;
+   size_t best_bytes = 0;
+
+   for (i=0; i < num_ranges; ++i)
+      n += ranges[i].num_chars;
+
+   // glyph sizes only depend on the font, padding and oversampling
+   if (!stbtt_PackBegin(&spc, NULL, max_size, max_size, 0, padding, NULL))
+      return 0;
+   stbtt_PackSetOversampling(&spc, h_oversample, v_oversample);
+
+   rects   = (stbrp_rect *) STBTT_malloc(sizeof(*rects) * n * 2, NULL);
+   page_of = (int *) STBTT_malloc(sizeof(*page_of) * n, NULL);
+   if (rects == NULL || page_of == NULL) {
+      if (rects   != NULL) STBTT_free(rects  , NULL);
+      if (page_of != NULL) STBTT_free(page_of, NULL);
+      stbtt_PackEnd(&spc);
+      return 0;
+   }
+   scratch = rects + n;
+
+   info.userdata = NULL;
+   stbtt_InitFont(&info, fontdata, stbtt_GetFontOffsetForIndex(fontdata,font_index));
+   n = stbtt_PackFontRangesGatherRects(&spc, &info, ranges, num_ranges, rects);
+   stbtt_PackEnd(&spc);
+
+   for (w = 64; w <= max_size; w *= 2) {
+      int h;
+      for (h = w/2; h <= w*2 && h <= max_size; h *= 2) {
+         size_t bytes;
+         if (!stbtt_PackBeginPages(&spc, NULL, w, h, 0, n+1, padding, NULL))
+            continue;
+         if (stbtt__PackRectsPaged(&spc, rects, n, page_of, scratch)) {
+            bytes = (size_t) spc.num_pages * w * h;
+            // least memory, then fewest pages
+            if (best_pages == 0 || bytes < best_bytes || (bytes == best_bytes && spc.num_pages < best_pages)) {
+               best_bytes = bytes;
+               best_pages = spc.num_pages;
+               *page_width = w;
+               *page_height = h;
+            }
+         }
+         stbtt_PackEnd(&spc);
+      }
+   }
+
+   STBTT_free(page_of, NULL);
+   STBTT_free(rects, NULL);
+   return best_pages;
+}
+
 STBTT_DEF void stbtt_PackSetOversampling(stbtt_pack_context *spc, unsigned int h_oversample, unsigned int v_oversample)
 {
    STBTT_assert(h_oversample <= STBTT_MAX_OVERSAMPLE);
@@ -3953,6 +4136,102 @@ static void stbtt__v_prefilter(unsigned char *pixels, int w, int h, int stride_i
    }
 }
 
+#ifdef STBTT__SSE2
+// Both prefilters in one pass, 16 columns at a time: each strip is filtered
+// horizontally a row at a time and the rows that gives go into a running
+// vertical sum, so nothing walks down the bitmap with a stride. Strips go
+// right to left, which leaves the columns the horizontal filter reads to the
+// left of a strip unfiltered. The sums fit in 16 bits, and for k up to 8 the
+// high half of sum * ceil(65536/k) is exactly sum/k, so the results are the
+// same as stbtt__h_prefilter then stbtt__v_prefilter.
+#define STBTT__SSE2_ADD_SHIFTED(k) \
+   shifted = _mm_or_si128(_mm_slli_si128(cur, k), _mm_srli_si128(prev, 16-(k))); \
+   lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(shifted, zero)); \
+   hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(shifted, zero))
+
+static void stbtt__prefilter_sse2(unsigned char *pixels, int w, int h, int stride_in_bytes, int kernel_x, int kernel_y)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i recip_x = _mm_set1_epi16((short) ((65536 + kernel_x - 1) / kernel_x));
+   __m128i recip_y = _mm_set1_epi16((short) ((65536 + kernel_y - 1) / kernel_y));
+   __m128i ring[8];
+   int x,j,k;
+
+   for (x = (w-1) & ~15; x >= 0; x -= 16) {
+      int n = w - x < 16 ? w - x : 16;
+      int slot = 0;
+      __m128i sum_lo = zero, sum_hi = zero;
+      for (k=0; k < kernel_y; ++k)
+         ring[k] = zero;
+
+      for (j=0; j < h; ++j) {
+         unsigned char *p = pixels + j*stride_in_bytes + x;
+         __m128i cur, prev, shifted, lo, hi, out;
+         if (n == 16) {
+            cur = _mm_loadu_si128((__m128i *) p);
+         } else {
+            unsigned char partial[16];
+            STBTT_memset(partial, 0, 16);
+            STBTT_memcpy(partial, p, n);
+            cur = _mm_loadu_si128((__m128i *) partial);
+         }
+         prev = x ? _mm_loadu_si128((__m128i *) (p - 16)) : zero;
+
+         // horizontal: cur plus the kernel_x-1 bytes before each one
+         lo = _mm_unpacklo_epi8(cur, zero);
+         hi = _mm_unpackhi_epi8(cur, zero);
+         if (kernel_x > 7) { STBTT__SSE2_ADD_SHIFTED(7); }
+         if (kernel_x > 6) { STBTT__SSE2_ADD_SHIFTED(6); }
+         if (kernel_x > 5) { STBTT__SSE2_ADD_SHIFTED(5); }
+         if (kernel_x > 4) { STBTT__SSE2_ADD_SHIFTED(4); }
+         if (kernel_x > 3) { STBTT__SSE2_ADD_SHIFTED(3); }
+         if (kernel_x > 2) { STBTT__SSE2_ADD_SHIFTED(2); }
+         if (kernel_x > 1) {
+            STBTT__SSE2_ADD_SHIFTED(1);
+            lo = _mm_mulhi_epu16(lo, recip_x);
+            hi = _mm_mulhi_epu16(hi, recip_x);
+         }
+         out = _mm_packus_epi16(lo, hi);
+
+         // vertical: the last kernel_y filtered rows of the strip
+         if (kernel_y > 1) {
+            __m128i old = ring[slot];
+            ring[slot] = out;
+            if (++slot == kernel_y)
+               slot = 0;
+            sum_lo = _mm_add_epi16(sum_lo, _mm_sub_epi16(_mm_unpacklo_epi8(out, zero), _mm_unpacklo_epi8(old, zero)));
+            sum_hi = _mm_add_epi16(sum_hi, _mm_sub_epi16(_mm_unpackhi_epi8(out, zero), _mm_unpackhi_epi8(old, zero)));
+            out = _mm_packus_epi16(_mm_mulhi_epu16(sum_lo, recip_y), _mm_mulhi_epu16(sum_hi, recip_y));
+         }
+
+         if (n == 16) {
+            _mm_storeu_si128((__m128i *) p, out);
+         } else {
+            unsigned char partial[16];
+            _mm_storeu_si128((__m128i *) partial, out);
+            STBTT_memcpy(p, partial, n);
+         }
+      }
+   }
+}
+
+#undef STBTT__SSE2_ADD_SHIFTED
+#endif
+
+static void stbtt__prefilter(unsigned char *pixels, int w, int h, int stride_in_bytes, int kernel_x, int kernel_y)
+{
+#ifdef STBTT__SSE2
+   if ((kernel_x > 1 || kernel_y > 1) && kernel_x <= 8 && kernel_y <= 8) {
+      stbtt__prefilter_sse2(pixels, w, h, stride_in_bytes, kernel_x > 1 ? kernel_x : 1, kernel_y > 1 ? kernel_y : 1);
+      return;
+   }
+#endif
+   if (kernel_x > 1)
+      stbtt__h_prefilter(pixels, w, h, stride_in_bytes, kernel_x);
+   if (kernel_y > 1)
+      stbtt__v_prefilter(pixels, w, h, stride_in_bytes, kernel_y);
+}
+
 static float stbtt__oversample_shift(int oversample)
 {
    if (!oversample)
@@ -4014,11 +4293,7 @@ STBTT_DEF void stbtt_MakeGlyphBitmapSubpixelPrefilter(const stbtt_fontinfo *info
                                  shift_y,
                                  glyph);
 
-   if (prefilter_x > 1)
-      stbtt__h_prefilter(output, out_w, out_h, out_stride, prefilter_x);
-
-   if (prefilter_y > 1)
-      stbtt__v_prefilter(output, out_w, out_h, out_stride, prefilter_y);
+   stbtt__prefilter(output, out_w, out_h, out_stride, prefilter_x, prefilter_y);
 
    *sub_x = stbtt__oversample_shift(prefilter_x);
    *sub_y = stbtt__oversample_shift(prefilter_y);
@@ -4073,15 +4348,9 @@ STBTT_DEF int stbtt_PackFontRangesRenderIntoRects(stbtt_pack_context *spc, const
                                           0,0,
                                           glyph);
 
-            if (spc->h_oversample > 1)
-               stbtt__h_prefilter(spc->pixels + r->x + r->y*spc->stride_in_bytes,
-                                  r->w, r->h, spc->stride_in_bytes,
-                                  spc->h_oversample);
-
-            if (spc->v_oversample > 1)
-               stbtt__v_prefilter(spc->pixels + r->x + r->y*spc->stride_in_bytes,
-                                  r->w, r->h, spc->stride_in_bytes,
-                                  spc->v_oversample);
+            stbtt__prefilter(spc->pixels + r->x + r->y*spc->stride_in_bytes,
+                             r->w, r->h, spc->stride_in_bytes,
+                             spc->h_oversample, spc->v_oversample);
 
             bc->x0       = (stbtt_int16)  r->x;
             bc->y0       = (stbtt_int16)  r->y;
@@ -4092,6 +4361,7 @@ STBTT_DEF int stbtt_PackFontRangesRenderIntoRects(stbtt_pack_context *spc, const
             bc->yoff     =       (float)  y0 * recip_v + sub_y;
             bc->xoff2    =                (x0 + r->w) * recip_h + sub_x;
             bc->yoff2    =                (y0 + r->h) * recip_v + sub_y;
+            bc->page     =                spc->page;
 
             if (glyph == 0)
                missing_glyph = j;
@@ -4119,6 +4389,38 @@ STBTT_DEF void stbtt_PackFontRangesPackRects(stbtt_pack_context *spc, stbrp_rect
    stbrp_pack_rects((stbrp_context *) spc->pack_info, rects, num_rects);
 }
 
+// pack across pages, then render each page's characters with that page as the target
+static int stbtt__PackFontRangesPaged(stbtt_pack_context *spc, const stbtt_fontinfo *info, stbtt_pack_range *ranges, int num_ranges, stbrp_rect *rects, int num_rects)
+{
+   stbrp_rect *scratch = (stbrp_rect *) STBTT_malloc(sizeof(*scratch) * num_rects, spc->user_allocator_context);
+   int *page_of = (int *) STBTT_malloc(sizeof(*page_of) * num_rects, spc->user_allocator_context);
+   int i, p, first_page = spc->page, last_page, return_value;
+
+   if (scratch == NULL || page_of == NULL) {
+      if (scratch != NULL) STBTT_free(scratch, spc->user_allocator_context);
+      if (page_of != NULL) STBTT_free(page_of, spc->user_allocator_context);
+      return 0;
+   }
+
+   return_value = stbtt__PackRectsPaged(spc, rects, num_rects, page_of, scratch);
+   last_page = spc->page;
+
+   for (p = first_page; p <= last_page; ++p) {
+      // RenderIntoRects only touches rects flagged as packed; empty ones stay
+      // flagged so they pick up the missing glyph wherever it landed
+      for (i=0; i < num_rects; ++i)
+         rects[i].was_packed = page_of[i] == p || (page_of[i] < 0 && rects[i].w == 0 && rects[i].h == 0);
+      spc->page = p;
+      if (spc->first_page)
+         spc->pixels = spc->first_page + (size_t) p * spc->height * spc->stride_in_bytes;
+      stbtt_PackFontRangesRenderIntoRects(spc, info, ranges, num_ranges, rects);
+   }
+
+   STBTT_free(page_of, spc->user_allocator_context);
+   STBTT_free(scratch, spc->user_allocator_context);
+   return return_value;
+}
+
 STBTT_DEF int stbtt_PackFontRanges(stbtt_pack_context *spc, const unsigned char *fontdata, int font_index, stbtt_pack_range *ranges, int num_ranges)
 {
    stbtt_fontinfo info;
@@ -4147,9 +4449,13 @@ STBTT_DEF int stbtt_PackFontRanges(stbtt_pack_context *spc, const unsigned char
 
    n = stbtt_PackFontRangesGatherRects(spc, &info, ranges, num_ranges, rects);
 
-   stbtt_PackFontRangesPackRects(spc, rects, n);
+   if (spc->max_pages > 1) {
+      return_value = stbtt__PackFontRangesPaged(spc, &info, ranges, num_ranges, rects, n);
+   } else {
+      stbtt_PackFontRangesPackRects(spc, rects, n);
 
-   return_value = stbtt_PackFontRangesRenderIntoRects(spc, &info, ranges, num_ranges, rects);
+      return_value = stbtt_PackFontRangesRenderIntoRects(spc, &info, ranges, num_ranges, rects);
+   }
 
    STBTT_free(rects, spc->user_allocator_context);
    return return_value;
@@ -0,0 +1,123 @@
+// checksum_bench: prints the throughput of stbi_write_crc32 and
+// stbi_write_adler32 in GB/s over a range of buffer sizes, next to plain
+// byte-at-a-time versions, after checking that they all agree. CRC-32 is
+// timed both with PCLMULQDQ and with the slicing-by-8 tables it falls back
+// to; build with -DSTBIW_NO_SIMD for the scalar Adler-32.
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../stb_image_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_LEN (1 << 20)
+#define BYTES_PER_RUN (64 << 20)
+#define RUNS 7
+
+static unsigned int crc_table[256];
+
+static unsigned int crc32_bytewise(unsigned int crc, const unsigned char *p, int len)
+{
+   crc = ~crc;
+   while (len-- > 0)
+      crc = (crc >> 8) ^ crc_table[*p++ ^ (crc & 0xff)];
+   return ~crc;
+}
+
+static unsigned int adler32_bytewise(unsigned int adler, const unsigned char *p, int len)
+{
+   unsigned int s1 = adler & 0xffff, s2 = adler >> 16;
+   while (len > 0) {
+      int n = len < 5552 ? len : 5552;
+      len -= n;
+      while (n-- > 0) {
+         s1 += *p++;
+         s2 += s1;
+      }
+      s1 %= 65521;
+      s2 %= 65521;
+   }
+   return (s2 << 16) | s1;
+}
+
+typedef unsigned int checksum_func(unsigned int, const void *, int);
+
+static unsigned int crc32_ref(unsigned int crc, const void *p, int len) { return crc32_bytewise(crc, (const unsigned char *) p, len); }
+static unsigned int adler32_ref(unsigned int adler, const void *p, int len) { return adler32_bytewise(adler, (const unsigned char *) p, len); }
+
+static volatile unsigned int sink;
+
+static double bench(checksum_func *f, unsigned int init, const unsigned char *buf, int len)
+{
+   int r, i, reps = BYTES_PER_RUN / len;
+   double best = 1e30;
+   for (r=0; r < RUNS; ++r) {
+      struct timespec t0, t1;
+      double t;
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t0);
+      for (i=0; i < reps; ++i)
+         sink += f(init, buf, len);
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
+      t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+      if (t < best) best = t;
+   }
+   return (double) reps * len / best / 1e9;
+}
+
+int main(void)
+{
+   static const int sizes[] = { 64, 256, 4096, 65536, MAX_LEN };
+   unsigned char *buf = (unsigned char *) malloc(MAX_LEN);
+   unsigned int state = 1;
+   int i, j, failures = 0;
+
+   for (i=0; i < 256; ++i) {
+      unsigned int c = (unsigned int) i;
+      for (j=0; j < 8; ++j)
+         c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      crc_table[i] = c;
+   }
+   for (i=0; i < MAX_LEN; ++i) {
+      state = state * 1103515245u + 12345u;
+      buf[i] = (unsigned char) (state >> 16);
+   }
+
+   // odd lengths and offsets, split in two to exercise the running value;
+   // the second half of the cases with PCLMULQDQ turned off
+   for (i=0; i < 4000; ++i) {
+      int off = i % 61, len = (i * 7919) % (i % 2000 < 1000 ? 300 : 70000), split = len ? (i * 31) % len : 0;
+      const unsigned char *p = buf + off;
+      unsigned int crc, adler;
+#ifdef STBIW_PCLMUL
+      stbiw__pclmul_state = i < 2000 ? -1 : 0;
+#endif
+      crc = stbi_write_crc32(stbi_write_crc32(0, p, split), p + split, len - split);
+      adler = stbi_write_adler32(stbi_write_adler32(1, p, split), p + split, len - split);
+      if (crc != crc32_bytewise(0, p, len) || adler != adler32_bytewise(1, p, len)) {
+         printf("FAIL: length %d at offset %d split at %d\n", len, off, split);
+         ++failures;
+      }
+   }
+   if (failures) return 1;
+
+   printf("%-28s", "GB/s");
+   for (i=0; i < (int) (sizeof(sizes)/sizeof(sizes[0])); ++i)
+      printf(" %9d", sizes[i]);
+   printf("\n");
+   for (j=0; j < 5; ++j) {
+      static const char *names[] = { "crc32 bytewise", "crc32 slicing-by-8", "crc32 stbi_write_crc32", "adler32 bytewise", "adler32 stbi_write_adler32" };
+      checksum_func *f = j < 3 ? (j == 0 ? crc32_ref : stbi_write_crc32) : (j == 3 ? adler32_ref : stbi_write_adler32);
+#ifdef STBIW_PCLMUL
+      // the flag stbi_write_crc32 caches cpuid's answer in
+      stbiw__pclmul_state = j == 1 ? 0 : -1;
+#else
+      if (j == 1) continue;
+#endif
+      printf("%-28s", names[j]);
+      for (i=0; i < (int) (sizeof(sizes)/sizeof(sizes[0])); ++i)
+         printf(" %9.2f", bench(f, j < 3 ? 0 : 1, buf, sizes[i]));
+      printf("\n");
+   }
+   free(buf);
+   return 0;
+}
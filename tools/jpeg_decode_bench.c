@@ -0,0 +1,130 @@
+// jpeg_decode_bench: times stbi_load_from_memory on JPEGs with restart
+// markers, decoding with one thread and with several. With no files it
+// writes a 4096x3072 test image with stbi_write_jpg_restart_interval set to
+// 4 and to 0 (no markers, so always serial). Prints the best of several runs
+// in process CPU time and in wall time; on a machine with fewer cores than
+// threads only the CPU time is meaningful.
+#define STBI_THREADS
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../stb_image_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUNS 7
+
+typedef struct
+{
+   unsigned char *data;
+   int len, cap;
+} membuf;
+
+static void append(void *context, void *data, int size)
+{
+   membuf *m = (membuf *) context;
+   if (m->len + size > m->cap) {
+      m->cap = (m->len + size) * 2;
+      m->data = (unsigned char *) realloc(m->data, m->cap);
+   }
+   memcpy(m->data + m->len, data, size);
+   m->len += size;
+}
+
+static double now(clockid_t clock)
+{
+   struct timespec t;
+   clock_gettime(clock, &t);
+   return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+
+// smooth gradients with some noise, so the entropy decoder has real work
+static unsigned char *make_image(int w, int h)
+{
+   unsigned char *p = (unsigned char *) malloc((size_t) w*h*3);
+   unsigned int r = 1;
+   int x, y;
+   for (y=0; y < h; ++y) {
+      for (x=0; x < w; ++x) {
+         unsigned char *q = p + ((size_t) y*w + x)*3;
+         r = r * 1103515245u + 12345u;
+         q[0] = (unsigned char) (x * 255 / w + (r >> 28));
+         q[1] = (unsigned char) (y * 255 / h + ((r >> 24) & 15));
+         q[2] = (unsigned char) (((x ^ y) & 64) * 2 + ((r >> 20) & 15));
+      }
+   }
+   return p;
+}
+
+static void bench(const unsigned char *buf, int len, const char *name, int threads)
+{
+   int t;
+   printf("%s\n", name);
+   for (t=1; t <= threads; t = t < threads && t*2 > threads ? threads : t*2) {
+      double best_cpu = 1e30, best_wall = 1e30;
+      int i, w, h, n;
+      stbi_set_decode_threads(t);
+      for (i=0; i < RUNS; ++i) {
+         double c = now(CLOCK_PROCESS_CPUTIME_ID), wall = now(CLOCK_MONOTONIC);
+         stbi_uc *img = stbi_load_from_memory(buf, len, &w, &h, &n, 3);
+         c = now(CLOCK_PROCESS_CPUTIME_ID) - c;
+         wall = now(CLOCK_MONOTONIC) - wall;
+         if (!img) {
+            printf("   %s\n", stbi_failure_reason());
+            return;
+         }
+         stbi_image_free(img);
+         if (c < best_cpu) best_cpu = c;
+         if (wall < best_wall) best_wall = wall;
+      }
+      printf("   %2d thread%s: %8.1f ms cpu %8.1f ms wall\n", t, t == 1 ? " " : "s", best_cpu, best_wall);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   int i, threads = 4;
+   if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+      threads = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+   }
+   if (threads < 1) threads = 1;
+   if (argc < 2) {
+      static const int intervals[] = { 4, 0 };
+      int w = 4096, h = 3072;
+      unsigned char *img = make_image(w, h);
+      for (i=0; i < 2; ++i) {
+         membuf m = { NULL, 0, 0 };
+         char name[64];
+         stbi_write_jpg_restart_interval = intervals[i];
+         stbi_write_jpg_to_func(append, &m, w, h, 3, img, 90);
+         sprintf(name, "%dx%d, restart interval %d", w, h, intervals[i]);
+         bench(m.data, m.len, name, threads);
+         free(m.data);
+      }
+      free(img);
+      return 0;
+   }
+   for (i=1; i < argc; ++i) {
+      FILE *f = fopen(argv[i], "rb");
+      unsigned char *buf;
+      long len;
+      if (!f) {
+         printf("%s: can't open\n", argv[i]);
+         continue;
+      }
+      fseek(f, 0, SEEK_END);
+      len = ftell(f);
+      fseek(f, 0, SEEK_SET);
+      buf = (unsigned char *) malloc(len);
+      len = (long) fread(buf, 1, len, f);
+      fclose(f);
+      bench(buf, (int) len, argv[i], threads);
+      free(buf);
+   }
+   return 0;
+}
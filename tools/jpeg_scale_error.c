@@ -0,0 +1,52 @@
+// jpeg_scale_error: for each JPEG given, decodes it at 1/2, 1/4 and 1/8 with
+// stbi_load_scaled and prints the mean absolute difference from a full-size
+// decode box-filtered down to the same size, in 8-bit levels.
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <math.h>
+
+int main(int argc, char **argv)
+{
+   int i, s;
+   if (argc < 2) {
+      printf("usage: %s file.jpg...\n", argv[0]);
+      return 2;
+   }
+   for (i=1; i < argc; ++i) {
+      int w, h, n;
+      stbi_uc *full = stbi_load(argv[i], &w, &h, &n, 3);
+      if (!full) {
+         printf("%s: %s\n", argv[i], stbi_failure_reason());
+         continue;
+      }
+      printf("%s (%dx%d)", argv[i], w, h);
+      for (s=2; s <= 8; s *= 2) {
+         int sw, sh, x, y, k;
+         double err = 0;
+         stbi_uc *small = stbi_load_scaled(argv[i], &sw, &sh, &n, 3, s);
+         if (!small) {
+            printf("  1/%d: %s", s, stbi_failure_reason());
+            continue;
+         }
+         for (y=0; y < sh; ++y) {
+            for (x=0; x < sw; ++x) {
+               for (k=0; k < 3; ++k) {
+                  int xx, yy, cnt = 0;
+                  double sum = 0;
+                  for (yy=y*s; yy < y*s+s && yy < h; ++yy)
+                     for (xx=x*s; xx < x*s+s && xx < w; ++xx, ++cnt)
+                        sum += full[(yy*w + xx)*3 + k];
+                  err += fabs(sum/cnt - small[(y*sw + x)*3 + k]);
+               }
+            }
+         }
+         printf("  1/%d: %.2f", s, err / ((double) sw*sh*3));
+         stbi_image_free(small);
+      }
+      printf("\n");
+      stbi_image_free(full);
+   }
+   return 0;
+}
@@ -0,0 +1,104 @@
+// jpeg_thread_check: decodes each JPEG given on the command line, plus a few
+// hundred corrupted copies of it, with one thread and with four, and checks
+// that both succeed or fail together with the same pixels. Only scans with
+// restart markers take the threaded path, so give it files that have them.
+#define STBI_THREADS
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MUTATIONS 200
+
+static unsigned int rng_state = 1;
+static unsigned int rng(void)
+{
+   rng_state = rng_state * 1103515245u + 12345u;
+   return rng_state >> 8;
+}
+
+// overwrite, 0xff-fill or delete a few bytes, favouring the ones just before
+// a restart marker, then sometimes truncate
+static int mutate(unsigned char *d, int len)
+{
+   int i, k = 1 + rng() % 4;
+   for (i=0; i < k && len > 2; ++i) {
+      int pos = rng() % len, r = rng() % 8, j;
+      if (r < 4) {
+         for (j=pos; j+1 < len; ++j)
+            if (d[j] == 0xff && d[j+1] >= 0xd0 && d[j+1] <= 0xd7) break;
+         if (j+1 < len) {
+            int back = (int) (rng() % 4);
+            pos = j > back ? j - back : 0;
+         }
+      }
+      if (r == 0 || r == 4)
+         d[pos] = 0xff;
+      else if (r == 1 || r == 5) {
+         int n = 1 + rng() % 4;
+         if (pos + n > len) n = len - pos;
+         memmove(d + pos, d + pos + n, len - pos - n);
+         len -= n;
+      } else
+         d[pos] = (unsigned char) rng();
+   }
+   if (rng() % 8 == 0)
+      len = len/2 + (int) (rng() % (len/2 + 1));
+   return len;
+}
+
+static int compare(const unsigned char *buf, int len, const char *name, int index)
+{
+   int w1, h1, c1, w2, h2, c2, bad = 0;
+   unsigned char *a, *b;
+   stbi_set_decode_threads(1);
+   a = stbi_load_from_memory(buf, len, &w1, &h1, &c1, 3);
+   stbi_set_decode_threads(4);
+   b = stbi_load_from_memory(buf, len, &w2, &h2, &c2, 3);
+   if (!a != !b) {
+      printf("FAIL: %s (mutation %d): one thread %s, four threads %s\n", name, index, a ? "ok" : "failed", b ? "ok" : "failed");
+      bad = 1;
+   } else if (a && (w1 != w2 || h1 != h2 || memcmp(a, b, (size_t) w1*h1*3) != 0)) {
+      printf("FAIL: %s (mutation %d): pixels differ\n", name, index);
+      bad = 1;
+   }
+   stbi_image_free(a);
+   stbi_image_free(b);
+   return bad;
+}
+
+int main(int argc, char **argv)
+{
+   int i, m, failures = 0, runs = 0;
+   if (argc < 2) {
+      printf("usage: %s file.jpg...\n", argv[0]);
+      return 2;
+   }
+   for (i=1; i < argc; ++i) {
+      unsigned char *orig, *work;
+      long size;
+      FILE *f = fopen(argv[i], "rb");
+      if (!f) { printf("can't open %s\n", argv[i]); return 2; }
+      fseek(f, 0, SEEK_END);
+      size = ftell(f);
+      fseek(f, 0, SEEK_SET);
+      orig = (unsigned char *) malloc(size);
+      work = (unsigned char *) malloc(size);
+      if (fread(orig, 1, size, f) != (size_t) size) { printf("can't read %s\n", argv[i]); return 2; }
+      fclose(f);
+      failures += compare(orig, (int) size, argv[i], -1);
+      ++runs;
+      for (m=0; m < MUTATIONS; ++m) {
+         rng_state = (unsigned int) (i * 7919 + m);
+         memcpy(work, orig, size);
+         failures += compare(work, mutate(work, (int) size), argv[i], m);
+         ++runs;
+      }
+      free(orig);
+      free(work);
+   }
+   printf("%d decodes compared, %d mismatches\n", runs, failures);
+   return failures != 0;
+}
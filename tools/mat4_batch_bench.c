@@ -0,0 +1,134 @@
+// mat4_batch_bench: times m_mat4_mul_batch, m_mat4_transform3_batch and
+// m_mat4_transform4_batch against loops over m_mat4_mul, m_mat4_transform3
+// and m_mat4_transform4, for a batch that fits in L1 and one that only fits
+// in memory, and checks that both give the same floats. Prints nanoseconds
+// per element (best of several runs, process CPU time). The batch functions
+// use SSE by default; build with -mavx for the AVX loops or -DM_NO_SIMD for
+// plain C.
+#define M_MATH_IMPLEMENTATION
+#include "../m_math.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RUNS 7
+#define ELEMENTS_PER_RUN (1 << 22)
+
+static double now(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+   return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static float *make_floats(int n)
+{
+   float *p = (float *) m_aligned_malloc(n * sizeof(float));
+   int i;
+   for (i = 0; i < n; i++)
+      p[i] = (float) (rand() % 2001 - 1000) / 100.0f;
+   return p;
+}
+
+static void mul_loop(float *dest, const float *A, const float *B, int count)
+{
+   int i;
+   for (i = 0; i < count; i++)
+      m_mat4_mul(dest + i * 16, A, B + i * 16);
+}
+
+static void transform3_loop(float *dx, float *dy, float *dz, const float *m, const float *x, const float *y, const float *z, int count)
+{
+   int i;
+   for (i = 0; i < count; i++) {
+      float3 src, dest;
+      src.x = x[i]; src.y = y[i]; src.z = z[i];
+      m_mat4_transform3(&dest, m, &src);
+      dx[i] = dest.x; dy[i] = dest.y; dz[i] = dest.z;
+   }
+}
+
+static void transform4_loop(float *dx, float *dy, float *dz, float *dw, const float *m, const float *x, const float *y, const float *z, const float *w, int count)
+{
+   int i;
+   for (i = 0; i < count; i++) {
+      float4 src, dest;
+      src.x = x[i]; src.y = y[i]; src.z = z[i]; src.w = w[i];
+      m_mat4_transform4(&dest, m, &src);
+      dx[i] = dest.x; dy[i] = dest.y; dz[i] = dest.z; dw[i] = dest.w;
+   }
+}
+
+// 0: mul, 1: transform3, 2: transform4; the batch function or the scalar loop
+static void run(int what, int batch, float **d, float **s, const float *m, int count)
+{
+   switch (what) {
+   case 0:
+      if (batch) m_mat4_mul_batch(d[0], m, s[0], count);
+      else mul_loop(d[0], m, s[0], count);
+      break;
+   case 1:
+      if (batch) m_mat4_transform3_batch(d[0], d[1], d[2], m, s[0], s[1], s[2], count);
+      else transform3_loop(d[0], d[1], d[2], m, s[0], s[1], s[2], count);
+      break;
+   default:
+      if (batch) m_mat4_transform4_batch(d[0], d[1], d[2], d[3], m, s[0], s[1], s[2], s[3], count);
+      else transform4_loop(d[0], d[1], d[2], d[3], m, s[0], s[1], s[2], s[3], count);
+      break;
+   }
+}
+
+int main(void)
+{
+   static const char *names[3] = { "mat4_mul", "mat4_transform3", "mat4_transform4" };
+   static const int counts[2] = { 64, 1 << 18 };
+   float *m = make_floats(16);
+   int what, c, failures = 0;
+
+   printf("%-16s %9s %12s %12s %8s\n", "ns/element", "count", "scalar loop", "batch", "speedup");
+   for (what = 0; what < 3; what++) {
+      for (c = 0; c < 2; c++) {
+         int count = counts[c], arrays = what == 0 ? 1 : what + 2, len = what == 0 ? count * 16 : count;
+         int reps = ELEMENTS_PER_RUN / count, k, r, b;
+         float *s[4], *d[4], *ref[4];
+         double best[2] = { 1e30, 1e30 };
+         for (k = 0; k < arrays; k++) {
+            s[k] = make_floats(len);
+            d[k] = (float *) m_aligned_malloc(len * sizeof(float));
+            ref[k] = (float *) m_aligned_malloc(len * sizeof(float));
+         }
+
+         run(what, 0, ref, s, m, count);
+         run(what, 1, d, s, m, count);
+         for (k = 0; k < arrays; k++) {
+            if (memcmp(d[k], ref[k], len * sizeof(float)) != 0) {
+               printf("FAIL: %s, %d elements: batch and scalar results differ\n", names[what], count);
+               failures++;
+               break;
+            }
+         }
+
+         // alternate the two so both see the same machine state
+         for (r = 0; r < RUNS; r++) {
+            for (b = 0; b < 2; b++) {
+               double t = now();
+               for (k = 0; k < reps; k++)
+                  run(what, b, d, s, m, count);
+               t = (now() - t) / ((double) reps * count);
+               if (t < best[b]) best[b] = t;
+            }
+         }
+         printf("%-16s %9d %12.2f %12.2f %7.2fx\n", names[what], count, best[0], best[1], best[0] / best[1]);
+
+         for (k = 0; k < arrays; k++) {
+            m_aligned_free(s[k]);
+            m_aligned_free(d[k]);
+            m_aligned_free(ref[k]);
+         }
+      }
+   }
+   m_aligned_free(m);
+   return failures != 0;
+}
@@ -0,0 +1,133 @@
+// png_unfilter_fuzz: encodes random 8-bit images as PNGs with a random
+// filter on each row, decodes them with stbi_load_from_memory, as stored and
+// with RGB expanded to RGBA, and checks that the pixels come back exactly.
+// Narrow and wide rows both go through the SIMD unfilter (SSE2, or NEON when
+// built with STBI_NEON), its vector loops and its per-pixel tails; building
+// with -DSTBI_NO_SIMD checks the scalar path against the same images.
+// Exits non-zero on any mismatch.
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../stb_image_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGES 20000
+
+static unsigned int rng_state = 1;
+static unsigned int rng(void)
+{
+   rng_state = rng_state * 1103515245u + 12345u;
+   return rng_state >> 8;
+}
+
+static int paeth(int a, int b, int c)
+{
+   int p = a + b - c, pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+static unsigned char *put32(unsigned char *o, unsigned int v)
+{
+   o[0] = (unsigned char) (v >> 24);
+   o[1] = (unsigned char) (v >> 16);
+   o[2] = (unsigned char) (v >> 8);
+   o[3] = (unsigned char) v;
+   return o + 4;
+}
+
+static unsigned char *chunk(unsigned char *o, const char *type, const unsigned char *data, int len)
+{
+   unsigned char *start = o + 4;
+   o = put32(o, len);
+   memcpy(o, type, 4);
+   if (len)
+      memcpy(o + 4, data, len);
+   o += 4 + len;
+   return put32(o, stbiw__crc32(start, len + 4));
+}
+
+// filters each row of img with a random filter, or 'only' if it's 0..4, and
+// wraps the result up as a PNG
+static unsigned char *make_png(const unsigned char *img, int w, int h, int n, int only, int *out_len)
+{
+   static const int color[5] = { 0, 0, 4, 2, 6 };
+   int stride = w*n, x, y, zlen;
+   unsigned char *filt = (unsigned char *) malloc((size_t) (stride+1)*h), *z, *png, *o;
+   unsigned char ihdr[13];
+   for (y=0; y < h; ++y) {
+      const unsigned char *cur = img + y*stride, *prior = y ? cur - stride : NULL;
+      unsigned char *f = filt + y*(stride+1);
+      f[0] = (unsigned char) (only >= 0 ? only : (int) (rng() % 5));
+      for (x=0; x < stride; ++x) {
+         int a = x >= n ? cur[x-n] : 0, b = prior ? prior[x] : 0, c = prior && x >= n ? prior[x-n] : 0, pred = 0;
+         switch (f[0]) {
+            case 1: pred = a; break;
+            case 2: pred = b; break;
+            case 3: pred = (a + b) >> 1; break;
+            case 4: pred = paeth(a, b, c); break;
+         }
+         f[1+x] = (unsigned char) (cur[x] - pred);
+      }
+   }
+   z = stbi_zlib_compress(filt, (stride+1)*h, &zlen, 1);
+   free(filt);
+   o = png = (unsigned char *) malloc(8 + 25 + 12 + zlen + 12);
+   memcpy(o, "\x89PNG\r\n\x1a\n", 8);
+   put32(ihdr, w);
+   put32(ihdr+4, h);
+   ihdr[8] = 8;
+   ihdr[9] = (unsigned char) color[n];
+   ihdr[10] = ihdr[11] = ihdr[12] = 0;
+   o = chunk(o + 8, "IHDR", ihdr, 13);
+   o = chunk(o, "IDAT", z, zlen);
+   o = chunk(o, "IEND", NULL, 0);
+   STBIW_FREE(z);
+   *out_len = (int) (o - png);
+   return png;
+}
+
+static int check(const unsigned char *png, int len, const unsigned char *img, int w, int h, int n, int req)
+{
+   int x, y, k, ow, oh, on, out_n = req ? req : n;
+   stbi_uc *out = stbi_load_from_memory(png, len, &ow, &oh, &on, req);
+   int bad = !out || ow != w || oh != h || on != n;
+   for (y=0; y < h && !bad; ++y)
+      for (x=0; x < w && !bad; ++x)
+         for (k=0; k < out_n; ++k)
+            if (out[(y*w + x)*out_n + k] != (k < n ? img[(y*w + x)*n + k] : 255))
+               bad = 1;
+   if (bad)
+      printf("FAIL: %dx%d, %d channels, req_comp %d: %s\n", w, h, n, req, out ? "pixels differ" : stbi_failure_reason());
+   stbi_image_free(out);
+   return bad;
+}
+
+int main(void)
+{
+   int i, failures = 0;
+   for (i=0; i < IMAGES && failures < 10; ++i) {
+      // mostly the 3 and 4 channel images the SIMD path takes, at widths
+      // around its 4 and 5 pixel vectors, and sometimes wider
+      int n = rng() % 8 ? 3 + rng() % 2 : 1 + rng() % 2;
+      int w = 1 + rng() % (i & 1 ? 70 : 12), h = 1 + rng() % 5;
+      int only = rng() % 3 ? -1 : (int) (rng() % 5), len, k;
+      unsigned char *img, *png;
+      if (i % 64 == 0) w = 200 + rng() % 900;
+      img = (unsigned char *) malloc((size_t) w*h*n);
+      for (k=0; k < w*h*n; ++k)
+         img[k] = (unsigned char) rng();
+      png = make_png(img, w, h, n, only, &len);
+      failures += check(png, len, img, w, h, n, 0);
+      if (n == 3)
+         failures += check(png, len, img, w, h, n, 4);
+      free(png);
+      free(img);
+   }
+   printf("%s\n", failures ? "png_unfilter_fuzz failed" : "png_unfilter_fuzz passed");
+   return failures != 0;
+}
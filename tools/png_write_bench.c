@@ -0,0 +1,112 @@
+// png_write_bench: times stbi_write_png_to_mem with one thread and with
+// several, on two generated 2048x2048 RGBA images (a mostly-empty sprite
+// atlas and a noisy screenshot-like gradient) or on the images given on the
+// command line, and checks that every result decodes back to the input.
+// Prints the best of several runs in process CPU time and in wall time, plus
+// the output size. Build with -DSTBIW_NO_SIMD to compare the scalar filters.
+#define STBIW_THREADS
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#define RUNS 5
+
+static double now(clockid_t clock)
+{
+   struct timespec t;
+   clock_gettime(clock, &t);
+   return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+}
+
+static unsigned char *make_image(int w, int h, int screenshot)
+{
+   unsigned char *p = (unsigned char *) malloc((size_t) w*h*4);
+   unsigned int r = 5;
+   int x, y;
+   for (y=0; y < h; ++y) {
+      for (x=0; x < w; ++x) {
+         unsigned char *q = p + ((size_t) y*w + x)*4;
+         r = r * 1103515245u + 12345u;
+         if (screenshot) {
+            q[0] = (unsigned char) (x/8 + ((r >> 16) & 7));
+            q[1] = (unsigned char) (y/8 + ((r >> 24) & 7));
+            q[2] = (unsigned char) ((x+y)/16);
+            q[3] = 255;
+         } else {
+            int gx = x % 48 - 24, gy = y % 64 - 32;
+            double d = sqrt(gx*gx + gy*gy*0.5);
+            q[0] = q[1] = q[2] = 255;
+            q[3] = d < 14 ? (unsigned char) (255 - d*8) : 0;
+         }
+      }
+   }
+   return p;
+}
+
+static int bench(const unsigned char *img, int w, int h, int n, const char *name, int threads)
+{
+   int t, bad = 0;
+   printf("%s (%dx%d, %d channels)\n", name, w, h, n);
+   for (t=1; t <= threads; t = t < threads && t*2 > threads ? threads : t*2) {
+      double best_cpu = 1e30, best_wall = 1e30;
+      int i, len = 0;
+      stbi_write_png_threads = t;
+      for (i=0; i < RUNS; ++i) {
+         double c = now(CLOCK_PROCESS_CPUTIME_ID), wall = now(CLOCK_MONOTONIC);
+         unsigned char *png = stbi_write_png_to_mem(img, w*n, w, h, n, &len);
+         c = now(CLOCK_PROCESS_CPUTIME_ID) - c;
+         wall = now(CLOCK_MONOTONIC) - wall;
+         if (c < best_cpu) best_cpu = c;
+         if (wall < best_wall) best_wall = wall;
+         if (i == 0) {
+            int w2, h2, n2;
+            stbi_uc *back = png ? stbi_load_from_memory(png, len, &w2, &h2, &n2, n) : NULL;
+            if (!back || w2 != w || h2 != h || memcmp(back, img, (size_t) w*h*n) != 0) {
+               printf("   FAIL: %d thread%s: output doesn't decode to the input\n", t, t == 1 ? "" : "s");
+               bad = 1;
+            }
+            stbi_image_free(back);
+         }
+         STBIW_FREE(png);
+      }
+      printf("   %2d thread%s: %8.1f ms cpu %8.1f ms wall %10d bytes\n", t, t == 1 ? " " : "s", best_cpu, best_wall, len);
+   }
+   return bad;
+}
+
+int main(int argc, char **argv)
+{
+   int i, threads = 4, failures = 0;
+   if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+      threads = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+   }
+   if (threads < 1) threads = 1;
+   if (argc < 2) {
+      for (i=0; i < 2; ++i) {
+         unsigned char *img = make_image(2048, 2048, i);
+         failures += bench(img, 2048, 2048, 4, i ? "screenshot" : "atlas", threads);
+         free(img);
+      }
+      return failures != 0;
+   }
+   for (i=1; i < argc; ++i) {
+      int w, h, n;
+      stbi_uc *img = stbi_load(argv[i], &w, &h, &n, 0);
+      if (!img) {
+         printf("%s: %s\n", argv[i], stbi_failure_reason());
+         continue;
+      }
+      failures += bench(img, w, h, n, argv[i], threads);
+      stbi_image_free(img);
+   }
+   return failures != 0;
+}
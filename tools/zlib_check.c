@@ -0,0 +1,37 @@
+// zlib_check: round-trips buffers of awkward sizes through stbi_zlib_compress
+// and stbi_zlib_decode_malloc_guesssize, including an initial size of 0,
+// which must still grow the output buffer. Exits non-zero on any mismatch.
+#define STB_IMAGE_IMPLEMENTATION
+#include "../stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../stb_image_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(void)
+{
+   static const int sizes[] = { 0, 1, 2, 7, 100, 273, 274, 275, 1000, 65536, 99999 };
+   static const int initial[] = { 0, 1, 16384 };
+   unsigned char *src = (unsigned char *) malloc(100000);
+   int i, j, failures = 0;
+   for (i=0; i < 100000; ++i)
+      src[i] = (unsigned char) ((i*7) ^ (i >> 5));
+   for (i=0; i < (int) (sizeof(sizes)/sizeof(sizes[0])); ++i) {
+      for (j=0; j < (int) (sizeof(initial)/sizeof(initial[0])); ++j) {
+         int clen, n = -1;
+         unsigned char *c = stbi_zlib_compress(src, sizes[i], &clen, 8);
+         char *d = stbi_zlib_decode_malloc_guesssize((char *) c, clen, initial[j], &n);
+         if (d == NULL || n != sizes[i] || memcmp(d, src, n) != 0) {
+            printf("FAIL: %d bytes, initial size %d: %s\n", sizes[i], initial[j], d ? "output differs" : stbi_failure_reason());
+            ++failures;
+         }
+         free(d);
+         free(c);
+      }
+   }
+   free(src);
+   printf("%s\n", failures ? "zlib_check failed" : "zlib_check passed");
+   return failures != 0;
+}